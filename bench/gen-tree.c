@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// gen-tree creates a source tree and a destination tree that is a former copy of it, for benchmarks of
+// lp25-backup. Both trees only depend on the options and the seed, so two runs create the same files.
+// Each file of the source is identical in the destination, modified since (other content, older date and,
+// for half of them, another size) or new (missing from the destination).
+
+#define GEN_PATH_SIZE 4096
+#define GEN_WRITE_SIZE (64 * 1024)
+#define GEN_BASE_TIME 1600000000
+
+typedef enum {
+    SIZES_FIXED, // Every file has max_size bytes
+    SIZES_UNIFORM, // Uniform between min_size and max_size
+    SIZES_LOG, // Uniform power of two, then uniform in it: many small files, a few large ones
+} size_distribution_t;
+
+typedef struct {
+    uint32_t files_count;
+    uint32_t depth;
+    uint32_t fan_out;
+    uint64_t min_size;
+    uint64_t max_size;
+    size_distribution_t size_distribution;
+    uint32_t modified_percent;
+    uint32_t new_percent;
+    uint64_t seed;
+    bool skips_source;
+    char *source;
+    char *destination;
+} generator_configuration_t;
+
+typedef enum {
+    FILE_IDENTICAL,
+    FILE_MODIFIED,
+    FILE_NEW,
+} file_state_t;
+
+/*!
+ * @brief display_help displays the usage of the generator
+ * @param my_name is the name of the binary file
+ */
+static void display_help(char *my_name) {
+    printf("%s [options] source_dir destination_dir\n", my_name);
+    printf("Options: \t--files <count> number of files of the source (default 10000)\n");
+    printf("         \t--depth <levels> levels of directories below the root (default 3)\n");
+    printf("         \t--fan-out <count> subdirectories of each directory (default 4)\n");
+    printf("         \t--min-size <bytes> smallest file size (default 0)\n");
+    printf("         \t--max-size <bytes> largest file size (default 131072)\n");
+    printf("         \t--size-distribution <fixed|uniform|log> distribution of the file sizes (default log)\n");
+    printf("         \t--modified <percent> files of the destination older than the source (default 10)\n");
+    printf("         \t--new <percent> files of the source missing from the destination (default 10)\n");
+    printf("         \t--seed <number> seed of the generated trees (default 1)\n");
+    printf("         \t--destination-only creates the destination only, the source already exists\n");
+    printf("Both directories must not exist, the remaining files are identical in both trees.\n");
+}
+
+/*!
+ * @brief next_random returns the next number of a xorshift64* generator
+ * @param state is a pointer to the state of the generator, never 0
+ * @return a pseudo random number
+ */
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/*!
+ * @brief seed_random makes the state of a generator from a seed and up to two numbers (splitmix64)
+ * @param seed is the seed of the trees
+ * @param first is the first number, such as a file index
+ * @param second is the second number, such as a content variant
+ * @return a state for next_random
+ */
+static uint64_t seed_random(uint64_t seed, uint64_t first, uint64_t second) {
+    uint64_t state = seed ^ (first * 0x9E3779B97F4A7C15ULL) ^ (second * 0xC2B2AE3D27D4EB4FULL);
+    state += 0x9E3779B97F4A7C15ULL;
+    state = (state ^ (state >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    state = (state ^ (state >> 27)) * 0x94D049BB133111EBULL;
+    state ^= state >> 31;
+    return state ? state : 1;
+}
+
+/*!
+ * @brief pick_size draws the size of a file
+ * @param config is a pointer to the generator configuration
+ * @param state is a pointer to the random state of the file
+ * @return the size in bytes
+ */
+static uint64_t pick_size(generator_configuration_t *config, uint64_t *state) {
+    uint64_t range = config->max_size - config->min_size;
+    switch (config->size_distribution) {
+        case SIZES_FIXED:
+            return config->max_size;
+        case SIZES_UNIFORM:
+            return config->min_size + next_random(state) % (range + 1);
+        case SIZES_LOG:
+        default: {
+            int bits = 0;
+            while (bits < 64 && (range >> bits) != 0) {
+                ++bits;
+            }
+            int chosen_bits = (int)(next_random(state) % (uint64_t)(bits + 1));
+            if (chosen_bits == 0) {
+                return config->min_size;
+            }
+            uint64_t low = 1ULL << (chosen_bits - 1);
+            uint64_t size = low + next_random(state) % low;
+            return config->min_size + (size > range ? range : size);
+        }
+    }
+}
+
+/*!
+ * @brief list_directories lists the directories of a tree, parents first
+ * Level k holds fan_out^k directories named d<index>, nested in the level k-1.
+ * @param config is a pointer to the generator configuration
+ * @param directories is the list to fill with paths relative to the root, directories[0] being the root itself
+ * @param directories_count is the number of directories
+ * @return 0 in case of success, -1 else
+ */
+static int list_directories(generator_configuration_t *config, char **directories, size_t directories_count) {
+    directories[0] = strdup("");
+    if (!directories[0]) {
+        return -1;
+    }
+    for (size_t i=1; i<directories_count; ++i) {
+        size_t parent = (i - 1) / config->fan_out;
+        directories[i] = malloc(GEN_PATH_SIZE);
+        if (!directories[i]) {
+            return -1;
+        }
+        snprintf(directories[i], GEN_PATH_SIZE, "%s%sd%zu", directories[parent], (parent == 0) ? "" : "/", (i - 1) % config->fan_out);
+    }
+    return 0;
+}
+
+/*!
+ * @brief make_directories creates the root and the directories of a tree
+ * @param root is the root of the tree
+ * @param directories is the list of the directories, @see list_directories
+ * @param directories_count is the number of directories
+ * @return 0 in case of success, -1 else
+ */
+static int make_directories(char *root, char **directories, size_t directories_count) {
+    char path[GEN_PATH_SIZE];
+    if (mkdir(root, 0755) == -1) {
+        perror(root);
+        return -1;
+    }
+    for (size_t i=1; i<directories_count; ++i) {
+        snprintf(path, GEN_PATH_SIZE, "%s/%s", root, directories[i]);
+        if (mkdir(path, 0755) == -1) {
+            perror(path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*!
+ * @brief write_file creates a file filled with pseudo random bytes
+ * @param path is the path of the file, which must not exist
+ * @param size is the size of the file
+ * @param content_seed is the random state of its content, the same seed gives the same content
+ * @param mtime is the modification date of the file
+ * @param buffer is a buffer of GEN_WRITE_SIZE bytes
+ * @return 0 in case of success, -1 else
+ */
+static int write_file(char *path, uint64_t size, uint64_t content_seed, time_t mtime, uint64_t *buffer) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+    uint64_t state = content_seed;
+    uint64_t written = 0;
+    while (written < size) {
+        size_t length = (size - written < GEN_WRITE_SIZE) ? (size_t)(size - written) : GEN_WRITE_SIZE;
+        for (size_t i=0; i<(length + 7) / 8; ++i) {
+            buffer[i] = next_random(&state);
+        }
+        ssize_t result = write(fd, buffer, length);
+        if (result <= 0) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        written += (uint64_t)result;
+    }
+    struct timespec times[2] = {{.tv_sec = mtime, .tv_nsec = 0}, {.tv_sec = mtime, .tv_nsec = 0}};
+    if (futimens(fd, times) == -1) {
+        perror(path);
+    }
+    close(fd);
+    return 0;
+}
+
+/*!
+ * @brief generate_trees creates the files of the source and the destination
+ * @param config is a pointer to the generator configuration
+ * @return 0 in case of success, -1 else
+ */
+static int generate_trees(generator_configuration_t *config) {
+    size_t directories_count = 1;
+    size_t level_count = 1;
+    for (uint32_t level=0; level<config->depth; ++level) {
+        level_count *= config->fan_out;
+        directories_count += level_count;
+        if (directories_count > config->files_count + 1 && directories_count > 1024) {
+            fprintf(stderr, "Too many directories for %u files, reduce --depth or --fan-out\n", config->files_count);
+            return -1;
+        }
+    }
+    char **directories = calloc(directories_count, sizeof(char *));
+    uint64_t *buffer = malloc(GEN_WRITE_SIZE);
+    if (!directories || !buffer) {
+        free(directories);
+        free(buffer);
+        return -1;
+    }
+    int result = list_directories(config, directories, directories_count);
+    if (result == 0 && !config->skips_source) {
+        result = make_directories(config->source, directories, directories_count);
+    }
+    if (result == 0) {
+        result = make_directories(config->destination, directories, directories_count);
+    }
+    char path[GEN_PATH_SIZE];
+    uint64_t sizes[3] = {0, 0, 0};
+    uint32_t counts[3] = {0, 0, 0};
+    for (uint32_t i=0; result == 0 && i<config->files_count; ++i) {
+        uint64_t state = seed_random(config->seed, i, 0);
+        uint64_t size = pick_size(config, &state);
+        uint32_t draw = (uint32_t)(next_random(&state) % 100);
+        file_state_t file_state = FILE_IDENTICAL;
+        if (draw < config->modified_percent) {
+            file_state = FILE_MODIFIED;
+        } else if (draw < config->modified_percent + config->new_percent) {
+            file_state = FILE_NEW;
+        }
+        char *directory = directories[i % directories_count];
+        time_t mtime = GEN_BASE_TIME + i;
+        if (!config->skips_source) {
+            snprintf(path, GEN_PATH_SIZE, "%s%s%s/f%07u", config->source, *directory ? "/" : "", directory, i);
+            if (write_file(path, size, seed_random(config->seed, i, 1), mtime, buffer) == -1) {
+                result = -1;
+                break;
+            }
+        }
+        snprintf(path, GEN_PATH_SIZE, "%s%s%s/f%07u", config->destination, *directory ? "/" : "", directory, i);
+        if (file_state == FILE_IDENTICAL) {
+            result = write_file(path, size, seed_random(config->seed, i, 1), mtime, buffer);
+        } else if (file_state == FILE_MODIFIED) {
+            uint64_t former_size = (i % 2 == 0) ? size : size / 2 + 1;
+            result = write_file(path, former_size, seed_random(config->seed, i, 2), mtime - 86400, buffer);
+        }
+        sizes[file_state] += size;
+        ++counts[file_state];
+    }
+    for (size_t i=0; i<directories_count; ++i) {
+        free(directories[i]);
+    }
+    free(directories);
+    free(buffer);
+    if (result == 0) {
+        printf("%zu directories, %u identical files (%llu bytes), %u modified (%llu bytes), %u new (%llu bytes)\n",
+               directories_count, counts[FILE_IDENTICAL], (unsigned long long)sizes[FILE_IDENTICAL],
+               counts[FILE_MODIFIED], (unsigned long long)sizes[FILE_MODIFIED],
+               counts[FILE_NEW], (unsigned long long)sizes[FILE_NEW]);
+    }
+    return result;
+}
+
+/*!
+ * @brief main parses the options and creates the trees
+ * @param argc its number of arguments, including its own name
+ * @param argv the array of arguments
+ * @return 0 in case of success, 1 else
+ */
+int main(int argc, char *argv[]) {
+    generator_configuration_t config = {
+            .files_count = 10000,
+            .depth = 3,
+            .fan_out = 4,
+            .min_size = 0,
+            .max_size = 128 * 1024,
+            .size_distribution = SIZES_LOG,
+            .modified_percent = 10,
+            .new_percent = 10,
+            .seed = 1,
+            .skips_source = false,
+    };
+    struct option my_opts[] = {
+            {.name="files", .has_arg=1, .flag=0, .val='f'},
+            {.name="depth", .has_arg=1, .flag=0, .val='d'},
+            {.name="fan-out", .has_arg=1, .flag=0, .val='o'},
+            {.name="min-size", .has_arg=1, .flag=0, .val='m'},
+            {.name="max-size", .has_arg=1, .flag=0, .val='M'},
+            {.name="size-distribution", .has_arg=1, .flag=0, .val='z'},
+            {.name="modified", .has_arg=1, .flag=0, .val='u'},
+            {.name="new", .has_arg=1, .flag=0, .val='a'},
+            {.name="seed", .has_arg=1, .flag=0, .val='s'},
+            {.name="destination-only", .has_arg=0, .flag=0, .val='D'},
+            {.name=0, .has_arg=0, .flag=0, .val=0}, // last element must be zero
+    };
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, "h", my_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'f':
+                config.files_count = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                config.depth = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                config.fan_out = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                config.min_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'M':
+                config.max_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'z':
+                if (strcmp(optarg, "fixed") == 0) {
+                    config.size_distribution = SIZES_FIXED;
+                } else if (strcmp(optarg, "uniform") == 0) {
+                    config.size_distribution = SIZES_UNIFORM;
+                } else if (strcmp(optarg, "log") == 0) {
+                    config.size_distribution = SIZES_LOG;
+                } else {
+                    fprintf(stderr, "Unknown size distribution %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'u':
+                config.modified_percent = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'a':
+                config.new_percent = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                config.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'D':
+                config.skips_source = true;
+                break;
+            case 'h':
+                display_help(argv[0]);
+                return 0;
+            default:
+                display_help(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        display_help(argv[0]);
+        return 1;
+    }
+    config.source = argv[optind];
+    config.destination = argv[optind + 1];
+    if (config.fan_out == 0) {
+        config.depth = 0;
+    }
+    if (config.min_size > config.max_size || config.modified_percent + config.new_percent > 100) {
+        fprintf(stderr, "Inconsistent sizes or percentages\n");
+        return 1;
+    }
+    return (generate_trees(&config) == 0) ? 0 : 1;
+}
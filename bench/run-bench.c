@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// run-bench generates a source and a destination tree with gen-tree, then runs lp25-backup on them in several
+// configurations. Before each run, the destination is generated again so every run has the same work to do.
+// Peak RSS is the one returned by wait4: the largest resident set among lp25-backup and the processes it waited
+// for, not their sum.
+
+#define BENCH_PATH_SIZE 4096
+#define BENCH_MAX_ARGUMENTS 64
+
+typedef struct {
+    char *binary;
+    char *generator;
+    char *work_dir;
+    char *processes_count;
+    int runs_count;
+    char *generator_arguments[BENCH_MAX_ARGUMENTS]; // Options passed as is to gen-tree
+    int generator_arguments_count;
+    char source[BENCH_PATH_SIZE];
+    char destination[BENCH_PATH_SIZE];
+} bench_configuration_t;
+
+typedef struct {
+    char *name;
+    char *options[4]; // NULL terminated, "-n" is followed by the processes count
+} bench_case_t;
+
+typedef struct {
+    double wall_seconds; // Fastest run
+    long peak_rss_kib; // Largest over the runs
+    int failed_runs;
+} bench_result_t;
+
+static uint64_t source_files_count = 0;
+static uint64_t source_bytes = 0;
+
+/*!
+ * @brief display_help displays the usage of the harness
+ * @param my_name is the name of the binary file
+ */
+static void display_help(char *my_name) {
+    printf("%s [options]\n", my_name);
+    printf("Options: \t--binary <path> lp25-backup binary (default ./lp25-backup)\n");
+    printf("         \t--generator <path> gen-tree binary (default ./bench/gen-tree)\n");
+    printf("         \t--work-dir <path> directory of the generated trees (default /tmp/lp25-bench)\n");
+    printf("         \t-n <processes count> processes count of the parallel configurations (default 4)\n");
+    printf("         \t--runs <count> runs of each configuration, the fastest is reported (default 1)\n");
+    printf("         \t--files, --depth, --fan-out, --min-size, --max-size, --size-distribution, --modified, --new,\n");
+    printf("         \t--seed are passed to the generator (see gen-tree -h)\n");
+}
+
+/*!
+ * @brief remove_entry removes a file or an empty directory (@see nftw)
+ * @return 0 to go on, -1 to stop the walk
+ */
+static int remove_entry(const char *path, const struct stat *properties, int type, struct FTW *position) {
+    (void) properties;
+    (void) type;
+    (void) position;
+    if (remove(path) == -1) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief remove_tree removes a directory tree, if it exists
+ * @param path is the root of the tree
+ * @return 0 in case of success, -1 else
+ */
+static int remove_tree(char *path) {
+    struct stat properties;
+    if (lstat(path, &properties) == -1) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    return nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+/*!
+ * @brief count_entry adds a regular file to the totals of the source (@see nftw)
+ * @return 0 to go on
+ */
+static int count_entry(const char *path, const struct stat *properties, int type, struct FTW *position) {
+    (void) path;
+    (void) position;
+    if (type == FTW_F && S_ISREG(properties->st_mode)) {
+        ++source_files_count;
+        source_bytes += (uint64_t)properties->st_size;
+    }
+    return 0;
+}
+
+/*!
+ * @brief run_command runs a command and waits for it
+ * @param arguments is the NULL terminated array of the command and its arguments
+ * @param is_quiet is true to discard its outputs
+ * @param usage is filled with the resources used by the command, may be NULL
+ * @return the exit status of the command, -1 if it could not run or was killed
+ */
+static int run_command(char **arguments, bool is_quiet, struct rusage *usage) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        if (is_quiet) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            if (null_fd != -1) {
+                dup2(null_fd, STDOUT_FILENO);
+                dup2(null_fd, STDERR_FILENO);
+                close(null_fd);
+            }
+        }
+        execv(arguments[0], arguments);
+        perror(arguments[0]);
+        _exit(127);
+    }
+    int status = 0;
+    struct rusage ignored_usage;
+    while (wait4(pid, &status, 0, usage ? usage : &ignored_usage) == -1) {
+        if (errno != EINTR) {
+            perror("wait4");
+            return -1;
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/*!
+ * @brief generate_trees calls the generator on the work directory
+ * @param config is a pointer to the harness configuration
+ * @param is_destination_only is true to generate the destination again, and not the source
+ * @return 0 in case of success, -1 else
+ */
+static int generate_trees(bench_configuration_t *config, bool is_destination_only) {
+    char *arguments[BENCH_MAX_ARGUMENTS + 5];
+    int count = 0;
+    arguments[count++] = config->generator;
+    for (int i=0; i<config->generator_arguments_count; ++i) {
+        arguments[count++] = config->generator_arguments[i];
+    }
+    if (is_destination_only) {
+        arguments[count++] = "--destination-only";
+    }
+    arguments[count++] = config->source;
+    arguments[count++] = config->destination;
+    arguments[count] = NULL;
+    if (remove_tree(config->destination) == -1 || (!is_destination_only && remove_tree(config->source) == -1)) {
+        return -1;
+    }
+    return (run_command(arguments, is_destination_only, NULL) == 0) ? 0 : -1;
+}
+
+/*!
+ * @brief run_case runs a configuration of lp25-backup runs_count times
+ * @param config is a pointer to the harness configuration
+ * @param bench_case is a pointer to the configuration of lp25-backup
+ * @param result is a pointer to the measures of the case
+ * @return 0 in case of success, -1 if the trees could not be generated
+ */
+static int run_case(bench_configuration_t *config, bench_case_t *bench_case, bench_result_t *result) {
+    char *arguments[8];
+    int count = 0;
+    arguments[count++] = config->binary;
+    for (int i=0; bench_case->options[i]; ++i) {
+        arguments[count++] = bench_case->options[i];
+        if (strcmp(bench_case->options[i], "-n") == 0) {
+            arguments[count++] = config->processes_count;
+        }
+    }
+    arguments[count++] = config->source;
+    arguments[count++] = config->destination;
+    arguments[count] = NULL;
+    result->wall_seconds = -1.0;
+    result->peak_rss_kib = 0;
+    result->failed_runs = 0;
+    for (int run=0; run<config->runs_count; ++run) {
+        if (generate_trees(config, true) == -1) {
+            return -1;
+        }
+        struct rusage usage;
+        memset(&usage, 0, sizeof(usage));
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int status = run_command(arguments, true, &usage);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double wall_seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+        if (status != 0) {
+            ++result->failed_runs;
+        }
+        if (result->wall_seconds < 0 || wall_seconds < result->wall_seconds) {
+            result->wall_seconds = wall_seconds;
+        }
+        if (usage.ru_maxrss > result->peak_rss_kib) {
+            result->peak_rss_kib = usage.ru_maxrss;
+        }
+    }
+    return 0;
+}
+
+/*!
+ * @brief main parses the options, generates the trees and runs the configurations
+ * @param argc its number of arguments, including its own name
+ * @param argv the array of arguments
+ * @return 0 in case of success, 1 else
+ */
+int main(int argc, char *argv[]) {
+    bench_configuration_t config = {
+            .binary = "./lp25-backup",
+            .generator = "./bench/gen-tree",
+            .work_dir = "/tmp/lp25-bench",
+            .processes_count = "4",
+            .runs_count = 1,
+            .generator_arguments_count = 0,
+    };
+    struct option my_opts[] = {
+            {.name="binary", .has_arg=1, .flag=0, .val='b'},
+            {.name="generator", .has_arg=1, .flag=0, .val='g'},
+            {.name="work-dir", .has_arg=1, .flag=0, .val='w'},
+            {.name="runs", .has_arg=1, .flag=0, .val='r'},
+            // Options of the generator, val is not used
+            {.name="files", .has_arg=1, .flag=0, .val='G'},
+            {.name="depth", .has_arg=1, .flag=0, .val='G'},
+            {.name="fan-out", .has_arg=1, .flag=0, .val='G'},
+            {.name="min-size", .has_arg=1, .flag=0, .val='G'},
+            {.name="max-size", .has_arg=1, .flag=0, .val='G'},
+            {.name="size-distribution", .has_arg=1, .flag=0, .val='G'},
+            {.name="modified", .has_arg=1, .flag=0, .val='G'},
+            {.name="new", .has_arg=1, .flag=0, .val='G'},
+            {.name="seed", .has_arg=1, .flag=0, .val='G'},
+            {.name=0, .has_arg=0, .flag=0, .val=0}, // last element must be zero
+    };
+    int opt = 0, option_index = 0;
+    while ((opt = getopt_long(argc, argv, "n:h", my_opts, &option_index)) != -1) {
+        switch (opt) {
+            case 'b':
+                config.binary = optarg;
+                break;
+            case 'g':
+                config.generator = optarg;
+                break;
+            case 'w':
+                config.work_dir = optarg;
+                break;
+            case 'n':
+                config.processes_count = optarg;
+                break;
+            case 'r':
+                config.runs_count = (int)strtol(optarg, NULL, 10);
+                if (config.runs_count < 1) {
+                    config.runs_count = 1;
+                }
+                break;
+            case 'G':
+                if (config.generator_arguments_count + 2 > BENCH_MAX_ARGUMENTS) {
+                    fprintf(stderr, "Too many generator options\n");
+                    return 1;
+                }
+                // The generator accepts --name=value as well as --name value
+                config.generator_arguments[config.generator_arguments_count] = malloc(strlen(my_opts[option_index].name) + strlen(optarg) + 4);
+                if (!config.generator_arguments[config.generator_arguments_count]) {
+                    return 1;
+                }
+                sprintf(config.generator_arguments[config.generator_arguments_count++], "--%s=%s", my_opts[option_index].name, optarg);
+                break;
+            case 'h':
+                display_help(argv[0]);
+                return 0;
+            default:
+                display_help(argv[0]);
+                return 1;
+        }
+    }
+    if (mkdir(config.work_dir, 0755) == -1 && errno != EEXIST) {
+        perror(config.work_dir);
+        return 1;
+    }
+    snprintf(config.source, BENCH_PATH_SIZE, "%s/source", config.work_dir);
+    snprintf(config.destination, BENCH_PATH_SIZE, "%s/destination", config.work_dir);
+    printf("Generating the trees in %s\n", config.work_dir);
+    if (generate_trees(&config, false) == -1) {
+        fprintf(stderr, "Could not generate the trees\n");
+        return 1;
+    }
+    nftw(config.source, count_entry, 64, FTW_PHYS);
+    printf("Source: %llu files, %.1f MB\n\n", (unsigned long long)source_files_count, (double)source_bytes / 1e6);
+
+    bench_case_t cases[] = {
+            {.name="no-parallel", .options={"--no-parallel", NULL}},
+            {.name="parallel -n", .options={"-n", NULL}},
+            {.name="date-size-only -n", .options={"-n", "--date-size-only", NULL}},
+            {.name="dry-run -n", .options={"-n", "--dry-run", NULL}},
+    };
+    printf("%-24s %10s %12s %10s %14s\n", "configuration", "wall (s)", "files/s", "MB/s", "peak RSS (MiB)");
+    int status = 0;
+    for (size_t i=0; i<sizeof(cases) / sizeof(cases[0]); ++i) {
+        bench_result_t result;
+        if (run_case(&config, &cases[i], &result) == -1) {
+            fprintf(stderr, "Could not generate the destination\n");
+            status = 1;
+            break;
+        }
+        char name[64];
+        bool uses_processes_count = strcmp(cases[i].options[0], "-n") == 0;
+        snprintf(name, sizeof(name), "%s%s%s", cases[i].name, uses_processes_count ? " " : "", uses_processes_count ? config.processes_count : "");
+        double wall_seconds = (result.wall_seconds > 0) ? result.wall_seconds : 1e-9;
+        printf("%-24s %10.3f %12.0f %10.1f %14.1f", name, result.wall_seconds,
+               (double)source_files_count / wall_seconds, (double)source_bytes / 1e6 / wall_seconds,
+               (double)result.peak_rss_kib / 1024.0);
+        if (result.failed_runs > 0) {
+            printf("   (%d failed runs)", result.failed_runs);
+            status = 1;
+        }
+        printf("\n");
+    }
+    for (int i=0; i<config.generator_arguments_count; ++i) {
+        free(config.generator_arguments[i]);
+    }
+    return status;
+}
@@ -4,6 +4,9 @@
 #include <getopt.h>
 #include <stdio.h>
 #include <string.h>
+#include <utility.h>
+#include <digest-cache.h>
+#include <file-properties.h>
 /*!
  * @brief function display_help displays a brief manual for the program usage
  * @param my_name is the name of the binary file
@@ -14,9 +17,21 @@ void display_help(char *my_name) {
     printf("Options: \t-n <processes count>\tnumber of processes for file calculations\n");
     printf("         \t-h display help (this text)\n");
     printf("         \t--date_size_only disables MD5 calculation for files\n");
+    printf("         \t--digest <md5|xxh64|blake2b> algorithm of the files digests (default md5)\n");
     printf("         \t--no-parallel disables parallel computing (cancels values of option -n)\n");
+    printf("         \t--threads use threads instead of processes and a message queue for parallel computing\n");
+    printf("         \t--sysv-mq use the System V message queue instead of shared memory between processes\n");
     printf("         \t--verbose enable mode verbose\n");
     printf("         \t--dry-run enable mode dry run \n");
+    printf("         \t--batch-size <entries> maximum number of files per message between processes (default %d)\n", DEFAULT_BATCH_SIZE);
+    printf("         \t--cache-file <path> digest cache file (default <destination_dir>/%s)\n", DIGEST_CACHE_FILE_NAME);
+    printf("         \t--no-cache disables the digest cache, all files are hashed again\n");
+    printf("         \t--hash-buffer <KiB> size of the reads when hashing files (default %d)\n", DEFAULT_HASH_BUFFER_SIZE / 1024);
+    printf("         \t--direct-io hash files with O_DIRECT, for data that is not in the page cache\n");
+    printf("         \t--pipeline compare and copy files while the lists are being built (parallel processes only)\n");
+    printf("         \t--delta rewrite only the changed blocks of large files existing in the destination\n");
+    printf("         \t--copy-jobs <threads> number of files copied at the same time (default: the processes count)\n");
+    printf("         \t--walkers <threads> number of threads listing each directory tree (default %d)\n", DEFAULT_WALKERS_COUNT);
 }
 
 /*!
@@ -25,11 +40,23 @@ void display_help(char *my_name) {
  */
 void init_configuration(configuration_t *the_config) {
     if(the_config) {
-        the_config->uses_md5 = false;
+        the_config->uses_md5 = true;
+        the_config->digest_algorithm = DIGEST_MD5;
         the_config->is_parallel = true;
+        the_config->is_threaded = false;
+        the_config->uses_sysv_mq = false;
         the_config->processes_count = 1;
         the_config->dry_run = false;
         the_config->verbose = false;
+        the_config->batch_size = DEFAULT_BATCH_SIZE;
+        the_config->walkers_count = DEFAULT_WALKERS_COUNT;
+        the_config->uses_digest_cache = true;
+        strcpy(the_config->cache_file, "");
+        the_config->hash_buffer_size = DEFAULT_HASH_BUFFER_SIZE;
+        the_config->uses_direct_io = false;
+        the_config->uses_pipeline = false;
+        the_config->uses_delta = false;
+        the_config->copy_jobs_count = 0;
         strcpy(the_config->source, "");
         strcpy(the_config->destination, "");
     }
@@ -52,20 +79,40 @@ int set_configuration(configuration_t *the_config, int argc, char *argv[]) {
     struct option my_opts[] = {
             {.name="date-size-only", .has_arg=0, .flag=0, .val='d'},
             {.name="no-parallel", .has_arg=0, .flag=0, .val='p'},
+            {.name="threads", .has_arg=0, .flag=0, .val='t'},
+            {.name="sysv-mq", .has_arg=0, .flag=0, .val='q'},
             {.name="verbose", .has_arg=0, .flag=0, .val='v'},
             {.name="dry-run", .has_arg=0, .flag=0, .val='r'},
+            {.name="batch-size", .has_arg=1, .flag=0, .val='b'},
+            {.name="walkers", .has_arg=1, .flag=0, .val='w'},
+            {.name="cache-file", .has_arg=1, .flag=0, .val='c'},
+            {.name="digest", .has_arg=1, .flag=0, .val='g'},
+            {.name="no-cache", .has_arg=0, .flag=0, .val='k'},
+            {.name="hash-buffer", .has_arg=1, .flag=0, .val='u'},
+            {.name="direct-io", .has_arg=0, .flag=0, .val='o'},
+            {.name="pipeline", .has_arg=0, .flag=0, .val='i'},
+            {.name="delta", .has_arg=0, .flag=0, .val='e'},
+            {.name="copy-jobs", .has_arg=1, .flag=0, .val='j'},
             {.name=0, .has_arg=0, .flag=0, .val=0}, // last element must be zero
     };
     while ((opt = (getopt_long(argc, argv, "n:h", my_opts, NULL))) != -1) {
         switch (opt) {
             case 'd':
-                the_config->uses_md5 = optarg;
+                the_config->uses_md5 = false;
                 ++parameter_count;
                 break;
             case'p':
                 the_config->is_parallel = false;
                 ++parameter_count;
                 break;
+            case 't':
+                the_config->is_threaded = true;
+                ++parameter_count;
+                break;
+            case 'q':
+                the_config->uses_sysv_mq = true;
+                ++parameter_count;
+                break;
                 case 'v':
                 the_config->verbose = true;
                 ++parameter_count;
@@ -81,6 +128,68 @@ int set_configuration(configuration_t *the_config, int argc, char *argv[]) {
                     break;
                 }
                 break;
+            case 'b':
+                if(optarg) {
+                    long batch_size = strtol(optarg,NULL,10);
+                    the_config->batch_size = (batch_size > 0 && batch_size <= UINT16_MAX) ? (uint16_t)batch_size : DEFAULT_BATCH_SIZE;
+                    parameter_count+=2;
+                }
+                break;
+            case 'w':
+                if(optarg) {
+                    long walkers_count = strtol(optarg,NULL,10);
+                    the_config->walkers_count = (walkers_count > 0 && walkers_count <= UINT8_MAX) ? (uint8_t)walkers_count : DEFAULT_WALKERS_COUNT;
+                    parameter_count+=2;
+                }
+                break;
+            case 'c':
+                if(optarg && strlen(optarg) < STR_MAX) {
+                    strcpy(the_config->cache_file,optarg);
+                    parameter_count+=2;
+                }
+                break;
+            case 'g':
+                if(optarg) {
+                    digest_algorithm_t algorithm = get_digest_algorithm(optarg);
+                    if (algorithm == DIGEST_NONE) {
+                        printf("Unknown digest %s, using %s\n", optarg, get_digest_name(the_config->digest_algorithm));
+                    } else {
+                        the_config->digest_algorithm = algorithm;
+                    }
+                    parameter_count+=2;
+                }
+                break;
+            case 'k':
+                the_config->uses_digest_cache = false;
+                ++parameter_count;
+                break;
+            case 'u':
+                if(optarg) {
+                    long kibibytes = strtol(optarg,NULL,10);
+                    // Up to 1 GiB, the reader rounds it to a multiple of HASH_BUFFER_ALIGNMENT
+                    the_config->hash_buffer_size = (kibibytes > 0 && kibibytes <= 1024 * 1024) ? (size_t)kibibytes * 1024 : DEFAULT_HASH_BUFFER_SIZE;
+                    parameter_count+=2;
+                }
+                break;
+            case 'o':
+                the_config->uses_direct_io = true;
+                ++parameter_count;
+                break;
+            case 'i':
+                the_config->uses_pipeline = true;
+                ++parameter_count;
+                break;
+            case 'e':
+                the_config->uses_delta = true;
+                ++parameter_count;
+                break;
+            case 'j':
+                if(optarg) {
+                    long copy_jobs_count = strtol(optarg,NULL,10);
+                    the_config->copy_jobs_count = (copy_jobs_count > 0 && copy_jobs_count <= UINT8_MAX) ? (uint8_t)copy_jobs_count : 0;
+                    parameter_count+=2;
+                }
+                break;
             case 'h':
                 display_help(argv[0]);
                 ++parameter_count;
@@ -95,6 +204,13 @@ int set_configuration(configuration_t *the_config, int argc, char *argv[]) {
         // Copy source_dir and destination_dir in the_config
         strcpy(the_config->source,argv[argc-2]);
         strcpy(the_config->destination,argv[argc-1]);
+        if (the_config->copy_jobs_count == 0) {
+            // As many copies as workers computing the lists, which are idle once the lists are done
+            the_config->copy_jobs_count = (the_config->is_parallel && the_config->processes_count > 0) ? the_config->processes_count : 1;
+        }
+        if (strlen(the_config->cache_file) == 0 && !concat_path(the_config->cache_file, the_config->destination, DIGEST_CACHE_FILE_NAME)) {
+            the_config->uses_digest_cache = false;
+        }
         return 0;
     }
 }
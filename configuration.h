@@ -2,16 +2,32 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <digest.h>
 #define STR_MAX 1024
+#define DEFAULT_BATCH_SIZE 32
+#define DEFAULT_WALKERS_COUNT 1
 
 typedef struct {
     char source[STR_MAX];
     char destination[STR_MAX];
     uint8_t processes_count;
     bool is_parallel;
-    bool uses_md5;
+    bool is_threaded; // Parallel mode with threads of the main process instead of processes and a MQ
+    bool uses_sysv_mq; // Processes communicate through the System V MQ instead of shared memory rings
+    bool uses_md5; // Compare the digests of files with the same properties
+    digest_algorithm_t digest_algorithm; // Algorithm of these digests
     bool verbose;
     bool dry_run;
+    uint16_t batch_size; // Maximum number of entries per message between processes
+    uint8_t walkers_count; // Number of threads listing each directory tree
+    bool uses_digest_cache; // Digests of unchanged files are read from the digest cache
+    char cache_file[STR_MAX]; // Path of the digest cache, in the destination root by default
+    size_t hash_buffer_size; // Size of the reads of each hashing worker
+    bool uses_direct_io; // Files are hashed with O_DIRECT, without filling the page cache
+    bool uses_pipeline; // Files are compared and copied while the listers still send their lists
+    bool uses_delta; // Large files existing in the destination are updated where they differ
+    uint8_t copy_jobs_count; // Number of threads copying files, 0 until set_configuration gives it its default
 } configuration_t;
 
 void init_configuration(configuration_t *the_config);
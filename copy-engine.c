@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+#include <copy-engine.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+
+// Functions in this file copy the data of a file with the cheapest mechanism the file systems support.
+// Each strategy copies from where the previous one stopped, so a file system refusing a mechanism halfway
+// (or returning early) does not lose data. Every loop goes on until the end of its range or of the source.
+
+// Largest request of a single copy_file_range or sendfile call (sendfile stops at 2 GB anyway)
+#define COPY_REQUEST_SIZE ((size_t)1 << 30)
+// End of the range of a file copied until the end of its source
+#define COPY_END_OF_FILE ((off_t)INT64_MAX)
+
+static const char *strategies_names[COPY_STRATEGIES_COUNT] = {"failed", "reflink", "copy_file_range", "sendfile", "buffered", "delta"};
+
+/*!
+ * @brief is_unsupported tells whether an error means that a mechanism cannot copy these files
+ * @param error is the errno of the failed call
+ * @return true if the next strategy should be tried, false for a real error
+ */
+static bool is_unsupported(int error) {
+    return error == EXDEV || error == EINVAL || error == ENOSYS || error == EOPNOTSUPP || error == ENOTTY || error == EBADF;
+}
+
+/*!
+ * @brief copy_with_file_range copies data with copy_file_range
+ * @param source_fd is the source file
+ * @param destination_fd is the destination file
+ * @param offset is a pointer to the offset where to start, in both files, updated with the copied data
+ * @param end is the offset where to stop
+ * @return 0 at the end of the range or of the source, 1 if copy_file_range cannot copy these files, -1 in case of error
+ */
+static int copy_with_file_range(int source_fd, int destination_fd, off_t *offset, off_t end) {
+    while (*offset < end) {
+        loff_t source_offset = *offset, destination_offset = *offset;
+        size_t request = (end - *offset < (off_t)COPY_REQUEST_SIZE) ? (size_t)(end - *offset) : COPY_REQUEST_SIZE;
+        ssize_t copied = copy_file_range(source_fd, &source_offset, destination_fd, &destination_offset, request, 0);
+        if (copied > 0) {
+            *offset += copied;
+        } else if (copied == 0) {
+            return 0;
+        } else if (errno != EINTR) {
+            return is_unsupported(errno) ? 1 : -1;
+        }
+    }
+    return 0;
+}
+
+/*!
+ * @brief copy_with_sendfile copies data with sendfile
+ * @param source_fd is the source file
+ * @param destination_fd is the destination file
+ * @param offset is a pointer to the offset where to start, in both files, updated with the copied data
+ * @param end is the offset where to stop
+ * @return 0 at the end of the range or of the source, 1 if sendfile cannot copy these files, -1 in case of error
+ */
+static int copy_with_sendfile(int source_fd, int destination_fd, off_t *offset, off_t end) {
+    // sendfile writes at the position of the destination
+    if (lseek(destination_fd, *offset, SEEK_SET) == -1) {
+        return -1;
+    }
+    while (*offset < end) {
+        size_t request = (end - *offset < (off_t)COPY_REQUEST_SIZE) ? (size_t)(end - *offset) : COPY_REQUEST_SIZE;
+        ssize_t copied = sendfile(destination_fd, source_fd, offset, request);
+        if (copied == 0) {
+            return 0;
+        } else if (copied == -1 && errno != EINTR) {
+            return is_unsupported(errno) ? 1 : -1;
+        }
+    }
+    return 0;
+}
+
+/*!
+ * @brief copy_with_buffer copies data with read and write
+ * @param source_fd is the source file
+ * @param destination_fd is the destination file
+ * @param offset is a pointer to the offset where to start, in both files, updated with the copied data
+ * @param end is the offset where to stop
+ * @return 0 at the end of the range or of the source, -1 in case of error
+ */
+static int copy_with_buffer(int source_fd, int destination_fd, off_t *offset, off_t end) {
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    if (!buffer) {
+        return -1;
+    }
+    int result = 0;
+    while (*offset < end) {
+        size_t request = (end - *offset < COPY_BUFFER_SIZE) ? (size_t)(end - *offset) : COPY_BUFFER_SIZE;
+        ssize_t read_bytes = pread(source_fd, buffer, request, *offset);
+        if (read_bytes == 0) {
+            break;
+        }
+        if (read_bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            result = -1;
+            break;
+        }
+        for (ssize_t written = 0; written < read_bytes; ) {
+            ssize_t bytes = pwrite(destination_fd, buffer + written, read_bytes - written, *offset + written);
+            if (bytes == -1 && errno != EINTR) {
+                free(buffer);
+                return -1;
+            }
+            written += (bytes > 0) ? bytes : 0;
+        }
+        *offset += read_bytes;
+    }
+    free(buffer);
+    return result;
+}
+
+/*!
+ * @brief copy_range copies a range of the source at the same offset in the destination
+ * It starts with the given strategy and goes to the next one when a strategy cannot copy these files, or when it
+ * stops before the expected end (some file systems answer 0 instead of an error).
+ * @param source_fd is the source file
+ * @param destination_fd is the destination file
+ * @param start is the offset of the range
+ * @param end is the end of the range, the copy also stops at the end of the source
+ * @param expected_end is the offset the source is expected to reach
+ * @param strategy is a pointer to the strategy to start with, updated with the strategy that completed the range
+ * @return the offset where the copy stopped, -1 in case of error
+ */
+static off_t copy_range(int source_fd, int destination_fd, off_t start, off_t end, off_t expected_end, copy_strategy_t *strategy) {
+    off_t offset = start;
+    while (*strategy <= COPY_BUFFERED) {
+        int result;
+        switch (*strategy) {
+            case COPY_FILE_RANGE:
+                result = copy_with_file_range(source_fd, destination_fd, &offset, end);
+                break;
+            case COPY_SENDFILE:
+                result = copy_with_sendfile(source_fd, destination_fd, &offset, end);
+                break;
+            default:
+                result = copy_with_buffer(source_fd, destination_fd, &offset, end);
+                break;
+        }
+        if (result == -1) {
+            return -1;
+        }
+        if (result == 0 && (offset >= expected_end || *strategy == COPY_BUFFERED)) {
+            break;
+        }
+        ++*strategy;
+    }
+    return offset;
+}
+
+/*!
+ * @brief copy_file_data copies the data of a file into another (empty) file
+ * It tries a reflink, then copy_file_range, sendfile and finally read and write. A strategy that reaches the
+ * end of the source before its expected size hands over to the next one.
+ * A sparse source (with fewer blocks than its size) is copied extent by extent, found with SEEK_DATA and
+ * SEEK_HOLE: the holes are neither read nor written, so they stay holes in the destination.
+ * @param source_fd is the source file, opened for reading
+ * @param destination_fd is the destination file, opened for writing and empty
+ * @param size is the expected size of the source
+ * @param copied_bytes receives the number of bytes copied (holes excluded), if not NULL
+ * @return the strategy that completed the copy, COPY_FAILED in case of error
+ */
+copy_strategy_t copy_file_data(int source_fd, int destination_fd, uint64_t size, uint64_t *copied_bytes) {
+    if (copied_bytes) {
+        *copied_bytes = 0;
+    }
+    if (ioctl(destination_fd, FICLONE, source_fd) == 0) {
+        if (copied_bytes) {
+            *copied_bytes = size;
+        }
+        return COPY_REFLINK;
+    }
+    copy_strategy_t strategy = COPY_FILE_RANGE;
+    struct stat source_stat;
+    bool is_sparse = fstat(source_fd, &source_stat) == 0 && (uint64_t)source_stat.st_blocks * 512 < (uint64_t)source_stat.st_size;
+    off_t data_start = is_sparse ? lseek(source_fd, 0, SEEK_DATA) : -1;
+    if (!is_sparse || (data_start == -1 && errno != ENXIO)) {
+        // Not sparse, or the file system cannot tell: the source is copied up to its end, whatever its size
+        off_t end = copy_range(source_fd, destination_fd, 0, COPY_END_OF_FILE, (off_t)size, &strategy);
+        if (copied_bytes && end != -1) {
+            *copied_bytes = (uint64_t)end;
+        }
+        return (end == -1) ? COPY_FAILED : strategy;
+    }
+    uint64_t copied = 0;
+    off_t end_of_source = source_stat.st_size;
+    while (data_start != -1) {
+        off_t data_end = lseek(source_fd, data_start, SEEK_HOLE);
+        if (data_end == -1) {
+            return COPY_FAILED;
+        }
+        off_t end = copy_range(source_fd, destination_fd, data_start, data_end, data_end, &strategy);
+        if (end == -1) {
+            return COPY_FAILED;
+        }
+        copied += (uint64_t)(end - data_start);
+        if (end < data_end) {
+            // The source has been truncated while being copied
+            end_of_source = end;
+            break;
+        }
+        data_start = lseek(source_fd, data_end, SEEK_DATA);
+        if (data_start == -1 && errno != ENXIO) {
+            return COPY_FAILED;
+        }
+    }
+    // The source may end with a hole, which no copy wrote
+    if (ftruncate(destination_fd, end_of_source) == -1) {
+        return COPY_FAILED;
+    }
+    if (copied_bytes) {
+        *copied_bytes = copied;
+    }
+    return strategy;
+}
+
+/*!
+ * @brief get_copy_strategy_name gives the name of a strategy
+ * @param strategy is the strategy
+ * @return its name
+ */
+const char *get_copy_strategy_name(copy_strategy_t strategy) {
+    return (strategy < COPY_STRATEGIES_COUNT) ? strategies_names[strategy] : "unknown";
+}
+
+/*!
+ * @brief add_copy_to_statistics counts a copy
+ * @param statistics is a pointer to the counters
+ * @param strategy is the strategy of the copy, COPY_FAILED for a failed copy
+ * @param bytes is the number of bytes the copy wrote (@see copy_file_data)
+ */
+void add_copy_to_statistics(copy_statistics_t *statistics, copy_strategy_t strategy, uint64_t bytes) {
+    if (statistics && strategy < COPY_STRATEGIES_COUNT) {
+        ++statistics->files_count[strategy];
+        statistics->bytes_count[strategy] += (strategy != COPY_FAILED) ? bytes : 0;
+    }
+}
+
+/*!
+ * @brief display_copy_statistics prints the number of files and bytes copied with each strategy
+ * @param statistics is a pointer to the counters
+ */
+void display_copy_statistics(copy_statistics_t *statistics) {
+    printf("Copies:");
+    for (int strategy=COPY_REFLINK; strategy<COPY_STRATEGIES_COUNT; ++strategy) {
+        printf(" %llu %s (%llu bytes)%s", (unsigned long long)statistics->files_count[strategy], strategies_names[strategy],
+               (unsigned long long)statistics->bytes_count[strategy], (strategy < COPY_STRATEGIES_COUNT - 1) ? "," : "");
+    }
+    printf(", %llu failed\n", (unsigned long long)statistics->files_count[COPY_FAILED]);
+}
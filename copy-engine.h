@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
+// Strategies from the cheapest to the most expensive, copy_file_data tries them in this order
+typedef enum {
+    COPY_FAILED = 0,
+    COPY_REFLINK, // FICLONE: the destination shares the extents of the source (btrfs, XFS...)
+    COPY_FILE_RANGE, // copy_file_range: in the kernel, offloaded by some file systems (NFS, SMB...)
+    COPY_SENDFILE, // sendfile: in the kernel, through the page cache
+    COPY_BUFFERED, // read and write
+    COPY_DELTA, // only the blocks that changed in an existing destination (@see delta_copy_file)
+    COPY_STRATEGIES_COUNT
+} copy_strategy_t;
+
+typedef struct {
+    uint64_t files_count[COPY_STRATEGIES_COUNT];
+    uint64_t bytes_count[COPY_STRATEGIES_COUNT];
+} copy_statistics_t;
+
+copy_strategy_t copy_file_data(int source_fd, int destination_fd, uint64_t size, uint64_t *copied_bytes);
+const char *get_copy_strategy_name(copy_strategy_t strategy);
+void add_copy_to_statistics(copy_statistics_t *statistics, copy_strategy_t strategy, uint64_t bytes);
+void display_copy_statistics(copy_statistics_t *statistics);
@@ -0,0 +1,551 @@
+#include <delta-copy.h>
+#include <digest.h>
+#include <defines.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Functions in this file update an existing destination file from its source like rsync does, writing only the
+// data that changed. The blocks of the destination are summed with a weak rolling checksum and a strong one
+// (XXH64). A window slides over the source: where its weak checksum, then its strong checksum, match a block
+// of the destination, this block is reused, else the byte is literal data of the source.
+// When most reused blocks stay at their offset, which is the case of files modified in place (database dumps,
+// disk images), the literal data and the few blocks that moved are written over the destination. Else the file is
+// rebuilt into a temporary file from the blocks of the destination and the literal data, then renamed over the
+// destination. As rsync does, the result is checked against the XXH64 of the whole source.
+
+#define TAGS_COUNT (1 << 16)
+
+typedef struct {
+    uint32_t weak;
+    uint64_t strong;
+} block_checksum_t;
+
+typedef struct {
+    size_t block_size;
+    uint64_t blocks_count;
+    block_checksum_t *blocks; // In the order of the blocks of the destination
+    uint32_t *sorted; // Indexes of the blocks sorted by tag and weak checksum
+    uint32_t *tag_start; // First index in sorted of each tag, TAGS_COUNT + 1 elements
+} delta_signature_t;
+
+typedef struct {
+    bool is_literal; // Data of the source, else a block of the destination
+    uint64_t source_offset;
+    uint64_t destination_offset; // For blocks of the destination
+    uint64_t length;
+} delta_operation_t;
+
+typedef struct {
+    delta_operation_t *operations;
+    size_t count;
+    size_t capacity;
+} delta_operations_t;
+
+/*!
+ * @brief get_delta_block_size chooses the size of the blocks of a file
+ * @param size is the size of the file
+ * @return the power of two closest above the square root of size, within DELTA_MIN_BLOCK_SIZE and DELTA_MAX_BLOCK_SIZE
+ */
+size_t get_delta_block_size(uint64_t size) {
+    size_t block_size = DELTA_MIN_BLOCK_SIZE;
+    while (block_size < DELTA_MAX_BLOCK_SIZE && (uint64_t)block_size * block_size < size) {
+        block_size *= 2;
+    }
+    return block_size;
+}
+
+/*!
+ * @brief get_tag reduces a weak checksum to the index of its bucket
+ * @param weak is the weak checksum
+ * @return the tag
+ */
+static inline uint32_t get_tag(uint32_t weak) {
+    return (weak ^ (weak >> 16)) & (TAGS_COUNT - 1);
+}
+
+/*!
+ * @brief weak_checksum computes the weak checksum of a block, as rsync does
+ * The checksum is made of two sums: a is the sum of the bytes, b the sum of the bytes weighted by their distance
+ * to the end of the block, both modulo 2^16. Both are updated in constant time when the block slides by one byte.
+ * @param data is the block
+ * @param length is its length
+ * @param a receives the first sum
+ * @param b receives the second sum
+ */
+static void weak_checksum(const uint8_t *data, size_t length, uint32_t *a, uint32_t *b) {
+    uint32_t sum_a = 0, sum_b = 0;
+    for (size_t i=0; i<length; ++i) {
+        sum_a += data[i];
+        sum_b += (uint32_t)(length - i) * data[i];
+    }
+    *a = sum_a;
+    *b = sum_b;
+}
+
+static inline uint32_t combine_weak(uint32_t a, uint32_t b) {
+    return (a & 0xffff) | (b << 16);
+}
+
+/*!
+ * @brief strong_checksum computes the strong checksum of a block
+ * @param context is a pointer to an XXH64 digest context
+ * @param data is the block
+ * @param length is its length
+ * @return the checksum
+ */
+static uint64_t strong_checksum(digest_context_t *context, const uint8_t *data, size_t length) {
+    uint8_t digest[8];
+    uint64_t checksum = 0;
+    if (reset_digest(context) == 0 && update_digest(context, data, length) == 0 && final_digest(context, digest) == 0) {
+        memcpy(&checksum, digest, sizeof(checksum));
+    }
+    return checksum;
+}
+
+/*!
+ * @brief read_at reads data at an offset, until length bytes or the end of the file
+ * @param fd is the file
+ * @param buffer is the output
+ * @param length is the number of bytes to read
+ * @param offset is the offset of the data
+ * @return the number of bytes read, -1 in case of error
+ */
+static ssize_t read_at(int fd, uint8_t *buffer, size_t length, uint64_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t read_bytes = pread(fd, buffer + done, length - done, (off_t)(offset + done));
+        if (read_bytes == 0) {
+            break;
+        }
+        if (read_bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += read_bytes;
+    }
+    return (ssize_t)done;
+}
+
+/*!
+ * @brief write_at writes all data at an offset
+ * @param fd is the file
+ * @param buffer is the data
+ * @param length is the number of bytes to write
+ * @param offset is the offset of the data
+ * @return 0 in case of success, -1 else
+ */
+static int write_at(int fd, const uint8_t *buffer, size_t length, uint64_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t written = pwrite(fd, buffer + done, length - done, (off_t)(offset + done));
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += written;
+    }
+    return 0;
+}
+
+/*!
+ * @brief transfer_range copies a range of a file into another
+ * @param source_fd is the file to read
+ * @param source_offset is the offset of the range in source_fd
+ * @param destination_fd is the file to write
+ * @param destination_offset is the offset of the range in destination_fd
+ * @param length is the length of the range
+ * @param buffer is a buffer of DELTA_READ_SIZE bytes
+ * @param context is a pointer to a digest context updated with the data, NULL for none
+ * @return 0 in case of success, -1 else
+ */
+static int transfer_range(int source_fd, uint64_t source_offset, int destination_fd, uint64_t destination_offset, uint64_t length, uint8_t *buffer, digest_context_t *context) {
+    for (uint64_t done = 0; done < length; ) {
+        size_t to_read = (length - done < DELTA_READ_SIZE) ? (size_t)(length - done) : DELTA_READ_SIZE;
+        ssize_t read_bytes = read_at(source_fd, buffer, to_read, source_offset + done);
+        if (read_bytes <= 0 || write_at(destination_fd, buffer, read_bytes, destination_offset + done) == -1) {
+            return -1;
+        }
+        if (context && update_digest(context, buffer, read_bytes) == -1) {
+            return -1;
+        }
+        done += read_bytes;
+    }
+    return 0;
+}
+
+/*!
+ * @brief hash_file computes the digest of a whole file
+ * @param fd is the file
+ * @param context is a pointer to a digest context
+ * @param buffer is a buffer of DELTA_READ_SIZE bytes
+ * @param digest receives the digest
+ * @return 0 in case of success, -1 else
+ */
+static int hash_file(int fd, digest_context_t *context, uint8_t *buffer, uint8_t *digest) {
+    if (reset_digest(context) == -1) {
+        return -1;
+    }
+    for (uint64_t offset = 0; ; ) {
+        ssize_t read_bytes = read_at(fd, buffer, DELTA_READ_SIZE, offset);
+        if (read_bytes == -1 || (read_bytes > 0 && update_digest(context, buffer, read_bytes) == -1)) {
+            return -1;
+        }
+        if (read_bytes < DELTA_READ_SIZE) {
+            break;
+        }
+        offset += read_bytes;
+    }
+    return final_digest(context, digest);
+}
+
+/*!
+ * @brief free_signature frees the tables of a signature
+ * @param signature is a pointer to the signature
+ */
+static void free_signature(delta_signature_t *signature) {
+    free(signature->blocks);
+    free(signature->sorted);
+    free(signature->tag_start);
+}
+
+/*!
+ * @brief make_signature sums the full blocks of the destination
+ * @param fd is the destination file
+ * @param size is its size
+ * @param block_size is the size of the blocks
+ * @param context is a pointer to an XXH64 digest context
+ * @param buffer is a buffer of DELTA_READ_SIZE bytes
+ * @param signature is a pointer to the signature to build
+ * @return 0 in case of success, -1 else
+ */
+static int make_signature(int fd, uint64_t size, size_t block_size, digest_context_t *context, uint8_t *buffer, delta_signature_t *signature) {
+    signature->block_size = block_size;
+    signature->blocks_count = size / block_size;
+    if (signature->blocks_count >= UINT32_MAX) {
+        return -1;
+    }
+    signature->blocks = malloc((signature->blocks_count + 1) * sizeof(block_checksum_t));
+    signature->sorted = malloc((signature->blocks_count + 1) * sizeof(uint32_t));
+    signature->tag_start = calloc(TAGS_COUNT + 1, sizeof(uint32_t));
+    if (!signature->blocks || !signature->sorted || !signature->tag_start) {
+        free_signature(signature);
+        return -1;
+    }
+    size_t blocks_per_read = DELTA_READ_SIZE / block_size;
+    for (uint64_t block = 0; block < signature->blocks_count; block += blocks_per_read) {
+        size_t count = (signature->blocks_count - block < blocks_per_read) ? (size_t)(signature->blocks_count - block) : blocks_per_read;
+        if (read_at(fd, buffer, count * block_size, block * block_size) != (ssize_t)(count * block_size)) {
+            free_signature(signature);
+            return -1;
+        }
+        for (size_t i=0; i<count; ++i) {
+            uint32_t a, b;
+            weak_checksum(buffer + i * block_size, block_size, &a, &b);
+            signature->blocks[block + i].weak = combine_weak(a, b);
+            signature->blocks[block + i].strong = strong_checksum(context, buffer + i * block_size, block_size);
+        }
+    }
+    // Counting sort by tag
+    for (uint64_t block = 0; block < signature->blocks_count; ++block) {
+        ++signature->tag_start[get_tag(signature->blocks[block].weak) + 1];
+    }
+    for (int tag=0; tag<TAGS_COUNT; ++tag) {
+        signature->tag_start[tag + 1] += signature->tag_start[tag];
+    }
+    uint32_t *next = malloc(TAGS_COUNT * sizeof(uint32_t));
+    if (!next) {
+        free_signature(signature);
+        return -1;
+    }
+    memcpy(next, signature->tag_start, TAGS_COUNT * sizeof(uint32_t));
+    for (uint64_t block = 0; block < signature->blocks_count; ++block) {
+        signature->sorted[next[get_tag(signature->blocks[block].weak)]++] = (uint32_t)block;
+    }
+    free(next);
+    return 0;
+}
+
+/*!
+ * @brief find_block looks for a block of the destination equal to the window of the source
+ * The block at the same offset is tried first, so that unchanged files are updated in place.
+ * @param signature is a pointer to the signature of the destination
+ * @param weak is the weak checksum of the window
+ * @param window is the window
+ * @param offset is the offset of the window in the source
+ * @param context is a pointer to an XXH64 digest context
+ * @return the index of the block, -1 if none matches
+ */
+static int64_t find_block(delta_signature_t *signature, uint32_t weak, const uint8_t *window, uint64_t offset, digest_context_t *context) {
+    uint32_t tag = get_tag(weak);
+    if (signature->tag_start[tag] == signature->tag_start[tag + 1]) {
+        return -1;
+    }
+    bool has_strong = false;
+    uint64_t strong = 0;
+    uint64_t aligned_block = offset / signature->block_size;
+    if (offset % signature->block_size == 0 && aligned_block < signature->blocks_count && signature->blocks[aligned_block].weak == weak) {
+        strong = strong_checksum(context, window, signature->block_size);
+        has_strong = true;
+        if (signature->blocks[aligned_block].strong == strong) {
+            return (int64_t)aligned_block;
+        }
+    }
+    for (uint32_t i = signature->tag_start[tag]; i < signature->tag_start[tag + 1]; ++i) {
+        uint32_t block = signature->sorted[i];
+        if (signature->blocks[block].weak != weak) {
+            continue;
+        }
+        if (!has_strong) {
+            strong = strong_checksum(context, window, signature->block_size);
+            has_strong = true;
+        }
+        if (signature->blocks[block].strong == strong) {
+            return block;
+        }
+    }
+    return -1;
+}
+
+/*!
+ * @brief add_operation appends an operation, merging it with the previous one when they are contiguous
+ * @param operations is a pointer to the list of operations
+ * @param is_literal tells if the data comes from the source
+ * @param source_offset is the offset of the data in the source
+ * @param destination_offset is the offset of the block in the destination
+ * @param length is the length of the data
+ * @return 0 in case of success, -1 else
+ */
+static int add_operation(delta_operations_t *operations, bool is_literal, uint64_t source_offset, uint64_t destination_offset, uint64_t length) {
+    if (length == 0) {
+        return 0;
+    }
+    if (operations->count > 0) {
+        delta_operation_t *last = &operations->operations[operations->count - 1];
+        if (last->is_literal == is_literal && last->source_offset + last->length == source_offset
+                && (is_literal || last->destination_offset + last->length == destination_offset)) {
+            last->length += length;
+            return 0;
+        }
+    }
+    if (operations->count == operations->capacity) {
+        size_t capacity = (operations->capacity > 0) ? 2 * operations->capacity : 256;
+        delta_operation_t *resized = realloc(operations->operations, capacity * sizeof(delta_operation_t));
+        if (!resized) {
+            return -1;
+        }
+        operations->operations = resized;
+        operations->capacity = capacity;
+    }
+    delta_operation_t operation = {is_literal, source_offset, destination_offset, length};
+    operations->operations[operations->count++] = operation;
+    return 0;
+}
+
+/*!
+ * @brief match_source slides a window over the source and lists the blocks reused and the literal data
+ * @param fd is the source file
+ * @param signature is a pointer to the signature of the destination
+ * @param context is a pointer to an XXH64 digest context
+ * @param operations is a pointer to the list of operations to fill
+ * @param file_context is a pointer to a digest context, updated with the whole source
+ * @param source_size receives the size of the source
+ * @return 0 in case of success, -1 else
+ */
+static int match_source(int fd, delta_signature_t *signature, digest_context_t *context, delta_operations_t *operations, digest_context_t *file_context, uint64_t *source_size) {
+    size_t block_size = signature->block_size;
+    size_t capacity = DELTA_READ_SIZE + block_size;
+    uint8_t *buffer = malloc(capacity);
+    if (!buffer) {
+        return -1;
+    }
+    uint64_t buffer_offset = 0; // Offset of buffer[0] in the source
+    size_t filled = 0, position = 0;
+    uint64_t literal_start = 0;
+    bool end_of_file = false, has_sum = false;
+    uint32_t a = 0, b = 0;
+    int result = 0;
+    while (result == 0) {
+        if (position + block_size > filled) {
+            if (end_of_file) {
+                break;
+            }
+            // Keeps the window and reads what follows
+            memmove(buffer, buffer + position, filled - position);
+            buffer_offset += position;
+            filled -= position;
+            position = 0;
+            ssize_t read_bytes = read_at(fd, buffer + filled, capacity - filled, buffer_offset + filled);
+            if (read_bytes == -1 || (read_bytes > 0 && update_digest(file_context, buffer + filled, read_bytes) == -1)) {
+                result = -1;
+            }
+            end_of_file = (read_bytes < (ssize_t)(capacity - filled));
+            filled += (read_bytes > 0) ? read_bytes : 0;
+            continue;
+        }
+        if (!has_sum) {
+            weak_checksum(buffer + position, block_size, &a, &b);
+            has_sum = true;
+        }
+        uint64_t offset = buffer_offset + position;
+        int64_t block = find_block(signature, combine_weak(a, b), buffer + position, offset, context);
+        if (block >= 0) {
+            if (add_operation(operations, true, literal_start, 0, offset - literal_start) == -1
+                    || add_operation(operations, false, offset, (uint64_t)block * block_size, block_size) == -1) {
+                result = -1;
+            }
+            position += block_size;
+            literal_start = offset + block_size;
+            has_sum = false;
+        } else if (position + block_size < filled) {
+            uint32_t out = buffer[position], in = buffer[position + block_size];
+            a += in - out;
+            b += a - (uint32_t)block_size * out;
+            ++position;
+        } else {
+            ++position;
+            has_sum = false;
+        }
+    }
+    *source_size = buffer_offset + filled;
+    if (result == 0) {
+        result = add_operation(operations, true, literal_start, 0, *source_size - literal_start);
+    }
+    free(buffer);
+    return result;
+}
+
+/*!
+ * @brief rebuild_into_temporary writes the new content into a temporary file, then renames it over the destination
+ * @param source_fd is the source file
+ * @param destination_fd is the destination file
+ * @param destination_path is the path of the destination
+ * @param mode is the access mode of the new file
+ * @param operations is a pointer to the list of operations
+ * @param buffer is a buffer of DELTA_READ_SIZE bytes
+ * @param context is a pointer to an XXH64 digest context
+ * @param source_digest is the XXH64 of the source, the new file replaces the destination only if it matches
+ * @return 0 in case of success, -1 else
+ */
+static int rebuild_into_temporary(int source_fd, int destination_fd, char *destination_path, mode_t mode, delta_operations_t *operations, uint8_t *buffer, digest_context_t *context, const uint8_t *source_digest) {
+    char temporary_path[PATH_SIZE];
+    if (snprintf(temporary_path, sizeof(temporary_path), "%s.XXXXXX", destination_path) >= (int)sizeof(temporary_path)) {
+        return -1;
+    }
+    int temporary_fd = mkstemp(temporary_path);
+    if (temporary_fd == -1) {
+        return -1;
+    }
+    uint64_t offset = 0;
+    int result = reset_digest(context);
+    for (size_t i=0; result == 0 && i<operations->count; ++i) {
+        delta_operation_t *operation = &operations->operations[i];
+        if (operation->is_literal) {
+            result = transfer_range(source_fd, operation->source_offset, temporary_fd, offset, operation->length, buffer, context);
+        } else {
+            result = transfer_range(destination_fd, operation->destination_offset, temporary_fd, offset, operation->length, buffer, context);
+        }
+        offset += operation->length;
+    }
+    uint8_t digest[8];
+    if (result == 0 && (final_digest(context, digest) == -1 || memcmp(digest, source_digest, sizeof(digest)) != 0)) {
+        result = -1;
+    }
+    if (fchmod(temporary_fd, mode & 07777) == -1) {
+        result = -1;
+    }
+    if (close(temporary_fd) == -1 || result == -1 || rename(temporary_path, destination_path) == -1) {
+        unlink(temporary_path);
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief delta_copy_file updates an existing destination so that it equals the source, writing only what differs
+ * If it fails, the destination may be partly updated and must be copied as a whole. It also fails when the result
+ * does not have the XXH64 of the source, in case blocks were matched wrongly or the source changed meanwhile.
+ * @param source_fd is the source file, opened for reading
+ * @param destination_fd is the destination file, opened for reading and writing
+ * @param destination_path is the path of the destination, used when it must be replaced
+ * @param mode is the access mode of the source
+ * @param result receives the amounts of data reused and written
+ * @return 0 in case of success, -1 else
+ */
+int delta_copy_file(int source_fd, int destination_fd, char *destination_path, mode_t mode, delta_result_t *result) {
+    struct stat source_stat, destination_stat;
+    if (fstat(source_fd, &source_stat) == -1 || fstat(destination_fd, &destination_stat) == -1) {
+        return -1;
+    }
+    digest_context_t context, file_context;
+    if (init_digest(&context, DIGEST_XXH64) == -1) {
+        return -1;
+    }
+    if (init_digest(&file_context, DIGEST_XXH64) == -1) {
+        free_digest(&context);
+        return -1;
+    }
+    uint8_t *buffer = malloc(DELTA_READ_SIZE);
+    delta_signature_t signature = {0, 0, NULL, NULL, NULL};
+    delta_operations_t operations = {NULL, 0, 0};
+    uint64_t source_size = 0;
+    uint8_t source_digest[8], result_digest[8];
+    size_t block_size = get_delta_block_size((uint64_t)source_stat.st_size);
+    if (!buffer || make_signature(destination_fd, (uint64_t)destination_stat.st_size, block_size, &context, buffer, &signature) == -1) {
+        free(buffer);
+        free_digest(&context);
+        free_digest(&file_context);
+        return -1;
+    }
+    int status = match_source(source_fd, &signature, &context, &operations, &file_context, &source_size);
+    free_signature(&signature);
+    if (status == 0) {
+        status = final_digest(&file_context, source_digest);
+    }
+    // Blocks found at another offset, a repeated block or a page of zeros for instance, are only worth a rebuild
+    // when they are most of the reused data. Else they are written from the source like literal data.
+    uint64_t aligned_bytes = 0, moved_bytes = 0, literal_bytes = 0;
+    for (size_t i=0; i<operations.count; ++i) {
+        delta_operation_t *operation = &operations.operations[i];
+        if (operation->is_literal) {
+            literal_bytes += operation->length;
+        } else if (operation->source_offset == operation->destination_offset) {
+            aligned_bytes += operation->length;
+        } else {
+            moved_bytes += operation->length;
+        }
+    }
+    result->in_place = (moved_bytes <= aligned_bytes);
+    if (status == 0 && result->in_place) {
+        result->matched_bytes = aligned_bytes;
+        result->written_bytes = literal_bytes + moved_bytes;
+        for (size_t i=0; status == 0 && i<operations.count; ++i) {
+            delta_operation_t *operation = &operations.operations[i];
+            if (operation->is_literal || operation->source_offset != operation->destination_offset) {
+                status = transfer_range(source_fd, operation->source_offset, destination_fd, operation->source_offset, operation->length, buffer, NULL);
+            }
+        }
+        if (status == 0 && (uint64_t)destination_stat.st_size != source_size && ftruncate(destination_fd, (off_t)source_size) == -1) {
+            status = -1;
+        }
+        if (status == 0 && (hash_file(destination_fd, &context, buffer, result_digest) == -1 || memcmp(result_digest, source_digest, sizeof(result_digest)) != 0)) {
+            status = -1;
+        }
+    } else if (status == 0) {
+        result->matched_bytes = aligned_bytes + moved_bytes;
+        result->written_bytes = source_size;
+        status = rebuild_into_temporary(source_fd, destination_fd, destination_path, mode, &operations, buffer, &context, source_digest);
+    }
+    free_digest(&context);
+    free_digest(&file_context);
+    free(operations.operations);
+    free(buffer);
+    return status;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Smallest files (source and destination) updated with a delta, smaller ones are copied as a whole
+#define DELTA_MIN_FILE_SIZE (16 * 1024 * 1024)
+// Size of the blocks compared, about the square root of the file size between these bounds
+#define DELTA_MIN_BLOCK_SIZE (8 * 1024)
+#define DELTA_MAX_BLOCK_SIZE (256 * 1024)
+// Size of the reads of the source and destination
+#define DELTA_READ_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+    uint64_t matched_bytes; // Data of the source found in the destination
+    uint64_t written_bytes; // Data written in the destination
+    bool in_place; // The destination has been rewritten where it differs, else it has been replaced
+} delta_result_t;
+
+size_t get_delta_block_size(uint64_t size);
+int delta_copy_file(int source_fd, int destination_fd, char *destination_path, mode_t mode, delta_result_t *result);
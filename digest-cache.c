@@ -0,0 +1,213 @@
+#include <digest-cache.h>
+#include <defines.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Functions in this file implement a persistent cache of file digests. A file whose device, inode, size and mtime
+// did not change since the previous run keeps its digest, so it is not read again.
+// The cache is loaded by the main process before forking and only read while the lists are built, so
+// analyzer processes and threads share it without locking. The main process then saves the digests of both
+// lists, which also drops the files that have been deleted.
+
+typedef struct {
+    digest_cache_record_t *records;
+    size_t count;
+    uint32_t *slots; // Open addressing on (device, inode), index of the record + 1, 0 when empty
+    size_t capacity; // Always a power of two
+} digest_cache_t;
+
+static digest_cache_t cache = {NULL, 0, NULL, 0};
+
+/*!
+ * @brief hash_file_identity mixes the device and inode of a file
+ * @param device is the device of the file
+ * @param inode is the inode of the file
+ * @return the hash
+ */
+static uint64_t hash_file_identity(uint64_t device, uint64_t inode) {
+    uint64_t hash = inode ^ (device * 0x9e3779b97f4a7c15ULL);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/*!
+ * @brief find_slot finds the slot of a file in the cache table
+ * @param device is the device of the file
+ * @param inode is the inode of the file
+ * @return a pointer to the slot holding the file, or to the empty slot where it would be
+ */
+static uint32_t *find_slot(uint64_t device, uint64_t inode) {
+    size_t mask = cache.capacity - 1;
+    for (size_t i = hash_file_identity(device, inode) & mask; ; i = (i + 1) & mask) {
+        uint32_t slot = cache.slots[i];
+        if (slot == 0 || (cache.records[slot - 1].device == device && cache.records[slot - 1].inode == inode)) {
+            return &cache.slots[i];
+        }
+    }
+}
+
+/*!
+ * @brief load_digest_cache loads a cache file, a missing or invalid file gives an empty cache
+ * @param cache_path is the path of the cache file
+ * @return 0 in case of success (even if the file does not exist), -1 else
+ */
+int load_digest_cache(char *cache_path) {
+    clear_digest_cache();
+    if (!cache_path) {
+        return -1;
+    }
+    int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    digest_cache_header_t header;
+    struct stat buf;
+    if (read(fd, &header, sizeof(header)) != sizeof(header) || memcmp(header.magic, DIGEST_CACHE_MAGIC, sizeof(header.magic)) != 0
+            || header.record_size != sizeof(digest_cache_record_t) || header.count >= UINT32_MAX
+            || fstat(fd, &buf) == -1 || (uint64_t)buf.st_size != sizeof(header) + header.count * sizeof(digest_cache_record_t)) {
+        close(fd);
+        return 0;
+    }
+    cache.capacity = 16;
+    while (cache.capacity < 2 * header.count) {
+        cache.capacity *= 2;
+    }
+    cache.records = malloc(header.count * sizeof(digest_cache_record_t) + 1);
+    cache.slots = calloc(cache.capacity, sizeof(uint32_t));
+    if (!cache.records || !cache.slots) {
+        close(fd);
+        clear_digest_cache();
+        return -1;
+    }
+    size_t to_read = header.count * sizeof(digest_cache_record_t);
+    for (size_t done = 0; done < to_read; ) {
+        ssize_t read_bytes = read(fd, (uint8_t *)cache.records + done, to_read - done);
+        if (read_bytes <= 0) {
+            if (read_bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            clear_digest_cache();
+            return -1;
+        }
+        done += read_bytes;
+    }
+    close(fd);
+    cache.count = header.count;
+    for (size_t i=0; i<cache.count; ++i) {
+        // Hard links give the same file twice, the last record wins
+        *find_slot(cache.records[i].device, cache.records[i].inode) = (uint32_t)(i + 1);
+    }
+    return 0;
+}
+
+/*!
+ * @brief find_cached_digest looks for the digest of a file in the cache
+ * The entry must hold the properties of the file (@see set_file_stats).
+ * @param entry is a pointer to the entry, its digest is set when found
+ * @param algorithm is the algorithm of the requested digest
+ * @return true if the file did not change since its digest was cached with the same algorithm, false else
+ */
+bool find_cached_digest(files_list_entry_t *entry, digest_algorithm_t algorithm) {
+    if (!entry || cache.count == 0 || entry->entry_type != FICHIER) {
+        return false;
+    }
+    uint32_t slot = *find_slot(entry->device, entry->inode);
+    if (slot == 0) {
+        return false;
+    }
+    digest_cache_record_t *record = &cache.records[slot - 1];
+    if (record->digest_algorithm != algorithm || record->size != entry->size || record->mtime_sec != entry->mtime.tv_sec || record->mtime_nsec != (uint32_t)entry->mtime.tv_nsec) {
+        return false;
+    }
+    entry->digest_algorithm = record->digest_algorithm;
+    memcpy(entry->digest, record->digest, sizeof(entry->digest));
+    return true;
+}
+
+/*!
+ * @brief write_list_records writes the records of the hashed files of a list
+ * @param file is the cache file being written
+ * @param list is a pointer to the list
+ * @return the number of records written, -1 in case of error
+ */
+static int64_t write_list_records(FILE *file, files_list_t *list) {
+    int64_t count = 0;
+    for (files_list_entry_t *cursor = list ? list->head : NULL; cursor != NULL; cursor=cursor->next) {
+        if (cursor->entry_type != FICHIER || cursor->digest_algorithm == DIGEST_NONE || cursor->inode == 0) {
+            continue;
+        }
+        digest_cache_record_t record = {
+                cursor->device, cursor->inode, cursor->size, cursor->mtime.tv_sec, (uint32_t)cursor->mtime.tv_nsec,
+                cursor->digest_algorithm, {0}, {0}
+        };
+        memcpy(record.digest, cursor->digest, sizeof(record.digest));
+        if (fwrite(&record, sizeof(record), 1, file) != 1) {
+            return -1;
+        }
+        ++count;
+    }
+    return count;
+}
+
+/*!
+ * @brief save_digest_cache replaces the cache file with the digests of both lists
+ * The file is written next to its final path, then renamed, so that an interrupted run keeps the old cache.
+ * @param cache_path is the path of the cache file
+ * @param source is a pointer to the source list
+ * @param destination is a pointer to the destination list
+ * @return 0 in case of success, -1 else
+ */
+int save_digest_cache(char *cache_path, files_list_t *source, files_list_t *destination) {
+    char temporary_path[PATH_SIZE];
+    if (!cache_path || snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", cache_path) >= (int)sizeof(temporary_path)) {
+        return -1;
+    }
+    FILE *file = fopen(temporary_path, "wb");
+    if (!file) {
+        return -1;
+    }
+    digest_cache_header_t header;
+    memcpy(header.magic, DIGEST_CACHE_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(digest_cache_record_t);
+    header.reserved = 0;
+    header.count = 0;
+    int64_t source_count, destination_count;
+    if (fwrite(&header, sizeof(header), 1, file) != 1
+            || (source_count = write_list_records(file, source)) == -1
+            || (destination_count = write_list_records(file, destination)) == -1) {
+        fclose(file);
+        unlink(temporary_path);
+        return -1;
+    }
+    header.count = (uint64_t)(source_count + destination_count);
+    if (fseek(file, 0, SEEK_SET) == -1 || fwrite(&header, sizeof(header), 1, file) != 1) {
+        fclose(file);
+        unlink(temporary_path);
+        return -1;
+    }
+    if (fclose(file) != 0 || rename(temporary_path, cache_path) == -1) {
+        unlink(temporary_path);
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief clear_digest_cache frees the loaded cache
+ */
+void clear_digest_cache(void) {
+    free(cache.records);
+    free(cache.slots);
+    cache.records = NULL;
+    cache.slots = NULL;
+    cache.count = 0;
+    cache.capacity = 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <files-list.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Default name of the cache file, at the root of the destination. The walker skips it when listing.
+#define DIGEST_CACHE_FILE_NAME ".lp25-backup-cache"
+#define DIGEST_CACHE_MAGIC "LP25DGC3"
+
+typedef struct {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint8_t digest_algorithm; // digest_algorithm_t of digest
+    uint8_t reserved[3];
+    uint8_t digest[DIGEST_MAX_SIZE];
+} digest_cache_record_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t record_size; // sizeof(digest_cache_record_t), a file with another layout is ignored
+    uint32_t reserved;
+    uint64_t count;
+} digest_cache_header_t;
+
+int load_digest_cache(char *cache_path);
+bool find_cached_digest(files_list_entry_t *entry, digest_algorithm_t algorithm);
+int save_digest_cache(char *cache_path, files_list_t *source, files_list_t *destination);
+void clear_digest_cache(void);
@@ -0,0 +1,300 @@
+#include <digest.h>
+#include <string.h>
+#include <strings.h>
+
+// Functions in this file hide the digest algorithms behind a single streaming interface.
+// MD5 and BLAKE2b come from libcrypto, XXH64 is implemented here: it runs four independent lanes over 32 bytes
+// stripes, so that the processor overlaps their multiplications, and reads inputs several times faster than MD5.
+
+#define XXH64_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH64_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH64_PRIME3 0x165667B19E3779F9ULL
+#define XXH64_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH64_PRIME5 0x27D4EB2F165667C5ULL
+
+typedef struct {
+    const char *name;
+    digest_algorithm_t algorithm;
+    size_t size;
+} digest_description_t;
+
+static const digest_description_t descriptions[] = {
+        {"md5", DIGEST_MD5, 16},
+        {"xxh64", DIGEST_XXH64, 8},
+        {"blake2b", DIGEST_BLAKE2B, 32},
+};
+
+/*!
+ * @brief get_digest_algorithm finds an algorithm by its name
+ * @param name is the name of the algorithm (md5, xxh64 or blake2b)
+ * @return the algorithm, DIGEST_NONE if the name is unknown
+ */
+digest_algorithm_t get_digest_algorithm(const char *name) {
+    for (size_t i=0; name && i<sizeof(descriptions)/sizeof(descriptions[0]); ++i) {
+        if (strcasecmp(name, descriptions[i].name) == 0) {
+            return descriptions[i].algorithm;
+        }
+    }
+    return DIGEST_NONE;
+}
+
+/*!
+ * @brief get_digest_name gives the name of an algorithm
+ * @param algorithm is the algorithm
+ * @return its name, "none" for DIGEST_NONE
+ */
+const char *get_digest_name(digest_algorithm_t algorithm) {
+    for (size_t i=0; i<sizeof(descriptions)/sizeof(descriptions[0]); ++i) {
+        if (descriptions[i].algorithm == algorithm) {
+            return descriptions[i].name;
+        }
+    }
+    return "none";
+}
+
+/*!
+ * @brief get_digest_size gives the number of bytes of the digests of an algorithm
+ * @param algorithm is the algorithm
+ * @return the size of its digests, 0 for DIGEST_NONE
+ */
+size_t get_digest_size(digest_algorithm_t algorithm) {
+    for (size_t i=0; i<sizeof(descriptions)/sizeof(descriptions[0]); ++i) {
+        if (descriptions[i].algorithm == algorithm) {
+            return descriptions[i].size;
+        }
+    }
+    return 0;
+}
+
+static inline uint64_t rotate_left(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t read_u64(const uint8_t *data) {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline uint32_t read_u32(const uint8_t *data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline uint64_t xxh64_round(uint64_t accumulator, uint64_t input) {
+    accumulator += input * XXH64_PRIME2;
+    accumulator = rotate_left(accumulator, 31);
+    return accumulator * XXH64_PRIME1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t accumulator, uint64_t lane) {
+    accumulator ^= xxh64_round(0, lane);
+    return accumulator * XXH64_PRIME1 + XXH64_PRIME4;
+}
+
+/*!
+ * @brief xxh64_consume_stripes runs the four lanes over whole 32 bytes stripes
+ * @param state is a pointer to the XXH64 state
+ * @param data is the input
+ * @param stripes is the number of stripes of data
+ */
+static void xxh64_consume_stripes(xxh64_state_t *state, const uint8_t *data, size_t stripes) {
+    uint64_t lane0 = state->lanes[0], lane1 = state->lanes[1], lane2 = state->lanes[2], lane3 = state->lanes[3];
+    for (size_t i=0; i<stripes; ++i, data += 32) {
+        lane0 = xxh64_round(lane0, read_u64(data));
+        lane1 = xxh64_round(lane1, read_u64(data + 8));
+        lane2 = xxh64_round(lane2, read_u64(data + 16));
+        lane3 = xxh64_round(lane3, read_u64(data + 24));
+    }
+    state->lanes[0] = lane0;
+    state->lanes[1] = lane1;
+    state->lanes[2] = lane2;
+    state->lanes[3] = lane3;
+}
+
+static void xxh64_init(xxh64_state_t *state) {
+    state->total_length = 0;
+    state->lanes[0] = XXH64_PRIME1 + XXH64_PRIME2;
+    state->lanes[1] = XXH64_PRIME2;
+    state->lanes[2] = 0;
+    state->lanes[3] = -XXH64_PRIME1;
+    state->buffered = 0;
+}
+
+static void xxh64_update(xxh64_state_t *state, const uint8_t *data, size_t length) {
+    state->total_length += length;
+    if (state->buffered > 0) {
+        size_t missing = 32 - state->buffered;
+        if (length < missing) {
+            memcpy(state->buffer + state->buffered, data, length);
+            state->buffered += length;
+            return;
+        }
+        memcpy(state->buffer + state->buffered, data, missing);
+        xxh64_consume_stripes(state, state->buffer, 1);
+        data += missing;
+        length -= missing;
+        state->buffered = 0;
+    }
+    xxh64_consume_stripes(state, data, length / 32);
+    data += length & ~(size_t)31;
+    length &= 31;
+    memcpy(state->buffer, data, length);
+    state->buffered = length;
+}
+
+static uint64_t xxh64_final(xxh64_state_t *state) {
+    uint64_t hash;
+    if (state->total_length >= 32) {
+        hash = rotate_left(state->lanes[0], 1) + rotate_left(state->lanes[1], 7) + rotate_left(state->lanes[2], 12) + rotate_left(state->lanes[3], 18);
+        for (int i=0; i<4; ++i) {
+            hash = xxh64_merge_round(hash, state->lanes[i]);
+        }
+    } else {
+        hash = XXH64_PRIME5;
+    }
+    hash += state->total_length;
+    const uint8_t *cursor = state->buffer;
+    const uint8_t *end = state->buffer + state->buffered;
+    for (; cursor + 8 <= end; cursor += 8) {
+        hash ^= xxh64_round(0, read_u64(cursor));
+        hash = rotate_left(hash, 27) * XXH64_PRIME1 + XXH64_PRIME4;
+    }
+    if (cursor + 4 <= end) {
+        hash ^= (uint64_t)read_u32(cursor) * XXH64_PRIME1;
+        hash = rotate_left(hash, 23) * XXH64_PRIME2 + XXH64_PRIME3;
+        cursor += 4;
+    }
+    for (; cursor < end; ++cursor) {
+        hash ^= (*cursor) * XXH64_PRIME5;
+        hash = rotate_left(hash, 11) * XXH64_PRIME1;
+    }
+    hash ^= hash >> 33;
+    hash *= XXH64_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH64_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/*!
+ * @brief get_evp_digest gives the libcrypto digest of an algorithm
+ * @param algorithm is the algorithm
+ * @return the digest, NULL if libcrypto does not compute it
+ */
+static const EVP_MD *get_evp_digest(digest_algorithm_t algorithm) {
+    switch (algorithm) {
+        case DIGEST_MD5:
+            return EVP_md5();
+        case DIGEST_BLAKE2B:
+            return EVP_blake2b512();
+        default:
+            return NULL;
+    }
+}
+
+/*!
+ * @brief init_digest prepares a context to compute a digest
+ * @param context is a pointer to the context
+ * @param algorithm is the algorithm to use
+ * @return 0 in case of success, -1 else
+ */
+int init_digest(digest_context_t *context, digest_algorithm_t algorithm) {
+    if (!context) {
+        return -1;
+    }
+    context->algorithm = algorithm;
+    context->evp = NULL;
+    switch (algorithm) {
+        case DIGEST_XXH64:
+            xxh64_init(&context->xxh64);
+            return 0;
+        case DIGEST_MD5:
+        case DIGEST_BLAKE2B:
+            context->evp = EVP_MD_CTX_new();
+            if (!context->evp) {
+                return -1;
+            }
+            if (EVP_DigestInit_ex(context->evp, get_evp_digest(algorithm), NULL) != 1) {
+                free_digest(context);
+                return -1;
+            }
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/*!
+ * @brief reset_digest starts a new digest with the algorithm of an initialized context
+ * Unlike init_digest, it keeps the libcrypto context, so hashing many files does not allocate one per file.
+ * @param context is a pointer to the context
+ * @return 0 in case of success, -1 else
+ */
+int reset_digest(digest_context_t *context) {
+    if (!context) {
+        return -1;
+    }
+    if (context->algorithm == DIGEST_XXH64) {
+        xxh64_init(&context->xxh64);
+        return 0;
+    }
+    return (context->evp && EVP_DigestInit_ex(context->evp, get_evp_digest(context->algorithm), NULL) == 1) ? 0 : -1;
+}
+
+/*!
+ * @brief update_digest adds data to a digest
+ * @param context is a pointer to the context
+ * @param data is the data to add
+ * @param length is the length of data
+ * @return 0 in case of success, -1 else
+ */
+int update_digest(digest_context_t *context, const void *data, size_t length) {
+    if (!context) {
+        return -1;
+    }
+    if (context->algorithm == DIGEST_XXH64) {
+        xxh64_update(&context->xxh64, data, length);
+        return 0;
+    }
+    return (context->evp && EVP_DigestUpdate(context->evp, data, length) == 1) ? 0 : -1;
+}
+
+/*!
+ * @brief final_digest ends a digest, the context can then be reset or freed
+ * @param context is a pointer to the context
+ * @param digest is the output, get_digest_size bytes long
+ * @return 0 in case of success, -1 else
+ */
+int final_digest(digest_context_t *context, uint8_t *digest) {
+    if (!context || !digest) {
+        return -1;
+    }
+    if (context->algorithm == DIGEST_XXH64) {
+        uint64_t hash = xxh64_final(&context->xxh64);
+        // Canonical (big endian) representation
+        for (int i=0; i<8; ++i) {
+            digest[i] = (uint8_t)(hash >> (56 - 8 * i));
+        }
+        return 0;
+    }
+    unsigned char value[EVP_MAX_MD_SIZE];
+    unsigned int value_length;
+    if (!context->evp || EVP_DigestFinal_ex(context->evp, value, &value_length) != 1) {
+        return -1;
+    }
+    memcpy(digest, value, get_digest_size(context->algorithm));
+    return 0;
+}
+
+/*!
+ * @brief free_digest frees the resources of a context
+ * @param context is a pointer to the context
+ */
+void free_digest(digest_context_t *context) {
+    if (context && context->evp) {
+        EVP_MD_CTX_free(context->evp);
+        context->evp = NULL;
+    }
+}
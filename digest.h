@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/evp.h>
+
+// Largest digest kept in a files list entry, longer digests are truncated
+#define DIGEST_MAX_SIZE 32
+
+typedef enum {
+    DIGEST_NONE = 0, // No digest computed
+    DIGEST_MD5 = 1,
+    DIGEST_XXH64 = 2, // Non cryptographic, for change detection only
+    DIGEST_BLAKE2B = 3, // BLAKE2b-512 truncated to 256 bits
+} digest_algorithm_t;
+
+typedef struct {
+    uint64_t total_length;
+    uint64_t lanes[4];
+    uint8_t buffer[32]; // Input not yet consumed by a full stripe
+    size_t buffered;
+} xxh64_state_t;
+
+typedef struct {
+    digest_algorithm_t algorithm;
+    EVP_MD_CTX *evp; // OpenSSL context of MD5 and BLAKE2b
+    xxh64_state_t xxh64;
+} digest_context_t;
+
+digest_algorithm_t get_digest_algorithm(const char *name);
+const char *get_digest_name(digest_algorithm_t algorithm);
+size_t get_digest_size(digest_algorithm_t algorithm);
+int init_digest(digest_context_t *context, digest_algorithm_t algorithm);
+int reset_digest(digest_context_t *context);
+int update_digest(digest_context_t *context, const void *data, size_t length);
+int final_digest(digest_context_t *context, uint8_t *digest);
+void free_digest(digest_context_t *context);
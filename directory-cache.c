@@ -0,0 +1,173 @@
+#include <directory-cache.h>
+#include <files-list.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Functions in this file create the directories of the destination before files are copied into them.
+// Each directory is created once with mkdirat relative to its parent, whose descriptor is kept open on a stack
+// holding the chain of the last directory: files are copied in the order of their paths, so the next directory
+// usually shares most of this chain and the kernel does not resolve full paths again.
+// A set remembers the directories created or found, so a directory seen again costs no system call.
+
+/*!
+ * @brief find_known finds the slot of a directory in the set of known directories
+ * @param cache is a pointer to the cache
+ * @param path is the path of the directory, relative to the root
+ * @param length is the length of the path
+ * @return a pointer to the slot holding the directory, or to the empty slot where it would be
+ */
+static char **find_known(directory_cache_t *cache, const char *path, size_t length) {
+    size_t mask = cache->known_capacity - 1;
+    for (size_t i = hash_relative_path(path, length) & mask; ; i = (i + 1) & mask) {
+        char *known = cache->known[i];
+        if (!known || (strncmp(known, path, length) == 0 && known[length] == '\0')) {
+            return &cache->known[i];
+        }
+    }
+}
+
+/*!
+ * @brief add_known adds a directory to the set of known directories
+ * @param cache is a pointer to the cache
+ * @param path is the path of the directory, relative to the root
+ * @param length is the length of the path
+ * @return 0 in case of success, -1 else
+ */
+static int add_known(directory_cache_t *cache, const char *path, size_t length) {
+    if (2 * (cache->known_count + 1) > cache->known_capacity) {
+        size_t capacity = 2 * cache->known_capacity;
+        char **known = calloc(capacity, sizeof(char *));
+        if (!known) {
+            return -1;
+        }
+        char **old_known = cache->known;
+        size_t old_capacity = cache->known_capacity;
+        cache->known = known;
+        cache->known_capacity = capacity;
+        for (size_t i=0; i<old_capacity; ++i) {
+            if (old_known[i]) {
+                *find_known(cache, old_known[i], strlen(old_known[i])) = old_known[i];
+            }
+        }
+        free(old_known);
+    }
+    char **slot = find_known(cache, path, length);
+    if (!*slot) {
+        *slot = strndup(path, length);
+        if (!*slot) {
+            return -1;
+        }
+        ++cache->known_count;
+    }
+    return 0;
+}
+
+/*!
+ * @brief init_directory_cache initializes a cache on an existing root directory
+ * @param cache is a pointer to the cache
+ * @param root is the path of the root directory
+ * @return 0 in case of success, -1 else
+ */
+int init_directory_cache(directory_cache_t *cache, char *root) {
+    cache->path[0] = '\0';
+    cache->ends[0] = 0;
+    cache->depth = 0;
+    cache->known_count = 0;
+    cache->known_capacity = 1024;
+    cache->created_count = 0;
+    cache->known = calloc(cache->known_capacity, sizeof(char *));
+    cache->fds[0] = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (!cache->known || cache->fds[0] == -1) {
+        free_directory_cache(cache);
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief make_directory creates a directory and its missing parents
+ * @param cache is a pointer to the cache
+ * @param relative_path is the path of the directory, relative to the root, without trailing /
+ * @return 0 in case of success (the directory exists), -1 else
+ */
+int make_directory(directory_cache_t *cache, const char *relative_path) {
+    size_t length = strlen(relative_path);
+    if (length == 0 || *find_known(cache, relative_path, length)) {
+        return 0;
+    }
+    if (length >= PATH_SIZE) {
+        return -1;
+    }
+    // Closes the directories of the chain that are not parents of relative_path
+    while (cache->depth > 0) {
+        size_t end = cache->ends[cache->depth];
+        if (end <= length && strncmp(cache->path, relative_path, end) == 0 && (relative_path[end] == '/' || relative_path[end] == '\0')) {
+            break;
+        }
+        close(cache->fds[cache->depth]);
+        --cache->depth;
+    }
+    char path[PATH_SIZE];
+    memcpy(path, relative_path, length + 1);
+    size_t start = cache->ends[cache->depth] + (cache->depth > 0 ? 1 : 0);
+    while (start < length) {
+        char *separator = strchr(path + start, '/');
+        size_t end = separator ? (size_t)(separator - path) : length;
+        int parent_fd = cache->fds[cache->depth];
+        // Beyond the stack, the remaining directories are created relative to its deepest directory
+        size_t name_start = (cache->depth < DIRECTORY_STACK_SIZE) ? start : cache->ends[cache->depth] + (cache->depth > 0 ? 1 : 0);
+        path[end] = '\0';
+        if (!*find_known(cache, path, end)) {
+            if (mkdirat(parent_fd, path + name_start, 0777) == 0) {
+                ++cache->created_count;
+            } else if (errno != EEXIST) {
+                return -1;
+            }
+            if (add_known(cache, path, end) == -1) {
+                return -1;
+            }
+        }
+        if (cache->depth < DIRECTORY_STACK_SIZE) {
+            int fd = openat(parent_fd, path + name_start, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd == -1) {
+                return -1;
+            }
+            if (start > 0) {
+                cache->path[start - 1] = '/';
+            }
+            memcpy(cache->path + start, path + start, end - start + 1);
+            ++cache->depth;
+            cache->fds[cache->depth] = fd;
+            cache->ends[cache->depth] = end;
+        }
+        if (separator) {
+            *separator = '/';
+        }
+        start = end + 1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief free_directory_cache closes the directories of a cache and frees its set
+ * @param cache is a pointer to the cache
+ */
+void free_directory_cache(directory_cache_t *cache) {
+    for (int i=0; i<=cache->depth; ++i) {
+        if (cache->fds[i] != -1) {
+            close(cache->fds[i]);
+        }
+    }
+    cache->depth = 0;
+    cache->fds[0] = -1;
+    for (size_t i=0; cache->known && i<cache->known_capacity; ++i) {
+        free(cache->known[i]);
+    }
+    free(cache->known);
+    cache->known = NULL;
+    cache->known_count = 0;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <defines.h>
+
+// Directories of the current chain that keep an open descriptor, deeper ones are created relative to the deepest
+#define DIRECTORY_STACK_SIZE 64
+
+typedef struct {
+    char path[PATH_SIZE]; // Chain of open directories, relative to the root
+    int fds[DIRECTORY_STACK_SIZE + 1]; // fds[0] is the root, fds[i] the i-th directory of path
+    size_t ends[DIRECTORY_STACK_SIZE + 1]; // Length of path up to the i-th directory
+    int depth;
+    char **known; // Open addressing set of the directories created or found, relative to the root
+    size_t known_count;
+    size_t known_capacity; // Always a power of two
+    uint64_t created_count; // Number of directories created
+} directory_cache_t;
+
+int init_directory_cache(directory_cache_t *cache, char *root);
+int make_directory(directory_cache_t *cache, const char *relative_path);
+void free_directory_cache(directory_cache_t *cache);
@@ -1,15 +1,19 @@
+#define _GNU_SOURCE
 #include "file-properties.h"
 #include "sync.h"
 #include <sys/stat.h>
 #include <dirent.h>
-#include <openssl/evp.h>
+#include <digest.h>
 #include <unistd.h>
 #include <assert.h>
 #include <string.h>
 #include "defines.h"
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <utility.h>
+#include <multi-buffer-md5.h>
 
 /*!
  * @brief get_file_stats gets all of the required information for a file (inc. directories)
@@ -20,10 +24,10 @@
  *   - mtime (in nanoseconds)
  *   - size
  *   - entry type (FICHIER)
- *   - MD5 sum
  * - for directories:
  *   - mode
  *   - entry type (DOSSIER)
+ * The digest is only computed when comparing files with the same properties (@see compute_missing_digests)
  * @return -1 in case of error, 0 else
  */
 int get_file_stats(files_list_entry_t *entry) {
@@ -31,20 +35,31 @@ int get_file_stats(files_list_entry_t *entry) {
     if (stat(entry->path_and_name, &buf)) {
        return -1;
     }
+    return set_file_stats(entry, &buf);
+}
+
+/*!
+ * @brief set_file_stats copies the properties of a file from the result of stat into its entry
+ * It is shared by get_file_stats and the directory walker, which gets them with fstatat.
+ * @param entry is a pointer to the files list entry
+ * @param buf is the result of a stat call on the file
+ * @return -1 if the file is neither a regular file nor a directory, 0 else
+ */
+int set_file_stats(files_list_entry_t *entry, struct stat *buf) {
     // if entry is File
-    if (S_ISREG(buf.st_mode)) {
+    if (S_ISREG(buf->st_mode)) {
         entry->entry_type = FICHIER;
-        entry->mode = buf.st_mode;
-        entry->mtime.tv_sec = buf.st_mtime;
-        entry->mtime.tv_nsec = buf.st_mtime/100;
-        entry->size = buf.st_size;
-        compute_file_md5(entry);
+        entry->mode = buf->st_mode;
+        entry->mtime = buf->st_mtim;
+        entry->size = buf->st_size;
+        entry->device = buf->st_dev;
+        entry->inode = buf->st_ino;
         return 0;
     }
     //if entry is Directories
-    if (S_ISDIR(buf.st_mode)) {
+    if (S_ISDIR(buf->st_mode)) {
         entry->entry_type = DOSSIER;
-        entry->mode = buf.st_mode;
+        entry->mode = buf->st_mode;
         return 0;
     }
     return -1;
@@ -54,48 +69,369 @@ int get_file_stats(files_list_entry_t *entry) {
  * @brief compute_file_md5 computes a file's MD5 sum
  * @param the pointer to the files list entry
  * @return -1 in case of error, 0 else
- * Use libcrypto functions from openssl/evp.h
  */
 int compute_file_md5(files_list_entry_t *entry) {
-    FILE *f = fopen(entry->path_and_name, "rb");
-    if (!f) {
-        printf("Erreur dans l'ouverture du fichier");
+    return compute_file_digest(entry, DIGEST_MD5);
+}
+
+/*!
+ * @brief compute_file_digest computes a file's digest
+ * It uses a reader for this file only, workers hashing many files keep their own (@see hash_file).
+ * @param entry is a pointer to the files list entry, its digest is left unset in case of error
+ * @param algorithm is the algorithm of the digest (@see digest.h)
+ * @return -1 in case of error, 0 else
+ */
+int compute_file_digest(files_list_entry_t *entry, digest_algorithm_t algorithm) {
+    entry->digest_algorithm = DIGEST_NONE;
+    hashing_reader_t reader;
+    if (init_hashing_reader(&reader, algorithm, 16 * HASH_BUFFER_ALIGNMENT, false) == -1) {
+        printf("Unknown message digest\n");
         return -1;
     }
+    int result = hash_file(&reader, entry);
+    free_hashing_reader(&reader);
+    return result;
+}
 
-    //INITIALISATION
-    EVP_MD_CTX *operations; //Structure représentant le contexte de hachage
-    const EVP_MD *hachage; //Structure vers un algorithme de hachage
-    unsigned char buffer[PATH_SIZE];
-    unsigned char md5_valeur[EVP_MAX_MD_SIZE]; //Création d'un tableau pouvant contenir au maximum 128 bits
-    unsigned int digest_len;
-    OpenSSL_add_all_digests();
-    hachage = EVP_get_digestbyname("md5");
-    if (!hachage) {
-        printf("Unknown message digest\n");
+/*!
+ * @brief init_hashing_reader prepares a reader, to be used by a single worker
+ * @param reader is a pointer to the reader
+ * @param algorithm is the algorithm of the digests
+ * @param buffer_size is the size of each read, rounded up to a multiple of HASH_BUFFER_ALIGNMENT
+ * @param direct_io is true to read files with O_DIRECT
+ * @return 0 in case of success, -1 else
+ */
+int init_hashing_reader(hashing_reader_t *reader, digest_algorithm_t algorithm, size_t buffer_size, bool direct_io) {
+    if (!reader) {
+        return -1;
+    }
+    reader->buffer_size = (buffer_size + HASH_BUFFER_ALIGNMENT - 1) & ~(size_t)(HASH_BUFFER_ALIGNMENT - 1);
+    if (reader->buffer_size == 0) {
+        reader->buffer_size = HASH_BUFFER_ALIGNMENT;
+    }
+    reader->direct_io = direct_io;
+    if (init_digest(&reader->context, algorithm) == -1) {
+        return -1;
+    }
+    void *buffer;
+    if (posix_memalign(&buffer, HASH_BUFFER_ALIGNMENT, reader->buffer_size) != 0) {
+        free_digest(&reader->context);
+        return -1;
+    }
+    reader->buffer = buffer;
+    return 0;
+}
+
+/*!
+ * @brief open_for_hashing opens a file to be read once from start to end
+ * @param path is the path of the file
+ * @param direct_io is true to bypass the page cache, the file is opened normally if its file system refuses O_DIRECT
+ * @return the file descriptor, -1 in case of error
+ */
+static int open_for_hashing(char *path, bool direct_io) {
+    int fd = -1;
+    if (direct_io) {
+        fd = open(path, O_RDONLY | O_CLOEXEC | O_DIRECT);
+        if (fd != -1 || errno != EINVAL) {
+            return fd;
+        }
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        // Lets the kernel read ahead further, the file is read only once
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    return fd;
+}
+
+/*!
+ * @brief hash_file computes a file's digest with the algorithm of a reader
+ * The chunks of a large file are hashed one after the other, workers sharing them use hash_file_chunk instead.
+ * @param reader is a pointer to the reader
+ * @param entry is a pointer to the files list entry, its digest is left unset in case of error
+ * @return -1 in case of error, 0 else
+ */
+int hash_file(hashing_reader_t *reader, files_list_entry_t *entry) {
+    entry->digest_algorithm = DIGEST_NONE;
+    if (get_chunks_count(entry->size) > 1) {
+        chunked_file_t file;
+        if (init_chunked_file(&file, entry, reader->context.algorithm) == -1) {
+            return -1;
+        }
+        size_t digest_size = get_digest_size(file.algorithm);
+        for (uint64_t chunk=0; chunk<file.chunks_count; ++chunk) {
+            if (hash_file_chunk(reader, entry->path_and_name, entry->size, chunk, file.chunk_digests + chunk * digest_size) == -1) {
+                break;
+            }
+            file.chunk_hashed[chunk] = true;
+        }
+        return finish_chunked_file(&file);
+    }
+    int fd = open_for_hashing(entry->path_and_name, reader->direct_io);
+    if (fd == -1) {
+        printf("Erreur dans l'ouverture du fichier %s\n", entry->path_and_name);
+        return -1;
+    }
+    if (reset_digest(&reader->context) == -1) {
+        close(fd);
+        return -1;
+    }
+    ssize_t bytes;
+    // With O_DIRECT, every read but the last one is a whole buffer, so offsets stay aligned
+    while ((bytes = read(fd, reader->buffer, reader->buffer_size)) != 0) {
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return -1;
+        }
+        update_digest(&reader->context, reader->buffer, (size_t)bytes);
+    }
+    close(fd);
+    if (final_digest(&reader->context, entry->digest) == -1) {
+        return -1;
+    }
+    entry->digest_algorithm = reader->context.algorithm;
+    return 0;
+}
+
+/*!
+ * @brief get_chunks_count gives the number of chunks of a file
+ * @param size is the size of the file when it was listed
+ * @return the number of chunks, 1 for the files hashed as a whole
+ */
+uint64_t get_chunks_count(uint64_t size) {
+    return (size <= LARGE_FILE_CHUNK_SIZE) ? 1 : (size + LARGE_FILE_CHUNK_SIZE - 1) / LARGE_FILE_CHUNK_SIZE;
+}
+
+/*!
+ * @brief hash_file_chunk computes the digest of a chunk of a large file
+ * The chunks are LARGE_FILE_CHUNK_SIZE long, except the last one which ends with the file, even if it grew since
+ * it was listed: all the workers cut a file the same way.
+ * @param reader is a pointer to the reader, whose algorithm is used
+ * @param path is the path of the file
+ * @param size is the size of the file when it was listed
+ * @param chunk is the index of the chunk
+ * @param digest receives the digest of the chunk
+ * @return -1 in case of error, 0 else
+ */
+int hash_file_chunk(hashing_reader_t *reader, char *path, uint64_t size, uint64_t chunk, uint8_t *digest) {
+    uint64_t chunks_count = get_chunks_count(size);
+    if (chunk >= chunks_count) {
         return -1;
     }
-    operations = EVP_MD_CTX_new();
-    if (!operations) {
-        printf("Error creating context\n");
+    int fd = open_for_hashing(path, reader->direct_io);
+    if (fd == -1) {
+        printf("Erreur dans l'ouverture du fichier %s\n", path);
         return -1;
     }
-    EVP_DigestInit_ex(operations, hachage, NULL);
-    //HACHAGE
-    while (1) {
-        int bytes = (int)fread(buffer, 1, PATH_SIZE, f);
-        if (bytes <= 0) break;
-        EVP_DigestUpdate(operations, buffer, bytes);
+    if (reset_digest(&reader->context) == -1) {
+        close(fd);
+        return -1;
     }
+    // Offsets are multiples of the chunk size and reads multiples of HASH_BUFFER_ALIGNMENT, as O_DIRECT requires
+    off_t offset = (off_t)(chunk * LARGE_FILE_CHUNK_SIZE);
+    uint64_t remaining = (chunk == chunks_count - 1) ? UINT64_MAX : LARGE_FILE_CHUNK_SIZE;
+    while (remaining > 0) {
+        size_t to_read = (remaining < reader->buffer_size) ? (size_t)remaining : reader->buffer_size;
+        ssize_t bytes = pread(fd, reader->buffer, to_read, offset);
+        if (bytes == 0) {
+            break;
+        }
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return -1;
+        }
+        update_digest(&reader->context, reader->buffer, (size_t)bytes);
+        offset += bytes;
+        remaining -= (uint64_t)bytes;
+    }
+    close(fd);
+    return final_digest(&reader->context, digest);
+}
 
-    //CALCUL FIN
-    EVP_DigestFinal_ex(operations, md5_valeur, &digest_len);
-    EVP_MD_CTX_free(operations);
-    fclose(f);
-    memcpy(entry->md5sum, md5_valeur, sizeof(entry->md5sum));
+/*!
+ * @brief init_chunked_file prepares the digests of the chunks of a large file
+ * @param file is a pointer to the chunked file
+ * @param entry is a pointer to the entry of the file
+ * @param algorithm is the algorithm of the digests
+ * @return 0 in case of success, -1 else
+ */
+int init_chunked_file(chunked_file_t *file, files_list_entry_t *entry, digest_algorithm_t algorithm) {
+    if (!file || !entry) {
+        return -1;
+    }
+    file->entry = entry;
+    file->algorithm = algorithm;
+    file->chunks_count = get_chunks_count(entry->size);
+    file->chunk_digests = malloc(file->chunks_count * get_digest_size(algorithm));
+    file->chunk_hashed = calloc(file->chunks_count, sizeof(bool));
+    if (!file->chunk_digests || !file->chunk_hashed) {
+        free(file->chunk_digests);
+        free(file->chunk_hashed);
+        return -1;
+    }
     return 0;
 }
 
+/*!
+ * @brief finish_chunked_file sets the digest of a large file, from the digests of its chunks, then frees them
+ * @param file is a pointer to the chunked file
+ * @return 0 in case of success, -1 if a chunk could not be hashed
+ */
+int finish_chunked_file(chunked_file_t *file) {
+    if (!file) {
+        return -1;
+    }
+    int result = 0;
+    for (uint64_t chunk=0; chunk<file->chunks_count; ++chunk) {
+        if (!file->chunk_hashed[chunk]) {
+            result = -1;
+        }
+    }
+    digest_context_t context;
+    file->entry->digest_algorithm = DIGEST_NONE;
+    if (result == 0 && init_digest(&context, file->algorithm) == 0) {
+        update_digest(&context, file->chunk_digests, file->chunks_count * get_digest_size(file->algorithm));
+        if (final_digest(&context, file->entry->digest) == 0) {
+            file->entry->digest_algorithm = file->algorithm;
+        } else {
+            result = -1;
+        }
+        free_digest(&context);
+    } else {
+        result = -1;
+    }
+    free(file->chunk_digests);
+    free(file->chunk_hashed);
+    file->chunk_digests = NULL;
+    file->chunk_hashed = NULL;
+    return result;
+}
+
+/*!
+ * @brief read_small_file reads a whole small file into the buffer of a reader
+ * @param reader is a pointer to the reader
+ * @param entry is a pointer to the entry of the file
+ * @param buffer is where to read the file, in the buffer of the reader and aligned on HASH_BUFFER_ALIGNMENT
+ * @param max_length is the number of bytes available at buffer, a multiple of HASH_BUFFER_ALIGNMENT
+ * @return the size of the file, max_length if it is larger, -1 in case of error
+ */
+static ssize_t read_small_file(hashing_reader_t *reader, files_list_entry_t *entry, uint8_t *buffer, size_t max_length) {
+    int fd = open_for_hashing(entry->path_and_name, reader->direct_io);
+    if (fd == -1) {
+        printf("Erreur dans l'ouverture du fichier %s\n", entry->path_and_name);
+        return -1;
+    }
+    size_t length = 0;
+    while (length < max_length) {
+        ssize_t bytes = read(fd, buffer + length, max_length - length);
+        if (bytes == 0) {
+            break;
+        }
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return -1;
+        }
+        length += (size_t)bytes;
+    }
+    close(fd);
+    return (ssize_t)length;
+}
+
+/*!
+ * @brief hash_small_files computes the MD5 sums of small files already read by read_small_file
+ * @param files are the entries of the files
+ * @param contents are the contents of the files
+ * @param lengths are the sizes of the files
+ * @param count is the number of files
+ */
+static void hash_small_files(files_list_entry_t **files, const uint8_t **contents, size_t *lengths, size_t count) {
+    uint8_t digests[SMALL_FILES_GROUP_SIZE][MD5_DIGEST_SIZE];
+    md5_hash_messages(contents, lengths, count, digests);
+    for (size_t i=0; i<count; ++i) {
+        memcpy(files[i]->digest, digests[i], MD5_DIGEST_SIZE);
+        files[i]->digest_algorithm = DIGEST_MD5;
+    }
+}
+
+/*!
+ * @brief hash_files computes the digests of several files with the algorithm of a reader
+ * With MD5, the small files are read whole, then hashed together, several files per vector (@see multi-buffer-md5.c).
+ * Larger files, and files of other algorithms, are hashed one after the other by hash_file once the small files are done,
+ * so that they do not cut the groups of small files.
+ * @param reader is a pointer to the reader
+ * @param entries are the entries of the files, the digest of an entry is left unset in case of error
+ * @param count is the number of entries
+ * @return -1 if a file could not be hashed, 0 else
+ */
+int hash_files(hashing_reader_t *reader, files_list_entry_t **entries, size_t count) {
+    // One more aligned block than the largest small file, to see whether the file grew since it was listed
+    const size_t read_length = (SMALL_FILE_MAX_SIZE + HASH_BUFFER_ALIGNMENT) & ~(size_t)(HASH_BUFFER_ALIGNMENT - 1);
+    files_list_entry_t *files[SMALL_FILES_GROUP_SIZE];
+    const uint8_t *contents[SMALL_FILES_GROUP_SIZE];
+    size_t lengths[SMALL_FILES_GROUP_SIZE];
+    size_t grouped = 0, used = 0;
+    int result = 0;
+    bool groups_small_files = reader->context.algorithm == DIGEST_MD5 && reader->buffer_size >= read_length;
+    for (size_t i=0; groups_small_files && i<count; ++i) {
+        files_list_entry_t *entry = entries[i];
+        if (entry->size > SMALL_FILE_MAX_SIZE) {
+            continue;
+        }
+        entry->digest_algorithm = DIGEST_NONE;
+        if (grouped == SMALL_FILES_GROUP_SIZE || reader->buffer_size - used < read_length) {
+            hash_small_files(files, contents, lengths, grouped);
+            grouped = used = 0;
+        }
+        ssize_t length = read_small_file(reader, entry, reader->buffer + used, read_length);
+        if (length == -1) {
+            result = -1;
+        } else if (length <= SMALL_FILE_MAX_SIZE) {
+            files[grouped] = entry;
+            contents[grouped] = reader->buffer + used;
+            lengths[grouped] = (size_t)length;
+            ++grouped;
+            used += ((size_t)length + HASH_BUFFER_ALIGNMENT - 1) & ~(size_t)(HASH_BUFFER_ALIGNMENT - 1);
+        } else {
+            // The file grew since it was listed, hash_file reads in the buffer of the reader so the group is hashed first
+            hash_small_files(files, contents, lengths, grouped);
+            grouped = used = 0;
+            if (hash_file(reader, entry) == -1) {
+                result = -1;
+            }
+        }
+    }
+    if (grouped > 0) {
+        hash_small_files(files, contents, lengths, grouped);
+    }
+    for (size_t i=0; i<count; ++i) {
+        if ((!groups_small_files || entries[i]->size > SMALL_FILE_MAX_SIZE) && hash_file(reader, entries[i]) == -1) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+/*!
+ * @brief free_hashing_reader frees the buffer and digest context of a reader
+ * @param reader is a pointer to the reader
+ */
+void free_hashing_reader(hashing_reader_t *reader) {
+    if (reader) {
+        free(reader->buffer);
+        reader->buffer = NULL;
+        free_digest(&reader->context);
+    }
+}
+
 /*!
  * @brief directory_exists tests the existence of a directory
  * @path_to_dir a string with the path to the directory
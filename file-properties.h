@@ -3,8 +3,51 @@
 #include <files-list.h>
 #include <stdbool.h>
 #include <configuration.h>
+#include <sys/stat.h>
+
+#define DEFAULT_HASH_BUFFER_SIZE (1024 * 1024)
+#define HASH_BUFFER_ALIGNMENT 4096 // Alignment of the buffer, offsets and lengths of O_DIRECT reads
+#define SMALL_FILE_MAX_SIZE (16 * 1024) // Files up to this size are read whole and their MD5 sums computed together
+#define SMALL_FILES_GROUP_SIZE 64 // Maximum number of small files hashed together
+// Larger files get a tree digest: the digest of the digests of their chunks, which can be hashed in parallel.
+// Changing it changes the digests of large files, and requires a new digest cache format.
+#define LARGE_FILE_CHUNK_SIZE ((uint64_t)64 * 1024 * 1024)
+
+typedef struct {
+    files_list_t *list; // List owning the entries
+    size_t start_of_name; // Length of the root of the list in the paths of its entries
+    digest_algorithm_t algorithm;
+    files_list_entry_t **entries; // Entries whose digest must be computed
+    size_t count;
+    size_t capacity;
+} digest_requests_t;
+
+typedef struct {
+    digest_context_t context; // Reset for each file instead of being allocated again
+    uint8_t *buffer; // Aligned on HASH_BUFFER_ALIGNMENT
+    size_t buffer_size; // Multiple of HASH_BUFFER_ALIGNMENT
+    bool direct_io; // Read around the page cache, where the file system supports it
+} hashing_reader_t;
+
+typedef struct {
+    files_list_entry_t *entry;
+    digest_algorithm_t algorithm;
+    uint64_t chunks_count;
+    uint8_t *chunk_digests; // get_digest_size(algorithm) bytes per chunk
+    bool *chunk_hashed; // Set by whoever hashed the chunk, a file is complete when all are set
+} chunked_file_t;
 
 int get_file_stats(files_list_entry_t *entry);
+int set_file_stats(files_list_entry_t *entry, struct stat *buf);
 int compute_file_md5(files_list_entry_t *entry);
+int compute_file_digest(files_list_entry_t *entry, digest_algorithm_t algorithm);
+int init_hashing_reader(hashing_reader_t *reader, digest_algorithm_t algorithm, size_t buffer_size, bool direct_io);
+int hash_file(hashing_reader_t *reader, files_list_entry_t *entry);
+int hash_files(hashing_reader_t *reader, files_list_entry_t **entries, size_t count);
+void free_hashing_reader(hashing_reader_t *reader);
+uint64_t get_chunks_count(uint64_t size);
+int hash_file_chunk(hashing_reader_t *reader, char *path, uint64_t size, uint64_t chunk, uint8_t *digest);
+int init_chunked_file(chunked_file_t *file, files_list_entry_t *entry, digest_algorithm_t algorithm);
+int finish_chunked_file(chunked_file_t *file);
 bool directory_exists(char *path_to_dir);
 bool is_directory_writable(char *path_to_dir);
\ No newline at end of file
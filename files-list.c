@@ -5,22 +5,166 @@
 #include <file-properties.h>
 #include <stdio.h>
 
+#define INDEX_MIN_CAPACITY 1024
+#define ARENA_BLOCK_SIZE (256 * 1024)
+
+static int index_insert(files_list_index_t *index, files_list_entry_t *entry);
+
+/*!
+ * @brief arena_alloc reserves memory in an arena
+ * Memory is taken from the current block with a bump pointer. A new block is chained when the current one
+ * is full (or a dedicated one when size exceeds the block size). Memory is only given back by arena_free.
+ * @param arena the arena to allocate from
+ * @param size the number of bytes to reserve
+ * @param alignment the required alignment, must be a power of two
+ * @return a pointer to the reserved memory, NULL if out of memory
+ */
+static void *arena_alloc(files_list_arena_t *arena, size_t size, size_t alignment) {
+    files_list_arena_block_t *block = arena->blocks;
+    if (block) {
+        size_t start = (block->used + alignment - 1) & ~(alignment - 1);
+        if (start + size <= block->capacity) {
+            block->used = start + size;
+            return block->data + start;
+        }
+    }
+    size_t capacity = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+    block = malloc(sizeof(files_list_arena_block_t) + capacity);
+    if (!block) {
+        return NULL;
+    }
+    block->capacity = capacity;
+    block->used = size;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    return block->data;
+}
+
+/*!
+ * @brief arena_free frees all the blocks of an arena at once
+ * @param arena the arena to free
+ */
+static void arena_free(files_list_arena_t *arena) {
+    while (arena->blocks) {
+        files_list_arena_block_t *tmp = arena->blocks;
+        arena->blocks = tmp->next;
+        free(tmp);
+    }
+}
+
+/*!
+ * @brief arena_adopt moves all the blocks of an arena to another one
+ * The blocks are inserted after the block being filled by the receiving arena, which keeps filling it.
+ * @param arena the receiving arena
+ * @param donor the arena whose blocks are moved, it is left empty
+ */
+static void arena_adopt(files_list_arena_t *arena, files_list_arena_t *donor) {
+    if (!donor->blocks) {
+        return;
+    }
+    if (!arena->blocks) {
+        arena->blocks = donor->blocks;
+    } else {
+        files_list_arena_block_t *last = donor->blocks;
+        while (last->next) {
+            last = last->next;
+        }
+        last->next = arena->blocks->next;
+        arena->blocks->next = donor->blocks;
+    }
+    donor->blocks = NULL;
+}
+
+/*!
+ * @brief init_files_list initializes an empty files list
+ * @param list is a pointer to the list to be initialized
+ */
+void init_files_list(files_list_t *list) {
+    if (list) {
+        list->head = NULL;
+        list->tail = NULL;
+        list->index = NULL;
+        list->entries_arena.blocks = NULL;
+        list->strings_arena.blocks = NULL;
+    }
+}
+
 /*!
  * @brief clear_files_list clears a files list
+ * Entries and paths live in the list arenas, so clearing frees a few blocks instead of every entry.
  * @param list is a pointer to the list to be cleared
- * This function is provided, you don't need to implement nor modify it
  */
 void clear_files_list(files_list_t *list) {
-    while (list->head) {
-        files_list_entry_t *tmp = list->head;
-        list->head = tmp->next;
-        free(tmp);
+    clear_files_list_index(list);
+    arena_free(&list->entries_arena);
+    arena_free(&list->strings_arena);
+    list->head = NULL;
+    list->tail = NULL;
+}
+
+/*!
+ * @brief adopt_files_list_arenas gives the memory of a list to another one
+ * Entries allocated in the donor (e.g. by a walker thread) can then be linked into the list and are freed
+ * with it. The donor must not be linked nor indexed, it is left empty.
+ * @param list is a pointer to the list receiving the memory
+ * @param donor is a pointer to the list whose arenas are moved
+ */
+void adopt_files_list_arenas(files_list_t *list, files_list_t *donor) {
+    if (list && donor) {
+        arena_adopt(&list->entries_arena, &donor->entries_arena);
+        arena_adopt(&list->strings_arena, &donor->strings_arena);
     }
 }
 
+/*!
+ * @brief new_files_list_entry allocates an entry in the arenas of a list
+ * The entry is zeroed and its path is copied to the strings arena with its exact length.
+ * It is not linked: use add_entry_to_tail to append it to the same list.
+ * @param list the list whose arenas are used
+ * @param file_path the full path of the file
+ * @return a pointer to the new entry, NULL if out of memory
+ */
+files_list_entry_t *new_files_list_entry(files_list_t *list, const char *file_path) {
+    if (!list || !file_path) {
+        return NULL;
+    }
+    size_t path_len = strlen(file_path);
+    files_list_entry_t *entry = arena_alloc(&list->entries_arena, sizeof(files_list_entry_t), sizeof(void *));
+    char *path = arena_alloc(&list->strings_arena, path_len + 1, 1);
+    if (!entry || !path) {
+        return NULL;
+    }
+    memset(entry, 0, sizeof(files_list_entry_t));
+    memcpy(path, file_path, path_len + 1);
+    entry->path_and_name = path;
+    return entry;
+}
+
+/*!
+ * @brief duplicate_files_list_entry copies an entry (with its path and properties) into the arenas of a list
+ * @param list the list whose arenas are used
+ * @param entry the entry to copy, it may belong to another list
+ * @return a pointer to the unlinked copy, NULL if out of memory
+ */
+files_list_entry_t *duplicate_files_list_entry(files_list_t *list, files_list_entry_t *entry) {
+    if (!entry) {
+        return NULL;
+    }
+    files_list_entry_t *copy = new_files_list_entry(list, entry->path_and_name);
+    if (!copy) {
+        return NULL;
+    }
+    char *path = copy->path_and_name;
+    *copy = *entry;
+    copy->path_and_name = path;
+    copy->next = NULL;
+    copy->prev = NULL;
+    return copy;
+}
+
 /*!
  *  @brief add_file_entry adds a new file to the files list.
- *  It adds the file in an ordered manner (strcmp) and fills its properties
+ *  It adds the file in an ordered manner (@see compare_paths) and fills its properties
  *  by calling stat on the file.
  *  If the file already exists, it does nothing and returns 0
  *  @param list the list to add the file entry into
@@ -31,28 +175,23 @@ files_list_entry_t *add_file_entry(files_list_t *list, char *file_path) {
     if (!file_path) {
         return NULL;
     }
-    files_list_entry_t *newel = (files_list_entry_t* )malloc(sizeof(files_list_entry_t));
-    strcpy(newel->path_and_name,file_path);
-    newel->next = NULL;
-    newel->prev = NULL;
     if(list) {
-        if (!list->head) {
+        if (!list->head || compare_paths(list->tail->path_and_name, file_path) < 0) {
+            // Entries provided in order are appended without walking the list
+            files_list_entry_t *newel = new_files_list_entry(list, file_path);
+            if (!newel) {
+                return NULL;
+            }
             add_entry_to_tail(list, newel);
-            return list->head;
+            return list->tail;
         } else {
             files_list_entry_t *cmp = list->head;
             int verif_length;
             while (1) {
-                verif_length = (int)(strlen(cmp->path_and_name)-strlen(file_path));
-                if (verif_length > 0) {
+                verif_length = compare_paths(cmp->path_and_name,file_path);
+                if (verif_length >= 0) {
                     break;
                 }
-                if (verif_length == 0) {
-                    verif_length = strcmp(cmp->path_and_name,file_path);
-                    if (verif_length > 0 || verif_length == 0) {
-                        break;
-                    }
-                }
                 if (!cmp->next) {
                     break;
                 }
@@ -62,6 +201,10 @@ files_list_entry_t *add_file_entry(files_list_t *list, char *file_path) {
                 return NULL;
             } else {
                 if (verif_length > 0) {
+                    files_list_entry_t *newel = new_files_list_entry(list, file_path);
+                    if (!newel) {
+                        return NULL;
+                    }
                     if (cmp == list->head) {
                         newel->next = cmp;
                         cmp->prev = newel;
@@ -72,30 +215,69 @@ files_list_entry_t *add_file_entry(files_list_t *list, char *file_path) {
                         (cmp->prev)->next = newel;
                         cmp->prev = newel;
                     }
+                    if (list->index) {
+                        index_insert(list->index, newel);
+                    }
                     return list->head;
                 }
             }
-            if (!cmp->next) {
-                add_entry_to_tail(list,newel);
-                return list->tail;
-            }
         }
     }
     return NULL;
 }
 
+/*!
+ * @brief compare_paths compares two paths in tree order
+ * Paths are compared byte per byte like strcmp, except that the / separator sorts before any other character.
+ * A directory's content thus comes right after the directory name and before its siblings
+ * (e.g. "a/z" < "a-b"), which is the order of a depth first walk over sorted directories.
+ * Source and destination lists must both use this ordering to be compared (@see diff_files_lists).
+ * @param lhd the first path
+ * @param rhd the second path
+ * @return a negative value if lhd comes first, 0 if both are equal, a positive value else
+ */
+int compare_paths(const char *lhd, const char *rhd) {
+    while (*lhd && *lhd == *rhd) {
+        ++lhd;
+        ++rhd;
+    }
+    int lhd_rank = (*lhd == '/') ? 1 : (*lhd ? (unsigned char)*lhd + 1 : 0);
+    int rhd_rank = (*rhd == '/') ? 1 : (*rhd ? (unsigned char)*rhd + 1 : 0);
+    return lhd_rank - rhd_rank;
+}
+
+/*!
+ * @brief is_files_list_sorted checks that a list is ordered with compare_paths
+ * @param list the list to check
+ * @return true if each entry comes strictly after its predecessor, false else
+ */
+bool is_files_list_sorted(files_list_t *list) {
+    if (!list) {
+        return false;
+    }
+    for (files_list_entry_t *cursor=list->head; cursor != NULL && cursor->next != NULL; cursor=cursor->next) {
+        if (compare_paths(cursor->path_and_name, cursor->next->path_and_name) >= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
 /*!
  * @brief add_entry_to_tail adds an entry directly to the tail of the list
  * It supposes that the entries are provided already ordered, e.g. when a lister process sends its list's
  * elements to the main process.
  * @param list is a pointer to the list to which to add the element
- * @param entry is a pointer to the entry to add. The list becomes owner of the entry.
+ * @param entry is a pointer to the entry to add, allocated in the list arenas (@see new_files_list_entry).
  * @return 0 in case of success, -1 else
  */
 int add_entry_to_tail(files_list_t *list, files_list_entry_t *entry) {
-    if (!list) {
+    if (!list || !entry) {
         return -1;
     }
+    if (list->index) {
+        index_insert(list->index, entry);
+    }
     if (!list->head) {
         list->head = entry;
         list->tail = entry;
@@ -117,7 +299,8 @@ int add_entry_to_tail(files_list_t *list, files_list_entry_t *entry) {
 
 /*!
  *  @brief find_entry_by_name looks up for a file in a list
- *  The function uses the ordering of the entries to interrupt its search
+ *  When the list has an index built with start_of_dest as its prefix length (@see build_files_list_index),
+ *  the lookup is a single hash probe. Otherwise the list is scanned from its head.
  *  @param list the list to look into
  *  @param file_path the full path of the file to look for
  *  @param start_of_src the position of the name of the file in the source directory (removing the source path)
@@ -130,7 +313,9 @@ files_list_entry_t *find_entry_by_name(files_list_t *list, char *file_path, size
     }
     if (list->head) {
         size_t path_len = strlen(file_path) - start_of_src - 1 ;
-        //
+        if (list->index && list->index->start_of_name == start_of_dest) {
+            return find_entry_in_index(list->index, file_path + start_of_src + 1, path_len);
+        }
         files_list_entry_t *cmp = list->head;
         while (cmp) {
             size_t cmp_len = strlen(cmp->path_and_name) - start_of_dest - 1;
@@ -143,6 +328,158 @@ files_list_entry_t *find_entry_by_name(files_list_t *list, char *file_path, size
     return NULL;
 }
 
+/*!
+ * @brief hash_relative_path computes the FNV-1a hash of a relative path
+ * @param path the relative path (not necessarily null terminated)
+ * @param path_len the number of bytes of path to hash
+ * @return the 64 bits hash value
+ */
+uint64_t hash_relative_path(const char *path, size_t path_len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i=0; i<path_len; ++i) {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*!
+ * @brief index_grow doubles the capacity of an index and rehashes its slots
+ * @param index the index to grow
+ * @return 0 in case of success, -1 else (out of memory)
+ */
+static int index_grow(files_list_index_t *index) {
+    size_t new_capacity = index->capacity * 2;
+    files_list_index_slot_t *new_slots = calloc(new_capacity, sizeof(files_list_index_slot_t));
+    if (!new_slots) {
+        return -1;
+    }
+    for (size_t i=0; i<index->capacity; ++i) {
+        if (index->slots[i].entry) {
+            size_t pos = index->slots[i].hash & (new_capacity - 1);
+            while (new_slots[pos].entry) {
+                pos = (pos + 1) & (new_capacity - 1);
+            }
+            new_slots[pos] = index->slots[i];
+        }
+    }
+    free(index->slots);
+    index->slots = new_slots;
+    index->capacity = new_capacity;
+    return 0;
+}
+
+/*!
+ * @brief index_insert adds an entry to an index, keyed on its path relative to the indexed root
+ * The load factor is kept under 1/2 so that linear probing stays short.
+ * @param index the index to update
+ * @param entry the entry to add (must belong to the indexed list)
+ * @return 0 in case of success, -1 else
+ */
+static int index_insert(files_list_index_t *index, files_list_entry_t *entry) {
+    size_t path_len = strlen(entry->path_and_name);
+    if (path_len <= index->start_of_name) {
+        return -1;
+    }
+    if ((index->count + 1) * 2 > index->capacity && index_grow(index) == -1) {
+        return -1;
+    }
+    char *relative_path = entry->path_and_name + index->start_of_name + 1;
+    path_len -= index->start_of_name + 1;
+    uint64_t hash = hash_relative_path(relative_path, path_len);
+    size_t pos = hash & (index->capacity - 1);
+    while (index->slots[pos].entry) {
+        if (index->slots[pos].entry == entry) {
+            return 0;
+        }
+        pos = (pos + 1) & (index->capacity - 1);
+    }
+    index->slots[pos].hash = hash;
+    index->slots[pos].entry = entry;
+    ++index->count;
+    return 0;
+}
+
+/*!
+ * @brief build_files_list_index builds a hash index over a list, keyed on the paths relative to its root
+ * The index is attached to the list and kept up to date by add_file_entry and add_entry_to_tail.
+ * An existing index is replaced.
+ * @param list the list to index
+ * @param start_of_name the length of the root prefix of the list (the relative path starts after the next /)
+ * @return 0 in case of success, -1 else (out of memory)
+ */
+int build_files_list_index(files_list_t *list, size_t start_of_name) {
+    if (!list) {
+        return -1;
+    }
+    clear_files_list_index(list);
+    files_list_index_t *index = malloc(sizeof(files_list_index_t));
+    if (!index) {
+        return -1;
+    }
+    size_t entries_count = 0;
+    for (files_list_entry_t *cursor=list->head; cursor != NULL; cursor=cursor->next) {
+        ++entries_count;
+    }
+    index->capacity = INDEX_MIN_CAPACITY;
+    while (index->capacity < entries_count * 2) {
+        index->capacity *= 2;
+    }
+    index->count = 0;
+    index->start_of_name = start_of_name;
+    index->slots = calloc(index->capacity, sizeof(files_list_index_slot_t));
+    if (!index->slots) {
+        free(index);
+        return -1;
+    }
+    for (files_list_entry_t *cursor=list->head; cursor != NULL; cursor=cursor->next) {
+        if (index_insert(index, cursor) == -1) {
+            free(index->slots);
+            free(index);
+            return -1;
+        }
+    }
+    list->index = index;
+    return 0;
+}
+
+/*!
+ * @brief find_entry_in_index looks up for a relative path in an index
+ * @param index the index to look into
+ * @param relative_path the path of the file, relative to the root of the list
+ * @param path_len the length of relative_path
+ * @return a pointer to the element found, NULL if none were found
+ */
+files_list_entry_t *find_entry_in_index(files_list_index_t *index, char *relative_path, size_t path_len) {
+    if (!index || !relative_path) {
+        return NULL;
+    }
+    uint64_t hash = hash_relative_path(relative_path, path_len);
+    size_t pos = hash & (index->capacity - 1);
+    while (index->slots[pos].entry) {
+        if (index->slots[pos].hash == hash) {
+            char *candidate = index->slots[pos].entry->path_and_name + index->start_of_name + 1;
+            if (strncmp(candidate, relative_path, path_len) == 0 && candidate[path_len] == '\0') {
+                return index->slots[pos].entry;
+            }
+        }
+        pos = (pos + 1) & (index->capacity - 1);
+    }
+    return NULL;
+}
+
+/*!
+ * @brief clear_files_list_index frees the index of a list, if any
+ * @param list the list whose index must be freed. Its entries are left untouched.
+ */
+void clear_files_list_index(files_list_t *list) {
+    if (list && list->index) {
+        free(list->index->slots);
+        free(list->index);
+        list->index = NULL;
+    }
+}
+
 /*!
  * @brief display_files_list displays a files list
  * @param list is the pointer to the list to be displayed
@@ -1,30 +1,71 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <time.h>
 #include <sys/types.h>
+#include <digest.h>
 
 typedef enum { FICHIER, DOSSIER } file_type_t;
 
 typedef struct _files_list_entry {
-  char path_and_name[4096];
+  char *path_and_name; // Stored in the strings arena of the list owning the entry
   struct timespec mtime;
   uint64_t size;
-  uint8_t md5sum[16];
+  uint8_t digest_algorithm; // digest_algorithm_t of digest, DIGEST_NONE until the digest is computed
+  uint8_t digest[DIGEST_MAX_SIZE];
   file_type_t entry_type;
   mode_t mode;
+  uint64_t device; // Device and inode identify the file for the digest cache
+  uint64_t inode;
   struct _files_list_entry *next;
   struct _files_list_entry *prev;
 } files_list_entry_t;
 
+typedef struct {
+  uint64_t hash;
+  struct _files_list_entry *entry;
+} files_list_index_slot_t;
+
+typedef struct {
+  files_list_index_slot_t *slots;
+  size_t capacity; // Always a power of two
+  size_t count;
+  size_t start_of_name; // Length of the root prefix, the key is the path after it
+} files_list_index_t;
+
+typedef struct _files_list_arena_block {
+  struct _files_list_arena_block *next; // Previously filled block
+  size_t used;
+  size_t capacity;
+  char data[];
+} files_list_arena_block_t;
+
+typedef struct {
+  files_list_arena_block_t *blocks; // Block being filled, NULL when nothing has been allocated
+} files_list_arena_t;
+
 typedef struct {
   struct _files_list_entry *head;
   struct _files_list_entry *tail;
+  files_list_index_t *index; // Optional hash index on relative paths, NULL when not built
+  files_list_arena_t entries_arena; // Slabs of files_list_entry_t
+  files_list_arena_t strings_arena; // Bump allocated paths, variable length
 } files_list_t;
 
+void init_files_list(files_list_t *list);
 void clear_files_list(files_list_t *list);
+void adopt_files_list_arenas(files_list_t *list, files_list_t *donor);
+files_list_entry_t *new_files_list_entry(files_list_t *list, const char *file_path);
+files_list_entry_t *duplicate_files_list_entry(files_list_t *list, files_list_entry_t *entry);
 files_list_entry_t *add_file_entry(files_list_t *list, char *file_path);
+int compare_paths(const char *lhd, const char *rhd);
+bool is_files_list_sorted(files_list_t *list);
 int add_entry_to_tail(files_list_t *list, files_list_entry_t *entry);
 files_list_entry_t *find_entry_by_name(files_list_t *list, char *file_path, size_t start_of_src, size_t start_of_dest);
+uint64_t hash_relative_path(const char *path, size_t path_len);
+int build_files_list_index(files_list_t *list, size_t start_of_name);
+files_list_entry_t *find_entry_in_index(files_list_index_t *index, char *relative_path, size_t path_len);
+void clear_files_list_index(files_list_t *list);
 void display_files_list(files_list_t *list);
 void display_files_list_reversed(files_list_t *list);
@@ -46,12 +46,12 @@ int main(int argc, char *argv[]) {
     if (my_config.verbose) {
         printf(" Run Synchronize \n");
     }
-    synchronize(&my_config, &processes_context);
+    int result = synchronize(&my_config, &processes_context);
     
     // Clean resources
     if (my_config.verbose) {
         printf(" Processes clean \n");
     }
     clean_processes(&my_config, &processes_context);
-    return 0;
+    return result;
 }
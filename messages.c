@@ -1,28 +1,262 @@
 #include <messages.h>
 #include <sys/msg.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <shm-transport.h>
 
 // Functions in this file are required for inter processes communication
 
+/*!
+ * @brief post_message sends a message through the shared memory transport when it is active, else on the MQ
+ * @param msg_queue is the id of the MQ, unused with the shared memory transport
+ * @param message is a pointer to the message, starting with its mtype
+ * @param msg_length is the length of the message text
+ * @return 0 in case of success, -1 else
+ */
+static int post_message(int msg_queue, void *message, size_t msg_length) {
+    if (is_shm_transport_active()) {
+        return shm_transport_send(message, msg_length);
+    }
+    return msgsnd(msg_queue, message, msg_length, 0);
+}
+
+/*!
+ * @brief encode_file_entry packs the useful fields of an entry into a buffer
+ * Only the used bytes of the path are written, and the digest only when it has been computed,
+ * so that an entry with a short path takes a few dozen bytes on the MQ. Pointers are never sent.
+ * @param buffer is the output buffer
+ * @param buffer_size is the size of buffer
+ * @param file_entry is a pointer to the entry to encode
+ * @return the number of bytes written, 0 if the entry does not fit
+ */
+size_t encode_file_entry(uint8_t *buffer, size_t buffer_size, files_list_entry_t *file_entry) {
+    if (!buffer || !file_entry || !file_entry->path_and_name) {
+        return 0;
+    }
+    size_t path_len = strlen(file_entry->path_and_name);
+    size_t digest_size = get_digest_size(file_entry->digest_algorithm);
+    size_t length = FILE_ENTRY_WIRE_FIXED_SIZE + path_len + digest_size;
+    if (path_len >= PATH_SIZE || length > buffer_size) {
+        return 0;
+    }
+    uint16_t wire_path_len = (uint16_t)path_len;
+    int64_t mtime_sec = file_entry->mtime.tv_sec;
+    int32_t mtime_nsec = (int32_t)file_entry->mtime.tv_nsec;
+    uint32_t mode = file_entry->mode;
+    uint8_t entry_type = (uint8_t)file_entry->entry_type;
+    uint8_t *cursor = buffer;
+    memcpy(cursor, &wire_path_len, sizeof(wire_path_len));
+    cursor += sizeof(wire_path_len);
+    memcpy(cursor, file_entry->path_and_name, path_len);
+    cursor += path_len;
+    memcpy(cursor, &mtime_sec, sizeof(mtime_sec));
+    cursor += sizeof(mtime_sec);
+    memcpy(cursor, &mtime_nsec, sizeof(mtime_nsec));
+    cursor += sizeof(mtime_nsec);
+    memcpy(cursor, &file_entry->size, sizeof(file_entry->size));
+    cursor += sizeof(file_entry->size);
+    memcpy(cursor, &mode, sizeof(mode));
+    cursor += sizeof(mode);
+    memcpy(cursor, &file_entry->device, sizeof(file_entry->device));
+    cursor += sizeof(file_entry->device);
+    memcpy(cursor, &file_entry->inode, sizeof(file_entry->inode));
+    cursor += sizeof(file_entry->inode);
+    *cursor++ = entry_type;
+    *cursor++ = (digest_size > 0) ? file_entry->digest_algorithm : DIGEST_NONE;
+    memcpy(cursor, file_entry->digest, digest_size);
+    cursor += digest_size;
+    return (size_t)(cursor - buffer);
+}
+
+/*!
+ * @brief decode_file_entry unpacks an entry encoded by encode_file_entry
+ * @param buffer is the encoded data
+ * @param length is the number of bytes available in buffer
+ * @param file_entry is a pointer to the entry to fill. Its links are reset.
+ * @param path_buffer is a PATH_SIZE buffer receiving the path, file_entry->path_and_name points to it
+ * @return the number of bytes consumed, -1 if the data is truncated or invalid
+ */
+ssize_t decode_file_entry(const uint8_t *buffer, size_t length, files_list_entry_t *file_entry, char *path_buffer) {
+    if (!buffer || !file_entry || !path_buffer || length < FILE_ENTRY_WIRE_FIXED_SIZE) {
+        return -1;
+    }
+    uint16_t path_len;
+    memcpy(&path_len, buffer, sizeof(path_len));
+    if (path_len >= PATH_SIZE || length < FILE_ENTRY_WIRE_FIXED_SIZE + path_len) {
+        return -1;
+    }
+    int64_t mtime_sec;
+    int32_t mtime_nsec;
+    uint32_t mode;
+    const uint8_t *cursor = buffer + sizeof(path_len);
+    memcpy(path_buffer, cursor, path_len);
+    path_buffer[path_len] = '\0';
+    cursor += path_len;
+    memcpy(&mtime_sec, cursor, sizeof(mtime_sec));
+    cursor += sizeof(mtime_sec);
+    memcpy(&mtime_nsec, cursor, sizeof(mtime_nsec));
+    cursor += sizeof(mtime_nsec);
+    memcpy(&file_entry->size, cursor, sizeof(file_entry->size));
+    cursor += sizeof(file_entry->size);
+    memcpy(&mode, cursor, sizeof(mode));
+    cursor += sizeof(mode);
+    memcpy(&file_entry->device, cursor, sizeof(file_entry->device));
+    cursor += sizeof(file_entry->device);
+    memcpy(&file_entry->inode, cursor, sizeof(file_entry->inode));
+    cursor += sizeof(file_entry->inode);
+    file_entry->entry_type = (file_type_t)*cursor++;
+    file_entry->digest_algorithm = *cursor++;
+    size_t digest_size = get_digest_size(file_entry->digest_algorithm);
+    if ((size_t)(cursor - buffer) + digest_size > length) {
+        return -1;
+    }
+    memset(file_entry->digest, 0, sizeof(file_entry->digest));
+    memcpy(file_entry->digest, cursor, digest_size);
+    cursor += digest_size;
+    file_entry->path_and_name = path_buffer;
+    file_entry->mtime.tv_sec = mtime_sec;
+    file_entry->mtime.tv_nsec = mtime_nsec;
+    file_entry->mode = mode;
+    file_entry->next = NULL;
+    file_entry->prev = NULL;
+    return (ssize_t)(cursor - buffer);
+}
+
 /*!
  * @brief send_file_entry sends a file entry, with a given command code
  * @param msg_queue the MQ identifier through which to send the entry
  * @param recipient is the id of the recipient (as specified by mtype)
- * @param file_entry is a pointer to the entry to send (must be copied)
+ * @param file_entry is a pointer to the entry to send (it is encoded with encode_file_entry)
  * @param cmd_code is the cmd code to process the entry.
- * @return the result of the msgsnd function
+ * @return 0 in case of success, -1 if the entry cannot be encoded
  * Used by the specialized functions send_analyze*
  */
 int send_file_entry(int msg_queue, int recipient, files_list_entry_t *file_entry, int cmd_code) {
-       
     files_list_entry_transmit_t msg;
-    
     msg.mtype = recipient;
     msg.op_code = (char)cmd_code;
-    msg.payload = *file_entry;
     msg.reply_to = msg_queue;
-    size_t msg_length = sizeof(files_list_entry_transmit_t) - sizeof(long);
-    return msgsnd(msg_queue, &msg, msg_length, 0);
+    size_t payload_length = encode_file_entry(msg.payload, sizeof(msg.payload), file_entry);
+    if (payload_length == 0) {
+        return -1;
+    }
+    size_t msg_length = FILE_ENTRY_MSG_HEADER_SIZE + payload_length;
+    return post_message(msg_queue, &msg, msg_length);
+}
+
+/*!
+ * @brief init_files_batch empties a batch
+ * @param batch is a pointer to the batch to reset
+ */
+void init_files_batch(files_list_batch_t *batch) {
+    if (batch) {
+        batch->count = 0;
+        batch->length = 0;
+    }
+}
+
+/*!
+ * @brief add_entry_to_batch encodes an entry at the end of a batch
+ * @param batch is a pointer to the batch to fill
+ * @param file_entry is a pointer to the entry to add
+ * @param max_entries is the maximum number of entries in the batch
+ * @return 0 when the entry was added, -1 when the batch is full (the entry is not added)
+ */
+int add_entry_to_batch(files_list_batch_t *batch, files_list_entry_t *file_entry, uint16_t max_entries) {
+    if (!batch || !file_entry || (max_entries > 0 && batch->count >= max_entries)) {
+        return -1;
+    }
+    // The first entry may use the whole payload, the next ones must fit in the budget
+    size_t available = sizeof(batch->payload);
+    if (batch->count > 0) {
+        available = (batch->length < FILES_BATCH_BYTES_BUDGET) ? FILES_BATCH_BYTES_BUDGET - batch->length : 0;
+    }
+    size_t entry_length = encode_file_entry(batch->payload + batch->length, available, file_entry);
+    if (entry_length == 0) {
+        return -1;
+    }
+    batch->length += (uint16_t)entry_length;
+    ++batch->count;
+    return 0;
+}
+
+/*!
+ * @brief send_files_batch sends the used part of a batch and empties it
+ * @param msg_queue the MQ identifier through which to send the batch
+ * @param recipient is the id of the recipient (as specified by mtype)
+ * @param reply_to is the id of the sender, to which answers must be addressed
+ * @param batch is a pointer to the batch to send
+ * @param cmd_code is the cmd code to process the entries
+ * @return 0 in case of success or if the batch was empty, -1 else
+ */
+int send_files_batch(int msg_queue, int recipient, int reply_to, files_list_batch_t *batch, int cmd_code) {
+    if (!batch) {
+        return -1;
+    }
+    if (batch->count == 0) {
+        return 0;
+    }
+    batch->mtype = recipient;
+    batch->op_code = (char)cmd_code;
+    batch->reply_to = reply_to;
+    size_t msg_length = FILES_BATCH_MSG_HEADER_SIZE + batch->length;
+    int result = post_message(msg_queue, batch, msg_length);
+    init_files_batch(batch);
+    return result;
+}
+
+/*!
+ * @brief send_file_chunk_command sends a chunk of a file to hash, or the digest of the chunk
+ * @param msg_queue is the id of the MQ used to send the message
+ * @param recipient is the id of the recipient (as specified in the MQ)
+ * @param reply_to is the id the recipient must answer to
+ * @param command is a pointer to the command, its path must be set
+ * @param cmd_code is the opcode (hash chunk or chunk hashed)
+ * @return the result of the message sending
+ */
+int send_file_chunk_command(int msg_queue, int recipient, int reply_to, file_chunk_command_t *command, int cmd_code) {
+    if (!command) {
+        return -1;
+    }
+    command->mtype = recipient;
+    command->op_code = (char)cmd_code;
+    command->reply_to = reply_to;
+    size_t msg_length = FILE_CHUNK_MSG_HEADER_SIZE + strnlen(command->path, PATH_SIZE - 1) + 1;
+    command->path[msg_length - FILE_CHUNK_MSG_HEADER_SIZE - 1] = '\0';
+    return post_message(msg_queue, command, msg_length);
+}
+
+/*!
+ * @brief receive_message waits for the next message addressed to a recipient, whatever its opcode
+ * Each process (or group of analyzers) has a single mtype, so a blocking msgrcv on it wakes up as soon as
+ * any message for it is queued. The caller dispatches on the opcode (@see get_message_op_code).
+ * @param msg_queue is the id of the MQ to read
+ * @param recipient is the mtype of the receiving process
+ * @param message is a pointer to the buffer receiving the message
+ * @return the length of the message text, -1 in case of error
+ */
+ssize_t receive_message(int msg_queue, long recipient, any_message_t *message) {
+    ssize_t result;
+    do {
+        if (is_shm_transport_active()) {
+            // The shared memory transport only delivers messages addressed to the calling process
+            result = shm_transport_receive(message, sizeof(any_message_t) - sizeof(long));
+        } else {
+            result = msgrcv(msg_queue, message, sizeof(any_message_t) - sizeof(long), recipient, 0);
+        }
+    } while (result == -1 && errno == EINTR);
+    return result;
+}
+
+/*!
+ * @brief get_message_op_code returns the opcode of a received message
+ * All messages start with their mtype followed by a one byte opcode.
+ * @param message is a pointer to the received message
+ * @return the opcode
+ */
+char get_message_op_code(any_message_t *message) {
+    return message->simple_command.message;
 }
 
 /*!
@@ -30,16 +264,21 @@ int send_file_entry(int msg_queue, int recipient, files_list_entry_t *file_entry
  * @param msg_queue is the id of the MQ used to send the command
  * @param recipient is the recipient of the message (mtype)
  * @param target_dir is a string containing the path to the directory to analyze
- * @return the result of msgsnd
+ * @return 0 in case of success, -1 else
  */
 int send_analyze_dir_command(int msg_queue, int recipient, char *target_dir) {
     analyze_dir_command_t dir_command;
     dir_command.mtype = recipient;
     dir_command.op_code = COMMAND_CODE_ANALYZE_DIR;
-    strcpy(dir_command.target,target_dir);
-    size_t msg_length = sizeof(analyze_dir_command_t) - sizeof(long);
+    size_t target_len = strlen(target_dir);
+    if (target_len >= PATH_SIZE) {
+        return -1;
+    }
+    memcpy(dir_command.target, target_dir, target_len + 1);
+    // Only the used part of the path is sent
+    size_t msg_length = offsetof(analyze_dir_command_t, target) - sizeof(long) + target_len + 1;
 
-    return msgsnd(msg_queue, &dir_command, msg_length, 0);
+    return post_message(msg_queue, &dir_command, msg_length);
 }
 
 // The 3 following functions are one-liners
@@ -82,37 +321,78 @@ int send_files_list_element(int msg_queue, int recipient, files_list_entry_t *fi
 
 /*!
  * @brief send_list_end sends the end of list message to the main process
+ * It is an empty batch, whose reply_to tells which list is complete.
  * @param msg_queue is the id of the MQ used to send the message
  * @param recipient is the destination of the message
- * @return the result of msgsnd
+ * @param reply_to is the recipient id of the lister
+ * @return 0 in case of success, -1 else
  */
-int send_list_end(int msg_queue, int recipient) {
-    simple_command_t end_message;
+int send_list_end(int msg_queue, int recipient, int reply_to) {
+    files_list_batch_t end_message;
     end_message.mtype = recipient;
-    end_message.message = COMMAND_CODE_LIST_COMPLETE;
-    size_t msg_length = sizeof(simple_command_t) - sizeof(long);
-    return msgsnd(msg_queue,&end_message,msg_length,0);
+    end_message.op_code = COMMAND_CODE_LIST_COMPLETE;
+    end_message.reply_to = reply_to;
+    end_message.count = 0;
+    end_message.length = 0;
+    return post_message(msg_queue, &end_message, FILES_BATCH_MSG_HEADER_SIZE);
+}
+
+/*!
+ * @brief send_list_abort tells the main process that a list could not be completed
+ * It replaces the end of list message, the entries already sent are incomplete.
+ * @param msg_queue is the id of the MQ used to send the message
+ * @param recipient is the destination of the message
+ * @param reply_to is the recipient id of the lister
+ * @return 0 in case of success, -1 else
+ */
+int send_list_abort(int msg_queue, int recipient, int reply_to) {
+    files_list_batch_t abort_message;
+    abort_message.mtype = recipient;
+    abort_message.op_code = COMMAND_CODE_LIST_ABORTED;
+    abort_message.reply_to = reply_to;
+    abort_message.count = 0;
+    abort_message.length = 0;
+    return post_message(msg_queue, &abort_message, FILES_BATCH_MSG_HEADER_SIZE);
+}
+
+/*!
+ * @brief send_batch_invalid tells the sender of a batch that the end of the batch could not be decoded
+ * The entries after an invalid one cannot be found, they are answered by their count only.
+ * @param msg_queue is the id of the MQ used to send the message
+ * @param recipient is the sender of the batch
+ * @param reply_to is the recipient id of the analyzer
+ * @param count is the number of entries that were not answered
+ * @return 0 in case of success, -1 else
+ */
+int send_batch_invalid(int msg_queue, int recipient, int reply_to, uint16_t count) {
+    files_list_batch_t invalid_message;
+    invalid_message.mtype = recipient;
+    invalid_message.op_code = COMMAND_CODE_BATCH_INVALID;
+    invalid_message.reply_to = reply_to;
+    invalid_message.count = count;
+    invalid_message.length = 0;
+    return post_message(msg_queue, &invalid_message, FILES_BATCH_MSG_HEADER_SIZE);
 }
 
 /*!
  * @brief send_terminate_command sends a terminate command to a child process so it stops
  * @param msg_queue is the MQ id used to send the command
  * @param recipient is the target of the terminate command
- * @return the result of msgsnd
+ * @return 0 in case of success, -1 else
  */
 int send_terminate_command(int msg_queue, int recipient) {
     simple_command_t terminate_message;
     terminate_message.mtype = recipient;
     terminate_message.message = COMMAND_CODE_TERMINATE;
     size_t msg_length = sizeof(simple_command_t) - sizeof(long);
-    return msgsnd(msg_queue,&terminate_message,msg_length,0);
+    return post_message(msg_queue, &terminate_message, msg_length);
 }
 
 /*!
  * @brief send_terminate_confirm sends a terminate confirmation from a child process to the requesting parent.
  * @param msg_queue is the id of the MQ used to send the message
  * @param recipient is the destination of the message
- * @return the result of msgsnd
+ * @return 0 in case of success, -1 else
  */
 int send_terminate_confirm(int msg_queue, int recipient) {
     simple_command_t confirm_message;
@@ -120,5 +400,5 @@ int send_terminate_confirm(int msg_queue, int recipient) {
     confirm_message.message = COMMAND_CODE_TERMINATE_OK;
     size_t msg_length = sizeof(simple_command_t) - sizeof(long);
 
-    return msgsnd(msg_queue,&confirm_message,msg_length,0);
+    return post_message(msg_queue, &confirm_message, msg_length);
 }
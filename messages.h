@@ -2,6 +2,8 @@
 
 #include <files-list.h>
 #include <defines.h>
+#include <stddef.h>
+#include <sys/types.h>
 
 #define COMMAND_CODE_TERMINATE 0x0
 #define COMMAND_CODE_TERMINATE_OK 0x10
@@ -10,6 +12,15 @@
 #define COMMAND_CODE_ANALYZE_DIR 0x02
 #define COMMAND_CODE_FILE_ENTRY 0x12
 #define COMMAND_CODE_LIST_COMPLETE 0x22
+#define COMMAND_CODE_LIST_ABORTED 0x32
+#define COMMAND_CODE_ANALYZE_BATCH 0x03
+#define COMMAND_CODE_BATCH_ANALYZED 0x13
+#define COMMAND_CODE_FILES_BATCH 0x23
+#define COMMAND_CODE_BATCH_INVALID 0x33
+#define COMMAND_CODE_HASH_BATCH 0x04
+#define COMMAND_CODE_BATCH_HASHED 0x14
+#define COMMAND_CODE_HASH_CHUNK 0x05
+#define COMMAND_CODE_CHUNK_HASHED 0x15
 
 #define MSG_TYPE_TO_MAIN 1
 #define MSG_TYPE_TO_SOURCE_LISTER 2
@@ -22,19 +33,58 @@ typedef struct {
     char message;
 } simple_command_t;
 
+// Packed entry: path length (uint16) and path, mtime sec (int64) and nsec (int32), size (uint64), mode (uint32),
+// device (uint64), inode (uint64), entry type (uint8), digest algorithm (uint8) followed by the digest unless the
+// algorithm is DIGEST_NONE
+#define FILE_ENTRY_WIRE_FIXED_SIZE (2 + 8 + 4 + 8 + 4 + 8 + 8 + 1 + 1)
+#define FILE_ENTRY_WIRE_MAX_SIZE (FILE_ENTRY_WIRE_FIXED_SIZE + PATH_SIZE + DIGEST_MAX_SIZE)
+
 typedef struct {
     long mtype;
     char op_code; // Contains the analyze file opcode
-    files_list_entry_t payload;
+    int reply_to; // Recipient id the analyzer must answer to
+    uint8_t payload[FILE_ENTRY_WIRE_MAX_SIZE]; // Only the encoded bytes are sent (@see encode_file_entry)
 } analyze_file_command_t;
 
 typedef struct {
     long mtype;
     char op_code; // Contains the analyze file opcode
-    files_list_entry_t payload;
     int reply_to; // MQ id of the sender, to build either source or destination list
+    uint8_t payload[FILE_ENTRY_WIRE_MAX_SIZE]; // Only the encoded bytes are sent (@see encode_file_entry)
 } files_list_entry_transmit_t;
 
+// Size of the message text before the payload, to compute the payload length returned by msgrcv
+#define FILE_ENTRY_MSG_HEADER_SIZE (offsetof(files_list_entry_transmit_t, payload) - sizeof(long))
+
+// A batch is filled until it holds its maximum entries count or this many bytes. A single entry always fits,
+// even with a PATH_SIZE path. Small batches keep several messages in a default MQ (msgmnb is 16 KB).
+#define FILES_BATCH_BYTES_BUDGET 4096
+
+typedef struct {
+    long mtype;
+    char op_code; // Contains a batch opcode, the same for all entries
+    int reply_to; // Recipient id of the sender
+    uint16_t count; // Number of entries in payload
+    uint16_t length; // Number of used bytes in payload
+    uint8_t payload[FILE_ENTRY_WIRE_MAX_SIZE]; // Entries encoded one after the other (@see encode_file_entry)
+} files_list_batch_t;
+
+#define FILES_BATCH_MSG_HEADER_SIZE (offsetof(files_list_batch_t, payload) - sizeof(long))
+
+typedef struct {
+    long mtype;
+    char op_code; // Contains the hash chunk opcode or its answer
+    int reply_to; // Recipient id the analyzer must answer to
+    uint32_t file; // Index of the file among the chunked files of the sender, sent back unchanged
+    uint32_t chunk; // Index of the chunk in the file
+    uint64_t size; // Size of the file when it was listed, which sets the boundaries of the chunks
+    uint8_t digest_algorithm; // Requested algorithm, then algorithm of digest in the answer (DIGEST_NONE on error)
+    uint8_t digest[DIGEST_MAX_SIZE];
+    char path[PATH_SIZE]; // Only the used characters and the terminating zero are sent
+} file_chunk_command_t;
+
+#define FILE_CHUNK_MSG_HEADER_SIZE (offsetof(file_chunk_command_t, path) - sizeof(long))
+
 typedef struct {
     long mtype;
     char op_code; // Contains the analyze dir opcode
@@ -46,13 +96,25 @@ typedef union {
     analyze_file_command_t analyze_file_command;
     analyze_dir_command_t analyze_dir_command;
     files_list_entry_transmit_t list_entry;
+    files_list_batch_t files_batch;
+    file_chunk_command_t file_chunk;
 } any_message_t;
 
+size_t encode_file_entry(uint8_t *buffer, size_t buffer_size, files_list_entry_t *file_entry);
+ssize_t decode_file_entry(const uint8_t *buffer, size_t length, files_list_entry_t *file_entry, char *path_buffer);
+void init_files_batch(files_list_batch_t *batch);
+int add_entry_to_batch(files_list_batch_t *batch, files_list_entry_t *file_entry, uint16_t max_entries);
+int send_files_batch(int msg_queue, int recipient, int reply_to, files_list_batch_t *batch, int cmd_code);
+ssize_t receive_message(int msg_queue, long recipient, any_message_t *message);
+char get_message_op_code(any_message_t *message);
+int send_file_chunk_command(int msg_queue, int recipient, int reply_to, file_chunk_command_t *command, int cmd_code);
 int send_analyze_dir_command(int msg_queue, int recipient, char *target_dir);
 int send_file_entry(int msg_queue, int recipient, files_list_entry_t *file_entry, int cmd_code);
 int send_analyze_file_command(int msg_queue, int recipient, files_list_entry_t *file_entry);
 int send_analyze_file_response(int msg_queue, int recipient, files_list_entry_t *file_entry);
 int send_files_list_element(int msg_queue, int recipient, files_list_entry_t *file_entry);
-int send_list_end(int msg_queue, int recipient);
+int send_list_end(int msg_queue, int recipient, int reply_to);
+int send_list_abort(int msg_queue, int recipient, int reply_to);
+int send_batch_invalid(int msg_queue, int recipient, int reply_to, uint16_t count);
 int send_terminate_command(int msg_queue, int recipient);
 int send_terminate_confirm(int msg_queue, int recipient);
\ No newline at end of file
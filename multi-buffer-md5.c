@@ -0,0 +1,205 @@
+#include <multi-buffer-md5.h>
+#include <string.h>
+
+// Functions in this file compute the MD5 sums of several messages at once. MD5 is a chain of dependent operations
+// on 32 bits words, so a single message leaves most of the processor idle: here, each lane of a vector holds the
+// state of another message, and one pass over a block advances all of them.
+// The kernel is written with the vector extensions of GCC and compiled for AVX-512, AVX2 and the baseline
+// instruction set (SSE2 on x86_64), the best version being chosen when the program is loaded.
+
+typedef uint32_t md5_vector_t __attribute__((vector_size(MD5_LANES * sizeof(uint32_t))));
+
+static const uint32_t md5_constants[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t md5_rotations[64] = {
+        7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+        5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+        4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+        6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static const uint32_t md5_initial_state[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+
+typedef struct {
+    const uint8_t *data; // Message being hashed, NULL when the lane is idle
+    size_t message; // Index of the message
+    size_t full_blocks; // Blocks read from the message itself
+    size_t total_blocks; // Including the padding blocks
+    size_t next_block;
+    uint8_t padding[128]; // Last bytes of the message, padding and length
+} md5_lane_t;
+
+static inline uint32_t read_le32(const uint8_t *data) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+#else
+    return (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+#endif
+}
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define MD5_KERNEL_TARGETS __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define MD5_KERNEL_TARGETS
+#endif
+
+/*!
+ * @brief md5_compress_lanes runs the MD5 compression function on one block of each lane
+ * @param state is the state of the lanes, state[i][lane] being word i of the lane
+ * @param words are the blocks, words[i][lane] being the (little endian) word i of the block of the lane
+ */
+MD5_KERNEL_TARGETS
+static void md5_compress_lanes(uint32_t state[4][MD5_LANES], const uint32_t words[16][MD5_LANES]) {
+    md5_vector_t a, b, c, d, w[16];
+    memcpy(&a, state[0], sizeof(a));
+    memcpy(&b, state[1], sizeof(b));
+    memcpy(&c, state[2], sizeof(c));
+    memcpy(&d, state[3], sizeof(d));
+    memcpy(w, words, sizeof(w));
+    md5_vector_t initial_a = a, initial_b = b, initial_c = c, initial_d = d;
+#pragma GCC unroll 64
+    for (int i=0; i<64; ++i) {
+        md5_vector_t f;
+        int g;
+        if (i < 16) {
+            f = d ^ (b & (c ^ d));
+            g = i;
+        } else if (i < 32) {
+            f = c ^ (d & (b ^ c));
+            g = (5 * i + 1) & 15;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) & 15;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) & 15;
+        }
+        f += a + md5_constants[i] + w[g];
+        a = d;
+        d = c;
+        c = b;
+        b += (f << md5_rotations[i]) | (f >> (32 - md5_rotations[i]));
+    }
+    a += initial_a;
+    b += initial_b;
+    c += initial_c;
+    d += initial_d;
+    memcpy(state[0], &a, sizeof(a));
+    memcpy(state[1], &b, sizeof(b));
+    memcpy(state[2], &c, sizeof(c));
+    memcpy(state[3], &d, sizeof(d));
+}
+
+/*!
+ * @brief start_lane assigns a message to a lane and prepares its padding blocks
+ * @param lane is a pointer to the lane
+ * @param state is the state of all lanes
+ * @param index is the index of the lane
+ * @param message is the index of the message
+ * @param data is the message
+ * @param length is the length of the message
+ */
+static void start_lane(md5_lane_t *lane, uint32_t state[4][MD5_LANES], int index, size_t message, const uint8_t *data, size_t length) {
+    lane->data = data;
+    lane->message = message;
+    lane->full_blocks = length / 64;
+    lane->next_block = 0;
+    size_t remainder = length % 64;
+    memset(lane->padding, 0, sizeof(lane->padding));
+    memcpy(lane->padding, data + 64 * lane->full_blocks, remainder);
+    lane->padding[remainder] = 0x80;
+    size_t padding_length = (remainder + 9 <= 64) ? 64 : 128;
+    uint64_t bits = (uint64_t)length * 8;
+    for (int i=0; i<8; ++i) {
+        lane->padding[padding_length - 8 + i] = (uint8_t)(bits >> (8 * i));
+    }
+    lane->total_blocks = lane->full_blocks + padding_length / 64;
+    for (int i=0; i<4; ++i) {
+        state[i][index] = md5_initial_state[i];
+    }
+}
+
+/*!
+ * @brief md5_hash_messages computes the MD5 sums of messages, MD5_LANES at a time
+ * A lane whose message ends takes the next message, so messages of different lengths keep all lanes busy.
+ * @param messages are the messages
+ * @param lengths are the lengths of the messages
+ * @param count is the number of messages
+ * @param digests receive the MD5 sums
+ */
+void md5_hash_messages(const uint8_t *const *messages, const size_t *lengths, size_t count, uint8_t (*digests)[MD5_DIGEST_SIZE]) {
+    md5_lane_t lanes[MD5_LANES];
+    uint32_t state[4][MD5_LANES];
+    uint32_t words[16][MD5_LANES];
+    memset(state, 0, sizeof(state));
+    size_t next_message = 0;
+    int active_lanes = 0;
+    for (int lane=0; lane<MD5_LANES; ++lane) {
+        if (next_message < count) {
+            start_lane(&lanes[lane], state, lane, next_message, messages[next_message], lengths[next_message]);
+            ++next_message;
+            ++active_lanes;
+        } else {
+            lanes[lane].data = NULL;
+        }
+    }
+    while (active_lanes > 0) {
+        for (int lane=0; lane<MD5_LANES; ++lane) {
+            const uint8_t *block = NULL;
+            if (lanes[lane].data) {
+                size_t index = lanes[lane].next_block;
+                block = (index < lanes[lane].full_blocks) ? lanes[lane].data + 64 * index : lanes[lane].padding + 64 * (index - lanes[lane].full_blocks);
+            }
+            for (int i=0; i<16; ++i) {
+                // Idle lanes hash zeros, their state is not used
+                words[i][lane] = block ? read_le32(block + 4 * i) : 0;
+            }
+        }
+        md5_compress_lanes(state, (const uint32_t (*)[MD5_LANES])words);
+        for (int lane=0; lane<MD5_LANES; ++lane) {
+            if (!lanes[lane].data || ++lanes[lane].next_block < lanes[lane].total_blocks) {
+                continue;
+            }
+            for (int i=0; i<4; ++i) {
+                for (int j=0; j<4; ++j) {
+                    digests[lanes[lane].message][4 * i + j] = (uint8_t)(state[i][lane] >> (8 * j));
+                }
+            }
+            if (next_message < count) {
+                start_lane(&lanes[lane], state, lane, next_message, messages[next_message], lengths[next_message]);
+                ++next_message;
+            } else {
+                lanes[lane].data = NULL;
+                --active_lanes;
+            }
+        }
+    }
+}
+
+/*!
+ * @brief get_md5_kernel_name gives the instruction set used by md5_hash_messages on this processor
+ * @return its name
+ */
+const char *get_md5_kernel_name(void) {
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return "avx512f";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return "avx2";
+    }
+#endif
+    return "default";
+}
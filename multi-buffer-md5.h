@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Number of messages hashed together, one per 32 bits lane of the vectors
+#define MD5_LANES 16
+#define MD5_DIGEST_SIZE 16
+
+void md5_hash_messages(const uint8_t *const *messages, const size_t *lengths, size_t count, uint8_t (*digests)[MD5_DIGEST_SIZE]);
+const char *get_md5_kernel_name(void);
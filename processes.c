@@ -8,6 +8,11 @@
 #include <sync.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <shm-transport.h>
+#include <tree-walker.h>
+#include <digest-cache.h>
 
 #define MQ_KEY_CREATE_ID 42
 /*!
@@ -17,27 +22,47 @@
  * @return 0 if all went good, -1 else
  */
 int prepare(configuration_t *the_config, process_context_t *p_context) {
-    if (!the_config->is_parallel) {
+    // The digest cache file is never listed, even when the cache is disabled for this run
+    exclude_from_walks(the_config->cache_file);
+    // The digest cache is loaded before forking, so that the analyzers inherit it
+    if (the_config->uses_md5 && the_config->uses_digest_cache && load_digest_cache(the_config->cache_file) == -1) {
+        perror("Erreur lors de la lecture du cache d'empreintes");
+    }
+    if (!the_config->is_parallel || the_config->is_threaded) {
+        // Threads are started by synchronize and need no MQ
         return 0;
     } else {
-        //create mq_key
-        if (the_config->verbose) {
-            printf("Creating MQ shared key \n");
-        }
-        p_context->shared_key = ftok("mq_key.txt", MQ_KEY_CREATE_ID);
-        if (p_context->shared_key == -1 ) {
-            perror("Erreur lors de la creation de la clé IPC \n");
-            return -1;
+        p_context->shared_key = -1;
+        p_context->message_queue_id = -1;
+        if (!the_config->uses_sysv_mq) {
+            // Shared memory rings are mapped before forking so that every process inherits them
+            if (the_config->verbose) {
+                printf("Creating shared memory transport \n");
+            }
+            if (create_shm_transport(the_config->processes_count, SHM_RING_DEFAULT_SIZE) == -1) {
+                perror("Erreur lors de la creation de la memoire partagee, utilisation de la file de message");
+            }
         }
+        if (!is_shm_transport_active()) {
+            //create mq_key
+            if (the_config->verbose) {
+                printf("Creating MQ shared key \n");
+            }
+            p_context->shared_key = ftok("mq_key.txt", MQ_KEY_CREATE_ID);
+            if (p_context->shared_key == -1 ) {
+                perror("Erreur lors de la creation de la clé IPC \n");
+                return -1;
+            }
 
-        //set-up the main mq FIFO
-        if (the_config->verbose) {
-            printf("Creating message FIFO \n");
-        }
-        p_context->message_queue_id = msgget(p_context->shared_key,IPC_CREAT | 0666);
-        if (p_context->message_queue_id == -1) {
-            perror("Erreur lors de la création de la file de message \n");
-            return -1;
+            //set-up the main mq FIFO
+            if (the_config->verbose) {
+                printf("Creating message FIFO \n");
+            }
+            p_context->message_queue_id = msgget(p_context->shared_key,IPC_CREAT | 0666);
+            if (p_context->message_queue_id == -1) {
+                perror("Erreur lors de la création de la file de message \n");
+                return -1;
+            }
         }
         p_context->main_process_pid = getpid();
         p_context->processes_count = the_config->processes_count;
@@ -47,19 +72,21 @@ int prepare(configuration_t *the_config, process_context_t *p_context) {
         p_context->destination_analyzers_pids = (pid_t *) malloc(sizeof(pid_t)*p_context->processes_count);
 
         //set-up source / destination lister_pid to 0
-        lister_configuration_t lister = {0,p_context->message_queue_id,p_context->processes_count,p_context->shared_key};
-        analyzer_configuration_t analyzer = {0,p_context->message_queue_id,p_context->shared_key,the_config->uses_md5};
+        lister_configuration_t lister = {0,p_context->message_queue_id,p_context->processes_count,p_context->shared_key,the_config->batch_size,the_config->walkers_count,0};
+        analyzer_configuration_t analyzer = {0,p_context->message_queue_id,p_context->shared_key,the_config->uses_md5,the_config->verbose,0,the_config->digest_algorithm,the_config->hash_buffer_size,the_config->uses_direct_io};
         void *parameter = &lister;
         if (the_config->verbose) {
             printf("Creation of source / destination lister process\n");
         }
         lister.my_recipient_id = MSG_TYPE_TO_SOURCE_LISTER;
+        lister.transport_endpoint = SHM_ENDPOINT_SOURCE_LISTER;
         p_context->source_lister_pid = make_process(p_context,lister_process_loop,parameter);
         if (p_context->source_lister_pid <=0) {
             perror("Erreur lors de la creation du processus lister");
             return -1;
         }
         lister.my_recipient_id = MSG_TYPE_TO_DESTINATION_LISTER;
+        lister.transport_endpoint = SHM_ENDPOINT_DESTINATION_LISTER;
         p_context->destination_lister_pid = make_process(p_context,lister_process_loop,parameter);
         if (p_context->destination_lister_pid <=0) {
             perror("Erreur lors de la creation du processus lister");
@@ -72,12 +99,14 @@ int prepare(configuration_t *the_config, process_context_t *p_context) {
         }
         for (int i = 0; i< p_context->processes_count;i++) {
             analyzer.my_recipient_id = MSG_TYPE_TO_SOURCE_ANALYZERS;
+            analyzer.transport_endpoint = get_analyzer_endpoint(true, i);
             p_context->source_analyzers_pids[i] = make_process(p_context,analyzer_process_loop,parameter);
             if (p_context->source_analyzers_pids[i] <= 0) {
                 perror("Erreur lors de la creation du processus analyzer");
                 return -1;
             }
             analyzer.my_recipient_id = MSG_TYPE_TO_DESTINATION_ANALYZERS;
+            analyzer.transport_endpoint = get_analyzer_endpoint(false, i);
             p_context->destination_analyzers_pids[i] = make_process(p_context,analyzer_process_loop,parameter);
             if (p_context->destination_analyzers_pids[i] <= 0) {
                 perror("Erreur lors de la creation du processus analyzer");
@@ -96,7 +125,8 @@ int prepare(configuration_t *the_config, process_context_t *p_context) {
  * @return the PID of the child process (it never returns in the child process)
  */
 int make_process(process_context_t *p_context, process_loop_t func, void *parameters) {
-    
+    // Sinon le fils hérite des messages encore dans le tampon de stdout et les écrit une seconde fois
+    fflush(stdout);
     pid_t child_pid = fork();
 
     if (child_pid < 0) {
@@ -116,6 +146,230 @@ int make_process(process_context_t *p_context, process_loop_t func, void *parame
     }
 }
 
+/*!
+ * @brief init_streaming_lister allocates the reorder buffer of a lister
+ * Up to analyzers_count batches are analyzed at the same time, as many files may wait for an earlier one.
+ * @param lister is a pointer to the lister
+ * @param cfg is a pointer to the lister configuration
+ * @return 0 in case of success, -1 else
+ */
+int init_streaming_lister(streaming_lister_t *lister, lister_configuration_t *cfg) {
+    lister->config = cfg;
+    lister->in_flight_limit = (cfg->analyzers_count > 0 ? cfg->analyzers_count : 1) * (cfg->batch_size > 0 ? cfg->batch_size : 1);
+    lister->window = 2 * (size_t)lister->in_flight_limit;
+    size_t buckets_count = 16;
+    while (buckets_count < 2 * lister->window) {
+        buckets_count *= 2;
+    }
+    lister->buckets_mask = buckets_count - 1;
+    lister->files = malloc(lister->window * sizeof(listed_file_t));
+    lister->buckets = malloc(buckets_count * sizeof(int));
+    if (!lister->files || !lister->buckets) {
+        free(lister->files);
+        free(lister->buckets);
+        return -1;
+    }
+    memset(lister->buckets, 0xff, buckets_count * sizeof(int));
+    lister->listed_count = 0;
+    lister->requested_count = 0;
+    lister->forwarded_count = 0;
+    lister->pending_entries = 0;
+    init_files_batch(&lister->list_batch);
+    return 0;
+}
+
+/*!
+ * @brief unlink_listed_file removes a file waiting for its properties from its bucket
+ * The bucket is a chain of the files whose paths have the same hash, the file may be anywhere in it.
+ * @param lister is a pointer to the lister
+ * @param path is the path of the file
+ * @return the index of the file in the reorder buffer, -1 if no file with this path is waiting
+ */
+int unlink_listed_file(streaming_lister_t *lister, const char *path) {
+    int *link = &lister->buckets[hash_relative_path(path, strlen(path)) & lister->buckets_mask];
+    while (*link != -1 && strcmp(lister->files[*link].entry.path_and_name, path) != 0) {
+        link = &lister->files[*link].next_in_bucket;
+    }
+    int index = *link;
+    if (index != -1) {
+        *link = lister->files[index].next_in_bucket;
+    }
+    return index;
+}
+
+/*!
+ * @brief request_listed_details sends the listed files to the analyzers of the lister's side, in list order
+ * Files are sent by full batches, as long as fewer than in_flight_limit files wait for their properties.
+ * @param lister is a pointer to the lister
+ * @param partial is true to also send an incomplete batch
+ * @return 0 in case of success, -1 when a file cannot be encoded
+ */
+static int request_listed_details(streaming_lister_t *lister, bool partial) {
+    lister_configuration_t *cfg = lister->config;
+    int analyzers_id = (cfg->my_recipient_id == MSG_TYPE_TO_SOURCE_LISTER) ? MSG_TYPE_TO_SOURCE_ANALYZERS : MSG_TYPE_TO_DESTINATION_ANALYZERS;
+    uint64_t batch_size = (cfg->batch_size > 0) ? cfg->batch_size : 1;
+    files_list_batch_t batch;
+    while (lister->requested_count < lister->listed_count && lister->pending_entries < lister->in_flight_limit) {
+        if (!partial && lister->listed_count - lister->requested_count < batch_size) {
+            return 0;
+        }
+        uint64_t allowed = (uint64_t)(lister->in_flight_limit - lister->pending_entries);
+        uint16_t max_entries = (uint16_t)((allowed < batch_size) ? allowed : batch_size);
+        init_files_batch(&batch);
+        while (lister->requested_count + batch.count < lister->listed_count
+                && add_entry_to_batch(&batch, &lister->files[(lister->requested_count + batch.count) % lister->window].entry, max_entries) == 0);
+        if (batch.count == 0) {
+            // A file that cannot be encoded cannot be forwarded either, it is lost like a file missed by the walk
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        uint16_t batch_count = batch.count;
+        if (send_files_batch(cfg->my_receiver_id, analyzers_id, cfg->my_recipient_id, &batch, COMMAND_CODE_ANALYZE_BATCH) == -1) {
+            perror("Erreur lors de l'envoi d'un lot à analyser");
+            exit(EXIT_FAILURE);
+        }
+        lister->requested_count += batch_count;
+        lister->pending_entries += batch_count;
+    }
+    return 0;
+}
+
+/*!
+ * @brief forward_listed_files sends the analyzed files to the main process, in list order
+ * A file whose properties are back waits for the files listed before it.
+ * @param lister is a pointer to the lister
+ */
+static void forward_listed_files(streaming_lister_t *lister) {
+    lister_configuration_t *cfg = lister->config;
+    while (lister->forwarded_count < lister->listed_count && lister->files[lister->forwarded_count % lister->window].is_analyzed) {
+        files_list_entry_t *entry = &lister->files[lister->forwarded_count % lister->window].entry;
+        if (add_entry_to_batch(&lister->list_batch, entry, cfg->batch_size) == -1) {
+            send_files_batch(cfg->my_receiver_id, MSG_TYPE_TO_MAIN, cfg->my_recipient_id, &lister->list_batch, COMMAND_CODE_FILES_BATCH);
+            add_entry_to_batch(&lister->list_batch, entry, cfg->batch_size);
+        }
+        free(entry->path_and_name);
+        ++lister->forwarded_count;
+    }
+}
+
+/*!
+ * @brief receive_listed_details waits for an answer of the analyzers and forwards the files it completes
+ * @param lister is a pointer to the lister
+ * @return 0 in case of success, -1 when the analyzers could not answer for some files
+ */
+static int receive_listed_details(streaming_lister_t *lister) {
+    lister_configuration_t *cfg = lister->config;
+    if (receive_message(cfg->my_receiver_id, cfg->my_recipient_id, &lister->message) == -1) {
+        perror("Erreur lors de la lecture du message");
+        exit(EXIT_FAILURE);
+    }
+    if (get_message_op_code(&lister->message) == COMMAND_CODE_BATCH_INVALID) {
+        // These files will never have their properties, the list cannot be completed
+        lister->pending_entries -= lister->message.files_batch.count;
+        errno = EBADMSG;
+        return -1;
+    }
+    if (get_message_op_code(&lister->message) != COMMAND_CODE_BATCH_ANALYZED) {
+        return 0;
+    }
+    //mise à jour des entrées en attente avec les propriétés reçues
+    files_list_batch_t *analyzed_batch = &lister->message.files_batch;
+    files_list_entry_t analyzed_entry;
+    char analyzed_path[PATH_SIZE];
+    size_t offset = 0;
+    for (uint16_t i=0; i<analyzed_batch->count; ++i) {
+        ssize_t used = decode_file_entry(analyzed_batch->payload + offset, analyzed_batch->length - offset, &analyzed_entry, analyzed_path);
+        if (used == -1) {
+            break;
+        }
+        offset += used;
+        int index = unlink_listed_file(lister, analyzed_path);
+        if (index == -1) {
+            continue;
+        }
+        listed_file_t *file = &lister->files[index];
+        char *path_and_name = file->entry.path_and_name;
+        file->entry = analyzed_entry;
+        file->entry.path_and_name = path_and_name;
+        file->is_analyzed = true;
+    }
+    lister->pending_entries -= analyzed_batch->count;
+    forward_listed_files(lister);
+    return 0;
+}
+
+/*!
+ * @brief list_file adds a file found by the walk to the reorder buffer (@see walk_callback_t)
+ * When the buffer is full, it waits for the analyzers to complete the oldest files, so the memory of the
+ * lister does not grow with the tree.
+ * @param path is the path of the file
+ * @param parameters is a pointer to the lister, to be cast to a streaming_lister_t
+ * @return 0 in case of success, -1 when a file is lost (not added, not encodable or not analyzed)
+ */
+int list_file(char *path, void *parameters) {
+    streaming_lister_t *lister = (streaming_lister_t *) parameters;
+    while (lister->listed_count - lister->forwarded_count >= lister->window) {
+        if (request_listed_details(lister, true) == -1) {
+            return -1;
+        }
+        if (lister->pending_entries == 0) {
+            break;
+        }
+        if (receive_listed_details(lister) == -1) {
+            return -1;
+        }
+    }
+    char *path_and_name = strdup(path);
+    if (!path_and_name) {
+        return -1;
+    }
+    listed_file_t *file = &lister->files[lister->listed_count % lister->window];
+    memset(&file->entry, 0, sizeof(file->entry));
+    file->entry.path_and_name = path_and_name;
+    file->is_analyzed = false;
+    int *bucket = &lister->buckets[hash_relative_path(path, strlen(path)) & lister->buckets_mask];
+    file->next_in_bucket = *bucket;
+    *bucket = (int)(lister->listed_count % lister->window);
+    ++lister->listed_count;
+    return request_listed_details(lister, false);
+}
+
+/*!
+ * @brief finish_streaming_lister waits for the last files, forwards them and frees the reorder buffer
+ * @param lister is a pointer to the lister
+ * @return 0 in case of success, -1 when a file is lost (the buffer is kept)
+ */
+static int finish_streaming_lister(streaming_lister_t *lister) {
+    while (lister->forwarded_count < lister->listed_count) {
+        if (request_listed_details(lister, true) == -1) {
+            return -1;
+        }
+        if (lister->pending_entries == 0) {
+            break;
+        }
+        if (receive_listed_details(lister) == -1) {
+            return -1;
+        }
+    }
+    send_files_batch(lister->config->my_receiver_id, MSG_TYPE_TO_MAIN, lister->config->my_recipient_id, &lister->list_batch, COMMAND_CODE_FILES_BATCH);
+    free(lister->files);
+    free(lister->buckets);
+    return 0;
+}
+
+/*!
+ * @brief abort_streaming_lister frees the files that were not forwarded and the reorder buffer
+ * The answers of the analyzers still pending are dropped with the other messages before the terminate command.
+ * @param lister is a pointer to the lister
+ */
+static void abort_streaming_lister(streaming_lister_t *lister) {
+    for (uint64_t i=lister->forwarded_count; i<lister->listed_count; ++i) {
+        free(lister->files[i % lister->window].entry.path_and_name);
+    }
+    free(lister->files);
+    free(lister->buckets);
+}
+
 /*!
  * @brief lister_process_loop is the lister process function (@see make_process)
  * @param parameters is a pointer to its parameters, to be cast to a lister_configuration_t
@@ -123,148 +377,207 @@ int make_process(process_context_t *p_context, process_loop_t func, void *parame
 void lister_process_loop(void *parameters) {
     if (parameters) {
         lister_configuration_t *lister_config = (lister_configuration_t *) parameters;
+        attach_shm_endpoint(lister_config->transport_endpoint);
         //attente de reception du message d'analyse de repertoire
-        analyze_dir_command_t dir_message;
-        memset(&dir_message,0, sizeof(analyze_dir_command_t));
-        if (msgrcv(lister_config->my_receiver_id,&dir_message, sizeof(analyze_dir_command_t),COMMAND_CODE_ANALYZE_DIR,0) == -1) {
-            perror("Erreur lors de la reception du message");
-            exit(EXIT_FAILURE);
-        }
-        //creation d'une liste de fichier + remplissages du path_name de chaque element
-        files_list_t  build_list;
-        make_list(&build_list,dir_message.target);
-        int file_send = 0;
-        files_list_entry_t *current_entry = build_list.head;
-        //envoye des n premiers elements de la liste vers les n analyzeurs
-        while (current_entry != NULL &&  file_send < lister_config->analyzers_count) {
-            //analyze file
-            request_element_details(lister_config->my_receiver_id,current_entry,lister_config,&file_send);
-
-            //get next entry
-            current_entry = current_entry->next;
-            ++file_send;
-        }
-        //boucle infinie
-        bool running = true;
-        files_list_t complete_list;
-        files_list_entry_transmit_t receipt_entry;
-        memset(&receipt_entry,0, sizeof(files_list_entry_transmit_t));
-        while (current_entry != NULL || running) {
-            //reception des reponses des analyzer -> envoye de la prochaine entry
-            if (msgrcv(lister_config->my_receiver_id,&receipt_entry, sizeof(files_list_entry_transmit_t),COMMAND_CODE_FILE_ANALYZED,0) == -1) {
-                perror("Erreur lors de la lecture du message");
+        any_message_t message;
+        analyze_dir_command_t *dir_message = &message.analyze_dir_command;
+        do {
+            if (receive_message(lister_config->my_receiver_id, lister_config->my_recipient_id, &message) == -1) {
+                perror("Erreur lors de la reception du message");
                 exit(EXIT_FAILURE);
             }
-            //stockage de l'entrée reçu
-            add_entry_to_tail(&complete_list,&receipt_entry.payload);
-            --file_send;
-            if (current_entry != NULL) {
-		if(lister_config->my_recipient_id == MSG_TYPE_TO_SOURCE_LISTER){
-                    send_analyze_file_command(lister_config->my_receiver_id, MSG_TYPE_TO_SOURCE_ANALYZERS, current_entry);
-                }else{
-                    send_analyze_file_command(lister_config->my_receiver_id, MSG_TYPE_TO_DESTINATION_ANALYZERS, current_entry);
-                }               
-		current_entry = current_entry->next;
-                ++file_send;
+            if (get_message_op_code(&message) == COMMAND_CODE_TERMINATE) {
+                send_terminate_confirm(lister_config->my_receiver_id, MSG_TYPE_TO_MAIN);
+                return;
             }
-            if (file_send == 0) {
-                running = false;
+        } while (get_message_op_code(&message) != COMMAND_CODE_ANALYZE_DIR);
+        char target[PATH_SIZE];
+        strcpy(target, dir_message->target);
+        //listage de l'arborescence: chaque fichier trouvé part vers les analyzers, puis vers le main process dans l'ordre
+        streaming_lister_t *lister = malloc(sizeof(streaming_lister_t));
+        if (!lister || init_streaming_lister(lister, lister_config) == -1) {
+            perror("Erreur lors de l'allocation du listeur");
+            exit(EXIT_FAILURE);
+        }
+        int result = 0;
+        if (lister_config->walkers_count > 1) {
+            // The parallel walk gives its list at the end, which is then streamed like a sequential walk
+            files_list_t build_list;
+            init_files_list(&build_list);
+            result = walk_directory_tree(&build_list, target, false, lister_config->walkers_count);
+            for (files_list_entry_t *current_entry = build_list.head; result == 0 && current_entry != NULL; current_entry = current_entry->next) {
+                result = list_file(current_entry->path_and_name, lister);
             }
+            clear_files_list(&build_list);
+        } else {
+            result = walk_directory_tree_streaming(target, list_file, lister);
         }
-        current_entry = complete_list.head;
-        clear_files_list(&build_list);
-        //envoye du message de fin de completion de liste
-        send_list_end(lister_config->my_receiver_id,lister_config->my_recipient_id);
-        //transmission des entrées à jour au main process une par une
-        while (current_entry != NULL) {
-            send_files_list_element(lister_config->my_receiver_id,lister_config->my_recipient_id,current_entry);
-            current_entry = current_entry->next;
+        if (result == 0) {
+            result = finish_streaming_lister(lister);
         }
-        //fin du processus
-        simple_command_t end_message;
-        memset(&end_message,0, sizeof(simple_command_t));
-        if (msgrcv(lister_config->my_receiver_id,&end_message, sizeof(simple_command_t),COMMAND_CODE_TERMINATE,0) == -1) {
-            perror("Erreur lors de la reception du message");
-            exit(EXIT_FAILURE);
+        if (result == -1) {
+            // The list misses files, the main process must not synchronize with it
+            perror("Erreur lors du listage de l'arborescence");
+            abort_streaming_lister(lister);
+            send_list_abort(lister_config->my_receiver_id,MSG_TYPE_TO_MAIN,lister_config->my_recipient_id);
+        } else {
+            //envoye du message de fin de completion de liste, après les entrées pour qu'il soit reçu en dernier
+            send_list_end(lister_config->my_receiver_id,MSG_TYPE_TO_MAIN,lister_config->my_recipient_id);
         }
+        free(lister);
+        //fin du processus
+        do {
+            if (receive_message(lister_config->my_receiver_id, lister_config->my_recipient_id, &message) == -1) {
+                perror("Erreur lors de la reception du message");
+                exit(EXIT_FAILURE);
+            }
+        } while (get_message_op_code(&message) != COMMAND_CODE_TERMINATE);
         // send code TERMINATE_OK au main
-        send_terminate_confirm(lister_config->my_receiver_id,lister_config->my_recipient_id);
+        send_terminate_confirm(lister_config->my_receiver_id,MSG_TYPE_TO_MAIN);
     }
 }
 
+/*!
+ * @brief display_analyzer_statistics prints the throughput of an analyzer
+ * @param statistics is a pointer to the counters of the analyzer
+ * @param recipient_id is the mtype of the analyzer, to tell source and destination analyzers apart
+ */
+void display_analyzer_statistics(analyzer_statistics_t *statistics, int recipient_id) {
+    double files_per_second = (statistics->busy_time > 0.0) ? statistics->files_count / statistics->busy_time : 0.0;
+    double megabytes_per_second = (statistics->busy_time > 0.0) ? statistics->bytes_count / statistics->busy_time / 1e6 : 0.0;
+    printf("%s analyzer %d: %llu batches, %llu files, %llu bytes in %.3f s busy (%.1f files/s, %.1f MB/s)\n",
+           (recipient_id == MSG_TYPE_TO_SOURCE_ANALYZERS) ? "Source" : "Destination", (int)getpid(),
+           (unsigned long long)statistics->batches_count, (unsigned long long)statistics->files_count,
+           (unsigned long long)statistics->bytes_count, statistics->busy_time, files_per_second, megabytes_per_second);
+}
+
 /*!
  * @brief analyzer_process_loop is the analyzer process function
+ * An analyzer is a long lived worker: it processes every batch addressed to its side until it receives
+ * the terminate command, then displays its counters when verbose.
  * @param parameters is a pointer to its parameters, to be cast to an analyzer_configuration_t
  */
 void analyzer_process_loop(void *parameters) {
     if (parameters) {
         analyzer_configuration_t *analyzer_config = (analyzer_configuration_t *) parameters;
+        attach_shm_endpoint(analyzer_config->transport_endpoint);
         //declaration des variables recevant les messages
-        simple_command_t end_message;
-        memset(&end_message,0, sizeof(simple_command_t));
-        analyze_dir_command_t dir_message;
-        memset(&dir_message,0, sizeof(analyze_dir_command_t));
-        analyze_file_command_t file_message;
-        memset(&file_message,0, sizeof(analyze_file_command_t));
+        any_message_t message;
+        files_list_batch_t response;
+        // les entrées d'un lot sont traitées par groupes, pour hacher les petits fichiers ensemble
+        files_list_entry_t *group = malloc(SMALL_FILES_GROUP_SIZE * sizeof(files_list_entry_t));
+        char (*group_paths)[PATH_SIZE] = malloc(SMALL_FILES_GROUP_SIZE * PATH_SIZE);
+        files_list_entry_t *group_entries[SMALL_FILES_GROUP_SIZE];
+        int group_results[SMALL_FILES_GROUP_SIZE];
+        if (!group || !group_paths) {
+            perror("Erreur d'allocation de l'analyseur");
+            exit(EXIT_FAILURE);
+        }
+        analyzer_statistics_t statistics = {0, 0, 0, 0.0};
+        struct timespec batch_start, batch_end;
+        // un seul lecteur (tampon et contexte de hachage) pour tous les fichiers hachés par l'analyseur
+        hashing_reader_t reader;
+        bool has_reader = init_hashing_reader(&reader, analyzer_config->digest_algorithm, analyzer_config->hash_buffer_size, analyzer_config->direct_io) == 0;
 
         //boucle infini
         while (1) {
-            //gestion message de terminaison
-            size_t end_result = msgrcv(analyzer_config->my_receiver_id,&end_message, sizeof(simple_command_t),COMMAND_CODE_TERMINATE,IPC_NOWAIT);
-            if (end_result == -1) {
-                if(errno == ENOMSG){
-                    // attendre 1000 mili seconde
-                    usleep(100000);
-                } else {
-                    perror("Erreur lors de la lecture du message");
-                    exit(EXIT_FAILURE);
-                }
-            } else {
+            // attente bloquante du prochain message adressé aux analyseurs
+            if (receive_message(analyzer_config->my_receiver_id, analyzer_config->my_recipient_id, &message) == -1) {
+                perror("Erreur lors de la lecture du message");
+                exit(EXIT_FAILURE);
+            }
+            if (get_message_op_code(&message) == COMMAND_CODE_TERMINATE) {
                 // message de terminaison reçu
                 break;
             }
-
-            //gestion message d'analyse fichier / dossier
-            size_t dir_result = msgrcv(analyzer_config->my_receiver_id,&dir_message, sizeof(analyze_dir_command_t),COMMAND_CODE_ANALYZE_DIR,IPC_NOWAIT);
-            if (dir_result == -1) {
-                if (errno == ENOMSG) {
-                    // attendre 1000 mili seconde
-                    usleep(100000);
-                } else {
-                    perror("Erreur lors de la lecture du message");
-                    exit(EXIT_FAILURE);
+            int op_code = get_message_op_code(&message);
+            if (op_code == COMMAND_CODE_ANALYZE_BATCH || op_code == COMMAND_CODE_HASH_BATCH) {
+                // lot de fichiers à analyser reçu -> traitement de chaque entrée, réponse par lots
+                // listers request the properties of files, the main process the digests of files with known properties
+                int reply_code = (op_code == COMMAND_CODE_ANALYZE_BATCH) ? COMMAND_CODE_BATCH_ANALYZED : COMMAND_CODE_BATCH_HASHED;
+                clock_gettime(CLOCK_MONOTONIC, &batch_start);
+                files_list_batch_t *batch = &message.files_batch;
+                init_files_batch(&response);
+                size_t offset = 0;
+                uint16_t decoded = 0;
+                uint16_t invalid = 0;
+                while (decoded < batch->count) {
+                    size_t grouped = 0;
+                    while (grouped < SMALL_FILES_GROUP_SIZE && decoded < batch->count) {
+                        ssize_t used = decode_file_entry(batch->payload + offset, batch->length - offset, &group[grouped], group_paths[grouped]);
+                        if (used == -1) {
+                            printf("Invalid file entry received \n");
+                            invalid = batch->count - decoded;
+                            decoded = batch->count;
+                            break;
+                        }
+                        offset += used;
+                        ++decoded;
+                        group_entries[grouped] = &group[grouped];
+                        ++grouped;
+                    }
+                    if (op_code == COMMAND_CODE_HASH_BATCH && has_reader) {
+                        hash_files(&reader, group_entries, grouped);
+                    }
+                    for (size_t i=0; i<grouped; ++i) {
+                        if (op_code == COMMAND_CODE_ANALYZE_BATCH) {
+                            group_results[i] = get_file_stats(&group[i]);
+                        } else if (has_reader) {
+                            group_results[i] = (group[i].digest_algorithm == DIGEST_NONE) ? -1 : 0;
+                        } else {
+                            group_results[i] = compute_file_digest(&group[i], analyzer_config->digest_algorithm);
+                        }
+                        if (group_results[i] == 0) {
+                            ++statistics.files_count;
+                            statistics.bytes_count += group[i].size;
+                        }
+                        // the answer may grow past the budget (digests), in which case it is sent in several parts
+                        if (add_entry_to_batch(&response, &group[i], 0) == -1) {
+                            send_files_batch(analyzer_config->my_receiver_id, batch->reply_to, analyzer_config->my_recipient_id, &response, reply_code);
+                            add_entry_to_batch(&response, &group[i], 0);
+                        }
+                    }
                 }
-            } else {
-                // message d'analyse de repertoire reçu -> tratement
-                send_analyze_dir_command(analyzer_config->my_receiver_id,COMMAND_CODE_FILE_ANALYZED,dir_message.target);
-                break;
+                send_files_batch(analyzer_config->my_receiver_id, batch->reply_to, analyzer_config->my_recipient_id, &response, reply_code);
+                if (invalid > 0) {
+                    // the sender waits for an answer per entry, it must learn that the last ones will not come
+                    send_batch_invalid(analyzer_config->my_receiver_id, batch->reply_to, analyzer_config->my_recipient_id, invalid);
+                }
+                clock_gettime(CLOCK_MONOTONIC, &batch_end);
+                ++statistics.batches_count;
+                statistics.busy_time += (double)(batch_end.tv_sec - batch_start.tv_sec) + (double)(batch_end.tv_nsec - batch_start.tv_nsec) / 1e9;
             }
-            size_t file_result = msgrcv(analyzer_config->my_receiver_id,&file_message, sizeof(analyze_file_command_t),COMMAND_CODE_ANALYZE_FILE,IPC_NOWAIT);
-            if (file_result == -1) {
-                if (errno == ENOMSG) {
-                    // attendre 1000 mili seconde
-                    usleep(100000);
-                } else {
-                    perror("Erreur lors de la lecture du message");
-                    exit(EXIT_FAILURE);
+            if (op_code == COMMAND_CODE_HASH_CHUNK) {
+                // morceau d'un gros fichier -> réponse avec son empreinte, dans le même message
+                file_chunk_command_t *command = &message.file_chunk;
+                clock_gettime(CLOCK_MONOTONIC, &batch_start);
+                int result = -1;
+                if (has_reader && command->digest_algorithm == analyzer_config->digest_algorithm) {
+                    result = hash_file_chunk(&reader, command->path, command->size, command->chunk, command->digest);
                 }
-            } else {
-                // message d'analyse de fichier reçu -> traitement
-                files_list_entry_t *entry = &file_message.payload;
-                get_file_stats(entry);
-                //send response
-        	if(analyzer_config->my_recipient_id == MSG_TYPE_TO_SOURCE_ANALYZERS){
-                    send_analyze_file_response(analyzer_config->my_receiver_id,MSG_TYPE_TO_SOURCE_LISTER,entry);
+                command->digest_algorithm = (result == 0) ? analyzer_config->digest_algorithm : DIGEST_NONE;
+                if (result == 0) {
+                    statistics.bytes_count += (command->chunk == get_chunks_count(command->size) - 1) ? command->size - command->chunk * LARGE_FILE_CHUNK_SIZE : LARGE_FILE_CHUNK_SIZE;
                 }
-                if(analyzer_config->my_recipient_id == MSG_TYPE_TO_DESTINATION_ANALYZERS) {
-                    send_analyze_file_response(analyzer_config->my_receiver_id,MSG_TYPE_TO_DESTINATION_LISTER,entry);
-                }        
-		break;
+                send_file_chunk_command(analyzer_config->my_receiver_id, command->reply_to, analyzer_config->my_recipient_id, command, COMMAND_CODE_CHUNK_HASHED);
+                clock_gettime(CLOCK_MONOTONIC, &batch_end);
+                ++statistics.batches_count;
+                statistics.busy_time += (double)(batch_end.tv_sec - batch_start.tv_sec) + (double)(batch_end.tv_nsec - batch_start.tv_nsec) / 1e9;
             }
+            // the analyzer stays alive and waits for the next batch until it is told to terminate
+        }
+
+        if (has_reader) {
+            free_hashing_reader(&reader);
+        }
+        free(group);
+        free(group_paths);
+        if (analyzer_config->verbose) {
+            display_analyzer_statistics(&statistics, analyzer_config->my_recipient_id);
         }
 
         // send code TERMINATE_OK au main
-        send_terminate_confirm(analyzer_config->my_receiver_id,analyzer_config->my_recipient_id);
+        send_terminate_confirm(analyzer_config->my_receiver_id,MSG_TYPE_TO_MAIN);
     }
 }
 
@@ -274,13 +587,12 @@ void analyzer_process_loop(void *parameters) {
  * @param p_context is a pointer to the processes context
  */
 void clean_processes(configuration_t *the_config, process_context_t *p_context) {
-    // Do nothing if not parallel
-    if (the_config->is_parallel) {
-        bool lister_source = true;
-        bool lister_destination = true;
-        bool analyzer_source = true;
-        bool analyzer_destination = true;
-        simple_command_t end_message;
+    clear_digest_cache();
+    // Do nothing if not parallel or when threads were used
+    if (the_config->is_parallel && !the_config->is_threaded) {
+        // Listers and each analyzer confirm their termination to the main process
+        int pending_confirmations = 2 + 2 * p_context->processes_count;
+        any_message_t end_message;
         // Send terminate
         //envoye des messages de terminaison des processus fils
 	if (the_config->verbose) {
@@ -288,34 +600,27 @@ void clean_processes(configuration_t *the_config, process_context_t *p_context)
         }
         send_terminate_command(p_context->message_queue_id,MSG_TYPE_TO_SOURCE_LISTER);
         send_terminate_command(p_context->message_queue_id,MSG_TYPE_TO_DESTINATION_LISTER);
-        send_terminate_command(p_context->message_queue_id,MSG_TYPE_TO_SOURCE_ANALYZERS);
-        send_terminate_command(p_context->message_queue_id,MSG_TYPE_TO_DESTINATION_ANALYZERS);
+        // analyzers share their mtype, each of them consumes one terminate command
+        for (int i=0; i<p_context->processes_count; ++i) {
+            send_terminate_command(p_context->message_queue_id,MSG_TYPE_TO_SOURCE_ANALYZERS);
+            send_terminate_command(p_context->message_queue_id,MSG_TYPE_TO_DESTINATION_ANALYZERS);
+        }
         // Wait for responses
         //Attente de la reception du message de comfirmation de terminaison des processus fils
         if (the_config->verbose) {
                 printf("Wait until receive terminate confirm command from lister and analyzer \n");
         }
-        while (lister_source || lister_destination || analyzer_source || analyzer_destination) {
-                memset(&end_message,0, sizeof(simple_command_t));
-                if (msgrcv(p_context->message_queue_id,&end_message, sizeof(simple_command_t),COMMAND_CODE_TERMINATE_OK,0) == -1) {
+        while (pending_confirmations > 0) {
+                if (receive_message(p_context->message_queue_id, MSG_TYPE_TO_MAIN, &end_message) == -1) {
                     perror("Erreur lors de la reception du message de terminaison ");
                     exit(EXIT_FAILURE);
                 }
-                switch (end_message.mtype) {
-                    case MSG_TYPE_TO_SOURCE_LISTER:
-                        lister_source = false;
-                        break;
-                    case MSG_TYPE_TO_DESTINATION_LISTER:
-                        lister_destination = false;
-                        break;
-                    case MSG_TYPE_TO_SOURCE_ANALYZERS:
-                        analyzer_source = false;
-                        break;
-                    case MSG_TYPE_TO_DESTINATION_ANALYZERS:
-                        analyzer_destination = false;
-                        break;
+                if (get_message_op_code(&end_message) == COMMAND_CODE_TERMINATE_OK) {
+                    --pending_confirmations;
                 }
         }
+        while (wait(NULL) > 0) {
+        }
         // Free allocated memory
         //Libération de la mémoire allouer
         if (the_config->verbose) {
@@ -324,26 +629,169 @@ void clean_processes(configuration_t *the_config, process_context_t *p_context)
         free(p_context->destination_analyzers_pids);
         free(p_context->source_analyzers_pids);
 
-        // Free the MQ
+        // Free the MQ or the shared memory
         //Destruction de la file de message
         if (the_config->verbose) {
             printf("Message queue destruction \n");
         }
-        if (msgctl(p_context->message_queue_id,IPC_RMID,NULL) == -1) {
+        if (is_shm_transport_active()) {
+            destroy_shm_transport();
+        } else if (msgctl(p_context->message_queue_id,IPC_RMID,NULL) == -1) {
             perror("Erreur durant la suppression de la file de message");
             exit(EXIT_FAILURE);
         }
-        free(p_context);
         if (the_config->verbose) {
             printf("Clean END \n");
         }
     }
 }
-void request_element_details(int msg_queue, files_list_entry_t *entry, lister_configuration_t *cfg, int *current_analyzers){
-    if(cfg->my_recipient_id == MSG_TYPE_TO_SOURCE_LISTER){
-        send_analyze_file_command(msg_queue,MSG_TYPE_TO_SOURCE_ANALYZERS,entry);
+
+/*!
+ * @brief request_digests has the analyzer processes compute the digests of requested entries
+ * Entries are sent in batches to the analyzers of their side, keeping one batch per analyzer in flight, and
+ * the answers are matched to the entries by their path.
+ * The chunks of large files are spread over the analyzers of both sides, so that a single large file does
+ * not keep one analyzer busy while the others wait; their digests are combined once all are received.
+ * @param msg_queue is the id of the MQ used for communication
+ * @param requests is an array of two requests, for the source and the destination
+ * @param analyzers_count is the number of analyzers of each side
+ * @param batch_size is the maximum number of entries per batch
+ */
+void request_digests(int msg_queue, digest_requests_t *requests, int analyzers_count, uint16_t batch_size) {
+    int analyzers_ids[2] = {MSG_TYPE_TO_SOURCE_ANALYZERS, MSG_TYPE_TO_DESTINATION_ANALYZERS};
+    size_t next_entry[2] = {0, 0};
+    int pending_entries[2] = {0, 0};
+    int window = analyzers_count * (batch_size > 0 ? batch_size : 1);
+    for (int side=0; side<2; ++side) {
+        if (requests[side].count > 0 && build_files_list_index(requests[side].list, requests[side].start_of_name) == -1) {
+            printf("Cannot index files list, falling back to linear lookups \n");
+        }
+    }
+    // Large files of both sides, hashed by chunks
+    size_t chunked_count = 0;
+    for (int side=0; side<2; ++side) {
+        for (size_t i=0; i<requests[side].count; ++i) {
+            chunked_count += (get_chunks_count(requests[side].entries[i]->size) > 1) ? 1 : 0;
+        }
+    }
+    chunked_file_t *chunked_files = (chunked_count > 0) ? malloc(chunked_count * sizeof(chunked_file_t)) : NULL;
+    chunked_count = 0;
+    for (int side=0; side<2; ++side) {
+        for (size_t i=0; i<requests[side].count; ++i) {
+            files_list_entry_t *entry = requests[side].entries[i];
+            if (get_chunks_count(entry->size) == 1) {
+                continue;
+            }
+            if (!chunked_files || init_chunked_file(&chunked_files[chunked_count], entry, requests[side].algorithm) == -1) {
+                // Without memory for its chunks, the file is hashed right away
+                compute_file_digest(entry, requests[side].algorithm);
+                continue;
+            }
+            ++chunked_count;
+        }
+    }
+    size_t next_chunked_file = 0;
+    uint64_t next_chunk = 0;
+    int pending_chunks = 0, sent_chunks = 0;
+    int chunks_window = 2 * 2 * analyzers_count; // Two chunks per analyzer, so that none waits for the next one
+    any_message_t message;
+    files_list_batch_t batch;
+    file_chunk_command_t chunk_command;
+    files_list_entry_t hashed_entry;
+    char hashed_path[PATH_SIZE];
+    while (1) {
+        while (next_chunked_file < chunked_count && pending_chunks < chunks_window) {
+            chunked_file_t *file = &chunked_files[next_chunked_file];
+            chunk_command.file = (uint32_t)next_chunked_file;
+            chunk_command.chunk = (uint32_t)next_chunk;
+            chunk_command.size = file->entry->size;
+            chunk_command.digest_algorithm = file->algorithm;
+            strncpy(chunk_command.path, file->entry->path_and_name, PATH_SIZE - 1);
+            chunk_command.path[PATH_SIZE - 1] = '\0';
+            // Chunks alternate between the source and destination analyzers
+            if (send_file_chunk_command(msg_queue, analyzers_ids[sent_chunks % 2], MSG_TYPE_TO_MAIN, &chunk_command, COMMAND_CODE_HASH_CHUNK) == -1) {
+                perror("Erreur lors de l'envoi d'un morceau à hacher");
+            } else {
+                ++pending_chunks;
+                ++sent_chunks;
+            }
+            if (++next_chunk == file->chunks_count) {
+                ++next_chunked_file;
+                next_chunk = 0;
+            }
+        }
+        for (int side=0; side<2; ++side) {
+            while (next_entry[side] < requests[side].count && pending_entries[side] < window) {
+                init_files_batch(&batch);
+                while (next_entry[side] < requests[side].count) {
+                    files_list_entry_t *entry = requests[side].entries[next_entry[side]];
+                    if (get_chunks_count(entry->size) == 1 && add_entry_to_batch(&batch, entry, batch_size) == -1) {
+                        break;
+                    }
+                    ++next_entry[side];
+                }
+                if (batch.count == 0) {
+                    // An entry that cannot be encoded is skipped
+                    if (next_entry[side] < requests[side].count) {
+                        ++next_entry[side];
+                    }
+                    continue;
+                }
+                uint16_t batch_count = batch.count;
+                if (send_files_batch(msg_queue, analyzers_ids[side], MSG_TYPE_TO_MAIN, &batch, COMMAND_CODE_HASH_BATCH) == -1) {
+                    perror("Erreur lors de l'envoi d'un lot à hacher");
+                } else {
+                    pending_entries[side] += batch_count;
+                }
+            }
+        }
+        if (pending_entries[0] == 0 && pending_entries[1] == 0 && pending_chunks == 0) {
+            break;
+        }
+        if (receive_message(msg_queue, MSG_TYPE_TO_MAIN, &message) == -1) {
+            perror("Erreur lors de la lecture du message");
+            exit(EXIT_FAILURE);
+        }
+        if (get_message_op_code(&message) == COMMAND_CODE_CHUNK_HASHED) {
+            file_chunk_command_t *hashed_chunk = &message.file_chunk;
+            if (hashed_chunk->file < chunked_count && hashed_chunk->chunk < chunked_files[hashed_chunk->file].chunks_count) {
+                chunked_file_t *file = &chunked_files[hashed_chunk->file];
+                if (hashed_chunk->digest_algorithm == file->algorithm) {
+                    size_t digest_size = get_digest_size(file->algorithm);
+                    memcpy(file->chunk_digests + hashed_chunk->chunk * digest_size, hashed_chunk->digest, digest_size);
+                    file->chunk_hashed[hashed_chunk->chunk] = true;
+                }
+            }
+            --pending_chunks;
+            continue;
+        }
+        if (get_message_op_code(&message) == COMMAND_CODE_BATCH_INVALID) {
+            // These files keep no digest, like the files that cannot be read
+            pending_entries[(message.files_batch.reply_to == MSG_TYPE_TO_SOURCE_ANALYZERS) ? 0 : 1] -= message.files_batch.count;
+            continue;
+        }
+        if (get_message_op_code(&message) != COMMAND_CODE_BATCH_HASHED) {
+            continue;
+        }
+        files_list_batch_t *hashed_batch = &message.files_batch;
+        int side = (hashed_batch->reply_to == MSG_TYPE_TO_SOURCE_ANALYZERS) ? 0 : 1;
+        size_t offset = 0;
+        for (uint16_t i=0; i<hashed_batch->count; ++i) {
+            ssize_t used = decode_file_entry(hashed_batch->payload + offset, hashed_batch->length - offset, &hashed_entry, hashed_path);
+            if (used == -1) {
+                break;
+            }
+            offset += used;
+            files_list_entry_t *listed_entry = find_entry_by_name(requests[side].list, hashed_path, requests[side].start_of_name, requests[side].start_of_name);
+            if (listed_entry) {
+                listed_entry->digest_algorithm = hashed_entry.digest_algorithm;
+                memcpy(listed_entry->digest, hashed_entry.digest, sizeof(listed_entry->digest));
+            }
+        }
+        pending_entries[side] -= hashed_batch->count;
     }
-    if(cfg->my_recipient_id == MSG_TYPE_TO_DESTINATION_LISTER){
-        send_analyze_file_command(msg_queue,MSG_TYPE_TO_DESTINATION_ANALYZERS,entry);
+    for (size_t i=0; i<chunked_count; ++i) {
+        finish_chunked_file(&chunked_files[i]);
     }
+    free(chunked_files);
 }
@@ -4,6 +4,8 @@
 #include <sys/ipc.h>
 #include <sys/types.h>
 #include <files-list.h>
+#include <file-properties.h>
+#include <messages.h>
 #include <stdbool.h>
 
 typedef struct {
@@ -22,20 +24,60 @@ typedef struct {
     int my_receiver_id; // Id of MQ topic to listen to
     int analyzers_count; // Number of analyzers available
     key_t mq_key;
+    uint16_t batch_size; // Maximum number of entries per message
+    uint8_t walkers_count; // Number of threads listing the directory
+    int transport_endpoint; // Endpoint of the process on the shared memory transport
 } lister_configuration_t;
 
+typedef struct {
+    files_list_entry_t entry; // Properties received from the analyzers, path_and_name is allocated
+    bool is_analyzed;
+    int next_in_bucket; // Next file waiting for its properties in the same bucket, -1 at the end
+} listed_file_t;
+
+typedef struct {
+    lister_configuration_t *config;
+    listed_file_t *files; // Reorder buffer, the file number n is in files[n % window]
+    size_t window; // Maximum number of files listed and not yet forwarded to the main process
+    int *buckets; // First file waiting for its properties, by hash of its path, -1 when empty
+    size_t buckets_mask;
+    uint64_t listed_count; // Files found by the walk
+    uint64_t requested_count; // Files sent to the analyzers, in list order
+    uint64_t forwarded_count; // Files sent to the main process, in list order
+    int pending_entries; // Files sent to the analyzers and not answered yet
+    int in_flight_limit; // Maximum of pending_entries, so that the answers always fit in the MQ
+    files_list_batch_t list_batch; // Analyzed files waiting to be sent to the main process
+    any_message_t message;
+} streaming_lister_t;
+
 typedef struct {
     int my_recipient_id; // Id of my lister
     int my_receiver_id; // Id I must listen to
     key_t mq_key;
     bool use_md5; // Set to true when computing MD5sum for files
+    bool verbose; // Set to true to display the analyzer counters when it terminates
+    int transport_endpoint; // Endpoint of the process on the shared memory transport
+    digest_algorithm_t digest_algorithm; // Algorithm of the digests requested by the main process
+    size_t hash_buffer_size; // Size of the reads of the analyzer's hashing reader
+    bool direct_io; // Hash files with O_DIRECT
 } analyzer_configuration_t;
 
+typedef struct {
+    uint64_t batches_count;
+    uint64_t files_count;
+    uint64_t bytes_count; // Sum of the sizes of the analyzed files
+    double busy_time; // Seconds spent processing batches
+} analyzer_statistics_t;
+
 typedef void (*process_loop_t)(void *);
 
 int prepare(configuration_t *the_config, process_context_t *p_context);
 int make_process(process_context_t *p_context, process_loop_t func, void *parameters);
 void lister_process_loop(void *parameters);
 void analyzer_process_loop(void *parameters);
+void display_analyzer_statistics(analyzer_statistics_t *statistics, int recipient_id);
 void clean_processes(configuration_t *the_config, process_context_t *p_context);
-void request_element_details(int msg_queue, files_list_entry_t *entry, lister_configuration_t *cfg, int *current_analyzers);
\ No newline at end of file
+void request_digests(int msg_queue, digest_requests_t *requests, int analyzers_count, uint16_t batch_size);
+int init_streaming_lister(streaming_lister_t *lister, lister_configuration_t *cfg);
+int unlink_listed_file(streaming_lister_t *lister, const char *path);
+int list_file(char *path, void *parameters);
\ No newline at end of file
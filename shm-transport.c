@@ -0,0 +1,388 @@
+#define _GNU_SOURCE
+#include <shm-transport.h>
+#include <messages.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// Functions in this file implement a message transport in memory shared by the forked processes.
+// Every (producer, consumer) pair of processes that may communicate has its own lock free single producer,
+// single consumer ring buffer. A message is copied once into the ring and once out of it, without system call
+// as long as the consumer is busy. Idle consumers sleep on a futex of their endpoint, woken up by producers.
+// The region is a memfd mapped before the fork: it has no name and is freed when the last process exits.
+
+#define RING_WRAP_MARK UINT32_MAX
+#define CACHE_LINE 64
+
+typedef struct {
+    _Atomic uint64_t head; // Bytes written, only updated by the producer
+    char head_padding[CACHE_LINE - sizeof(uint64_t)];
+    _Atomic uint64_t tail; // Bytes read, only updated by the consumer
+    char tail_padding[CACHE_LINE - sizeof(uint64_t)];
+    _Atomic uint32_t space_sequence; // Incremented by the consumer when it frees space
+    _Atomic uint32_t producer_waiting; // Set by the producer before it sleeps on space_sequence
+    char control_padding[CACHE_LINE - 2 * sizeof(uint32_t)];
+    uint8_t data[]; // ring_size bytes
+} shm_ring_t;
+
+typedef struct {
+    _Atomic uint32_t sequence; // Incremented by producers when they publish a message
+    _Atomic uint32_t waiting; // Set by the consumer before it sleeps on sequence
+    char padding[CACHE_LINE - 2 * sizeof(uint32_t)];
+} shm_endpoint_t;
+
+typedef struct {
+    uint8_t *region;
+    size_t region_size;
+    size_t ring_size;
+    size_t ring_stride;
+    int endpoints_count;
+    int analyzers_per_side;
+    shm_endpoint_t *endpoints;
+    int *ring_table; // endpoints_count x endpoints_count, index of the ring from producer to consumer, -1 if none
+    int my_endpoint;
+    int *incoming_rings; // Rings of which my_endpoint is the consumer
+    int incoming_count;
+    int next_incoming; // Incoming ring to read first, for fairness
+    int *group_cursor; // Per recipient mtype, next endpoint of the group to send to
+} shm_transport_t;
+
+static shm_transport_t *transport = NULL;
+
+static long futex(_Atomic uint32_t *address, int operation, uint32_t value) {
+    return syscall(SYS_futex, (uint32_t *)address, operation, value, NULL, NULL, 0);
+}
+
+/*!
+ * @brief may_communicate tells if a producer can send messages to a consumer
+ * The main process talks with everybody, and each lister with the analyzers of its side.
+ * @param producer is the producer endpoint
+ * @param consumer is the consumer endpoint
+ * @return true if a ring is needed from producer to consumer
+ */
+static bool may_communicate(int producer, int consumer) {
+    if (producer == consumer) {
+        return false;
+    }
+    if (producer == SHM_ENDPOINT_MAIN || consumer == SHM_ENDPOINT_MAIN) {
+        return true;
+    }
+    int n = transport->analyzers_per_side;
+    int lister = (producer < SHM_ENDPOINT_FIRST_ANALYZER) ? producer : consumer;
+    int analyzer = (producer < SHM_ENDPOINT_FIRST_ANALYZER) ? consumer : producer;
+    if (lister >= SHM_ENDPOINT_FIRST_ANALYZER || analyzer < SHM_ENDPOINT_FIRST_ANALYZER) {
+        return false;
+    }
+    bool source_analyzer = analyzer < SHM_ENDPOINT_FIRST_ANALYZER + n;
+    return (lister == SHM_ENDPOINT_SOURCE_LISTER) == source_analyzer;
+}
+
+static shm_ring_t *get_ring(int ring) {
+    return (shm_ring_t *)(transport->region + CACHE_LINE * transport->endpoints_count + (size_t)ring * transport->ring_stride);
+}
+
+/*!
+ * @brief create_shm_transport creates the shared region and its rings, it must be called before forking
+ * The calling process becomes the main endpoint.
+ * @param analyzers_per_side is the number of analyzers of each side
+ * @param ring_size is the size in bytes of each ring, rounded to a power of two
+ * @return 0 in case of success, -1 else
+ */
+int create_shm_transport(int analyzers_per_side, size_t ring_size) {
+    // Keep the ring a power of two so that positions are masks of the counters, and large enough for the
+    // biggest message
+    size_t power = 1;
+    while (power < ring_size || power < 4 * sizeof(any_message_t)) {
+        power *= 2;
+    }
+    transport = calloc(1, sizeof(shm_transport_t));
+    if (!transport) {
+        return -1;
+    }
+    transport->analyzers_per_side = analyzers_per_side;
+    transport->endpoints_count = SHM_ENDPOINT_FIRST_ANALYZER + 2 * analyzers_per_side;
+    transport->ring_size = power;
+    transport->ring_stride = sizeof(shm_ring_t) + power;
+    int endpoints_count = transport->endpoints_count;
+    transport->ring_table = malloc(sizeof(int) * endpoints_count * endpoints_count);
+    transport->incoming_rings = malloc(sizeof(int) * endpoints_count);
+    transport->group_cursor = calloc(MSG_TYPE_TO_DESTINATION_ANALYZERS + 1, sizeof(int));
+    if (!transport->ring_table || !transport->incoming_rings || !transport->group_cursor) {
+        destroy_shm_transport();
+        return -1;
+    }
+    int rings_count = 0;
+    for (int producer=0; producer<endpoints_count; ++producer) {
+        for (int consumer=0; consumer<endpoints_count; ++consumer) {
+            transport->ring_table[producer * endpoints_count + consumer] = may_communicate(producer, consumer) ? rings_count++ : -1;
+        }
+    }
+    transport->region_size = CACHE_LINE * endpoints_count + (size_t)rings_count * transport->ring_stride;
+    int fd = memfd_create("lp25-backup-transport", MFD_CLOEXEC);
+    if (fd == -1) {
+        destroy_shm_transport();
+        return -1;
+    }
+    // The file is sparse: pages of rings that are never used are never allocated
+    if (ftruncate(fd, (off_t)transport->region_size) == -1) {
+        close(fd);
+        destroy_shm_transport();
+        return -1;
+    }
+    transport->region = mmap(NULL, transport->region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (transport->region == MAP_FAILED) {
+        transport->region = NULL;
+        destroy_shm_transport();
+        return -1;
+    }
+    transport->endpoints = (shm_endpoint_t *)transport->region;
+    attach_shm_endpoint(SHM_ENDPOINT_MAIN);
+    return 0;
+}
+
+/*!
+ * @brief is_shm_transport_active tells if messages go through the shared memory rings
+ * @return true when create_shm_transport succeeded in this process or its parent
+ */
+bool is_shm_transport_active(void) {
+    return transport != NULL;
+}
+
+/*!
+ * @brief get_analyzer_endpoint computes the endpoint of an analyzer
+ * @param is_source is true for source analyzers
+ * @param analyzer_index is the index of the analyzer on its side
+ * @return the endpoint
+ */
+int get_analyzer_endpoint(bool is_source, int analyzer_index) {
+    int n = transport ? transport->analyzers_per_side : 0;
+    return SHM_ENDPOINT_FIRST_ANALYZER + (is_source ? 0 : n) + analyzer_index;
+}
+
+/*!
+ * @brief attach_shm_endpoint sets the identity of the calling process, a forked child must call it first
+ * @param endpoint is the endpoint of the calling process
+ */
+void attach_shm_endpoint(int endpoint) {
+    if (!transport || endpoint < 0 || endpoint >= transport->endpoints_count) {
+        return;
+    }
+    transport->my_endpoint = endpoint;
+    transport->incoming_count = 0;
+    transport->next_incoming = 0;
+    for (int producer=0; producer<transport->endpoints_count; ++producer) {
+        int ring = transport->ring_table[producer * transport->endpoints_count + endpoint];
+        if (ring != -1) {
+            transport->incoming_rings[transport->incoming_count++] = ring;
+        }
+    }
+}
+
+/*!
+ * @brief get_recipient_range converts a recipient mtype to the range of endpoints that may receive it
+ * @param recipient is the mtype of the message
+ * @param first is set to the first endpoint of the range
+ * @param count is set to the number of endpoints of the range
+ * @return 0 in case of success, -1 for an unknown recipient
+ */
+static int get_recipient_range(long recipient, int *first, int *count) {
+    *count = 1;
+    switch (recipient) {
+        case MSG_TYPE_TO_MAIN:
+            *first = SHM_ENDPOINT_MAIN;
+            return 0;
+        case MSG_TYPE_TO_SOURCE_LISTER:
+            *first = SHM_ENDPOINT_SOURCE_LISTER;
+            return 0;
+        case MSG_TYPE_TO_DESTINATION_LISTER:
+            *first = SHM_ENDPOINT_DESTINATION_LISTER;
+            return 0;
+        case MSG_TYPE_TO_SOURCE_ANALYZERS:
+        case MSG_TYPE_TO_DESTINATION_ANALYZERS:
+            *first = get_analyzer_endpoint(recipient == MSG_TYPE_TO_SOURCE_ANALYZERS, 0);
+            *count = transport->analyzers_per_side;
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/*!
+ * @brief ring_free_space computes the free space of a ring from the producer side
+ */
+static size_t ring_free_space(shm_ring_t *ring) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return transport->ring_size - (size_t)(head - tail);
+}
+
+/*!
+ * @brief choose_consumer picks the consumer of a message addressed to a group of analyzers
+ * Consumers are chosen in strict round robin: a group of N messages (e.g. the N terminate commands of the
+ * main process) reaches every member of the group exactly once.
+ * @param recipient is the mtype of the message
+ * @param first is the first endpoint of the group
+ * @param count is the size of the group
+ * @return the chosen endpoint, -1 if none can be reached from the calling process
+ */
+static int choose_consumer(long recipient, int first, int count) {
+    int *cursor = &transport->group_cursor[recipient];
+    for (int i=0; i<count; ++i) {
+        int consumer = first + (*cursor + i) % count;
+        if (transport->ring_table[transport->my_endpoint * transport->endpoints_count + consumer] != -1) {
+            *cursor = (consumer - first + 1) % count;
+            return consumer;
+        }
+    }
+    return -1;
+}
+
+/*!
+ * @brief shm_transport_send sends a message to the endpoint designated by its mtype
+ * It blocks while the ring to the recipient is full.
+ * @param message is the message, starting with its mtype like for msgsnd
+ * @param msg_length is the length of the message text (without the mtype)
+ * @return 0 in case of success, -1 else
+ */
+int shm_transport_send(void *message, size_t msg_length) {
+    if (!transport || !message) {
+        return -1;
+    }
+    long recipient = *(long *)message;
+    int first, count;
+    if (get_recipient_range(recipient, &first, &count) == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    int consumer = (count == 1) ? first : choose_consumer(recipient, first, count);
+    int ring_index = (consumer == -1) ? -1 : transport->ring_table[transport->my_endpoint * transport->endpoints_count + consumer];
+    if (ring_index == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    shm_ring_t *ring = get_ring(ring_index);
+    size_t length = sizeof(long) + msg_length;
+    size_t record = (sizeof(uint32_t) + length + 7) & ~(size_t)7;
+    if (record > transport->ring_size / 2) {
+        errno = E2BIG;
+        return -1;
+    }
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t position = head & (transport->ring_size - 1);
+    size_t contiguous = transport->ring_size - position;
+    size_t needed = (record > contiguous) ? contiguous + record : record;
+    // Wait for the consumer to free enough space
+    while (ring_free_space(ring) < needed) {
+        uint32_t sequence = atomic_load(&ring->space_sequence);
+        atomic_store(&ring->producer_waiting, 1);
+        if (ring_free_space(ring) < needed) {
+            futex(&ring->space_sequence, FUTEX_WAIT, sequence);
+        }
+        atomic_store(&ring->producer_waiting, 0);
+    }
+    if (record > contiguous) {
+        uint32_t mark = RING_WRAP_MARK;
+        memcpy(ring->data + position, &mark, sizeof(mark));
+        head += contiguous;
+        position = 0;
+    }
+    uint32_t stored_length = (uint32_t)length;
+    memcpy(ring->data + position, &stored_length, sizeof(stored_length));
+    memcpy(ring->data + position + sizeof(stored_length), message, length);
+    atomic_store_explicit(&ring->head, head + record, memory_order_release);
+
+    shm_endpoint_t *endpoint = &transport->endpoints[consumer];
+    atomic_fetch_add(&endpoint->sequence, 1);
+    if (atomic_load(&endpoint->waiting)) {
+        futex(&endpoint->sequence, FUTEX_WAKE, INT_MAX);
+    }
+    return 0;
+}
+
+/*!
+ * @brief ring_pop copies the next message of a ring, if any
+ * @param ring is the ring to read
+ * @param message is the output buffer
+ * @param max_length is the maximum length of the message text
+ * @return the length of the message text, -1 if the ring is empty
+ */
+static ssize_t ring_pop(shm_ring_t *ring, void *message, size_t max_length) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail == head) {
+        return -1;
+    }
+    size_t position = tail & (transport->ring_size - 1);
+    uint32_t length;
+    memcpy(&length, ring->data + position, sizeof(length));
+    if (length == RING_WRAP_MARK) {
+        tail += transport->ring_size - position;
+        position = 0;
+        memcpy(&length, ring->data, sizeof(length));
+    }
+    size_t copied = (length < sizeof(long) + max_length) ? length : sizeof(long) + max_length;
+    memcpy(message, ring->data + position + sizeof(length), copied);
+    size_t record = (sizeof(uint32_t) + length + 7) & ~(size_t)7;
+    atomic_store_explicit(&ring->tail, tail + record, memory_order_release);
+
+    atomic_fetch_add(&ring->space_sequence, 1);
+    if (atomic_load(&ring->producer_waiting)) {
+        futex(&ring->space_sequence, FUTEX_WAKE, INT_MAX);
+    }
+    return (ssize_t)(copied - sizeof(long));
+}
+
+/*!
+ * @brief shm_transport_receive waits for the next message addressed to the calling process
+ * Incoming rings are read in turn so that no producer is starved.
+ * @param message is the output buffer, starting with its mtype like for msgrcv
+ * @param max_length is the maximum length of the message text
+ * @return the length of the message text, -1 in case of error
+ */
+ssize_t shm_transport_receive(void *message, size_t max_length) {
+    if (!transport || !message || transport->incoming_count == 0) {
+        return -1;
+    }
+    shm_endpoint_t *endpoint = &transport->endpoints[transport->my_endpoint];
+    while (1) {
+        uint32_t sequence = atomic_load(&endpoint->sequence);
+        for (int i=0; i<transport->incoming_count; ++i) {
+            int slot = (transport->next_incoming + i) % transport->incoming_count;
+            ssize_t result = ring_pop(get_ring(transport->incoming_rings[slot]), message, max_length);
+            if (result != -1) {
+                transport->next_incoming = (slot + 1) % transport->incoming_count;
+                return result;
+            }
+        }
+        // Nothing queued: sleep until a producer publishes (the sequence check avoids a lost wake up)
+        atomic_store(&endpoint->waiting, 1);
+        if (atomic_load(&endpoint->sequence) == sequence) {
+            futex(&endpoint->sequence, FUTEX_WAIT, sequence);
+        }
+        atomic_store(&endpoint->waiting, 0);
+    }
+}
+
+/*!
+ * @brief destroy_shm_transport unmaps the shared region and frees the transport of the calling process
+ */
+void destroy_shm_transport(void) {
+    if (transport) {
+        if (transport->region) {
+            munmap(transport->region, transport->region_size);
+        }
+        free(transport->ring_table);
+        free(transport->incoming_rings);
+        free(transport->group_cursor);
+        free(transport);
+        transport = NULL;
+    }
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SHM_RING_DEFAULT_SIZE (256 * 1024)
+
+// Endpoints are the processes of the program: main, both listers, then the source analyzers followed by
+// the destination analyzers
+#define SHM_ENDPOINT_MAIN 0
+#define SHM_ENDPOINT_SOURCE_LISTER 1
+#define SHM_ENDPOINT_DESTINATION_LISTER 2
+#define SHM_ENDPOINT_FIRST_ANALYZER 3
+
+int create_shm_transport(int analyzers_per_side, size_t ring_size);
+bool is_shm_transport_active(void);
+int get_analyzer_endpoint(bool is_source, int analyzer_index);
+void attach_shm_endpoint(int endpoint);
+int shm_transport_send(void *message, size_t msg_length);
+ssize_t shm_transport_receive(void *message, size_t max_length);
+void destroy_shm_transport(void);
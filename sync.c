@@ -2,19 +2,522 @@
 #include <dirent.h>
 #include <string.h>
 #include <processes.h>
+#include <thread-engine.h>
+#include <tree-walker.h>
+#include <digest-cache.h>
+#include <multi-buffer-md5.h>
+#include <delta-copy.h>
+#include <directory-cache.h>
 #include <utility.h>
 #include <messages.h>
 #include "file-properties.h"
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <sys/sendfile.h>
 #include <unistd.h>
 #include <sys/msg.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+typedef struct {
+    configuration_t *the_config;
+    files_list_t *difference;
+} difference_context_t;
 
+/*!
+ * @brief add_to_difference is the diff callback used by synchronize (@see diff_callback_t)
+ * New and changed source entries are copied to the tail of the difference list, which keeps it ordered.
+ * The digest of a destination entry that will be replaced is dropped, so that it does not go to the cache.
+ * @param status the result of the comparison
+ * @param source_entry the source entry, NULL when the file only exists in the destination
+ * @param destination_entry the destination entry, NULL for new files
+ * @param parameters a pointer to the difference_context_t
+ */
+static void add_to_difference(diff_status_t status, files_list_entry_t *source_entry, files_list_entry_t *destination_entry, void *parameters) {
+    difference_context_t *context = (difference_context_t *) parameters;
+    if (status == DIFF_DESTINATION_ONLY) {
+        return;
+    }
+    if (status == DIFF_UNCHANGED) {
+        if (context->the_config->verbose) {
+            printf(" Verification of files differences %s : EQUAL \n", source_entry->path_and_name);
+        }
+        return;
+    }
+    if (context->the_config->verbose && status == DIFF_CHANGED) {
+        printf(" Verification of files differences %s : DIFFERENT \n", source_entry->path_and_name);
+    }
+    if (destination_entry) {
+        // The copy keeps the inode, and may keep the size and mtime: the old digest must not be cached
+        destination_entry->digest_algorithm = DIGEST_NONE;
+    }
+    files_list_entry_t *copy = duplicate_files_list_entry(context->difference, source_entry);
+    if (!copy) {
+        printf("Cannot add file %s to difference: out of memory \n", source_entry->path_and_name);
+        return;
+    }
+    add_entry_to_tail(context->difference, copy);
+    if (context->the_config->verbose) {
+        printf("Add file %s to difference \n", source_entry->path_and_name);
+    }
+}
+
+/*!
+ * @brief compare_files_lists classifies the entries of the source list against the destination list
+ * @param source is a pointer to the source list
+ * @param start_of_src is the length of the source root in the source paths
+ * @param destination is a pointer to the destination list
+ * @param start_of_dest is the length of the destination root in the destination paths
+ * @param has_md5 is true to compare the digests of files with the same properties
+ * @param callback is the function called for each entry (@see diff_callback_t)
+ * @param parameters is passed to callback
+ */
+static void compare_files_lists(files_list_t *source, size_t start_of_src, files_list_t *destination, size_t start_of_dest, bool has_md5, diff_callback_t callback, void *parameters) {
+    if (is_files_list_sorted(source) && is_files_list_sorted(destination)) {
+        // Both lists share the same ordering: one merge walk classifies every entry
+        diff_files_lists(source, start_of_src, destination, start_of_dest, has_md5, callback, parameters);
+    } else {
+        // Index the destination once so that each lookup below is a hash probe instead of a scan
+        if (build_files_list_index(destination, start_of_dest) == -1) {
+            printf("Cannot index destination list, falling back to linear lookups \n");
+        }
+        for (files_list_entry_t *cmp_source=source->head; cmp_source != NULL; cmp_source=cmp_source->next) {
+            files_list_entry_t *cmp_destination = find_entry_by_name(destination, cmp_source->path_and_name, start_of_src, start_of_dest);
+            if (!cmp_destination) {
+                callback(DIFF_NEW, cmp_source, NULL, parameters);
+            } else if (mismatch(cmp_source, cmp_destination, has_md5)) {
+                callback(DIFF_CHANGED, cmp_source, cmp_destination, parameters);
+            } else {
+                callback(DIFF_UNCHANGED, cmp_source, cmp_destination, parameters);
+            }
+        }
+    }
+}
+
+/*!
+ * @brief add_digest_request adds an entry to the entries to hash, unless the digest cache knows its digest
+ * @param request is a pointer to the requests of the side of the entry
+ * @param entry is a pointer to the entry
+ */
+static void add_digest_request(digest_requests_t *request, files_list_entry_t *entry) {
+    if (find_cached_digest(entry, request->algorithm)) {
+        return;
+    }
+    if (request->count == request->capacity) {
+        size_t new_capacity = request->capacity ? 2 * request->capacity : 256;
+        files_list_entry_t **new_entries = realloc(request->entries, new_capacity * sizeof(files_list_entry_t *));
+        if (!new_entries) {
+            // Without memory, the entry is hashed right away
+            compute_file_digest(entry, request->algorithm);
+            return;
+        }
+        request->entries = new_entries;
+        request->capacity = new_capacity;
+    }
+    request->entries[request->count++] = entry;
+}
+
+/*!
+ * @brief add_to_digest_requests is the diff callback collecting the files to hash (@see diff_callback_t)
+ * Called on a comparison without digests, DIFF_UNCHANGED means that both files have the same properties.
+ * @param status the result of the comparison
+ * @param source_entry the source entry
+ * @param destination_entry the destination entry
+ * @param parameters a pointer to an array of two digest_requests_t, for the source and the destination
+ */
+static void add_to_digest_requests(diff_status_t status, files_list_entry_t *source_entry, files_list_entry_t *destination_entry, void *parameters) {
+    digest_requests_t *requests = (digest_requests_t *) parameters;
+    if (status == DIFF_UNCHANGED && source_entry->entry_type == FICHIER) {
+        add_digest_request(&requests[0], source_entry);
+        add_digest_request(&requests[1], destination_entry);
+    }
+}
+
+/*!
+ * @brief hash_requested_files computes the digests of the files of the requests, with the analyzers of the current mode
+ * @param the_config is a pointer to the configuration
+ * @param p_context is a pointer to the processes context
+ * @param requests are the requests of the source and of the destination
+ */
+static void hash_requested_files(configuration_t *the_config, process_context_t *p_context, digest_requests_t requests[2]) {
+    if (the_config->verbose) {
+        printf("Files to hash: %zu in source, %zu in destination \n", requests[0].count, requests[1].count);
+        if (the_config->digest_algorithm == DIGEST_MD5) {
+            printf("Small files MD5 kernel: %s, %d files at once \n", get_md5_kernel_name(), MD5_LANES);
+        }
+    }
+    if (the_config->is_parallel && the_config->is_threaded) {
+        hash_entries_threaded(requests, 2, 2 * (the_config->processes_count > 0 ? the_config->processes_count : 1), the_config->hash_buffer_size, the_config->uses_direct_io);
+    } else if (the_config->is_parallel) {
+        request_digests(p_context->message_queue_id, requests, p_context->processes_count, the_config->batch_size);
+    } else {
+        hashing_reader_t reader;
+        bool has_reader = init_hashing_reader(&reader, the_config->digest_algorithm, the_config->hash_buffer_size, the_config->uses_direct_io) == 0;
+        for (int side=0; side<2; ++side) {
+            if (has_reader) {
+                hash_files(&reader, requests[side].entries, requests[side].count);
+                continue;
+            }
+            for (size_t i=0; i<requests[side].count; ++i) {
+                compute_file_digest(requests[side].entries[i], requests[side].algorithm);
+            }
+        }
+        if (has_reader) {
+            free_hashing_reader(&reader);
+        }
+    }
+}
+
+/*!
+ * @brief compute_missing_digests computes the digests needed by the comparison of both lists
+ * Files that are new, or whose properties already differ, are different whatever their content: only the
+ * pairs of files with the same properties are hashed, by the analyzers of the current mode.
+ * @param the_config is a pointer to the configuration
+ * @param p_context is a pointer to the processes context
+ * @param source is a pointer to the source list
+ * @param start_of_src is the length of the source root in the source paths
+ * @param destination is a pointer to the destination list
+ * @param start_of_dest is the length of the destination root in the destination paths
+ */
+void compute_missing_digests(configuration_t *the_config, process_context_t *p_context, files_list_t *source, size_t start_of_src, files_list_t *destination, size_t start_of_dest) {
+    digest_requests_t requests[2] = {
+            {source, start_of_src, the_config->digest_algorithm, NULL, 0, 0},
+            {destination, start_of_dest, the_config->digest_algorithm, NULL, 0, 0},
+    };
+    compare_files_lists(source, start_of_src, destination, start_of_dest, false, add_to_digest_requests, requests);
+    hash_requested_files(the_config, p_context, requests);
+    free(requests[0].entries);
+    free(requests[1].entries);
+}
+
+/*!
+ * @brief create_parent_directories creates the missing directories of a destination path
+ * @param destination_path is the path of a file in the destination, it is restored before returning
+ * @param start_of_relative is the length of the destination root in destination_path, existing in any case
+ * @return 0 in case of success, -1 else
+ */
+static int create_parent_directories(char *destination_path, size_t start_of_relative) {
+    for (char *separator = strchr(destination_path + start_of_relative + 1, '/'); separator; separator = strchr(separator + 1, '/')) {
+        *separator = '\0';
+        // the folder may exist already, created for a previous file
+        int result = mkdir(destination_path, 0777);
+        *separator = '/';
+        if (result != 0 && errno != EEXIST) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*!
+ * @brief make_parent_directory creates the destination directory of a source file
+ * @param cache is a pointer to the directory cache of the destination
+ * @param entry is a pointer to the entry of the source file
+ * @param start_of_src is the length of the source root in the source paths
+ * @return 0 in case of success, -1 else
+ */
+static int make_parent_directory(directory_cache_t *cache, files_list_entry_t *entry, size_t start_of_src) {
+    char relative_path[PATH_SIZE];
+    char *relative_name = entry->path_and_name + start_of_src + 1;
+    char *last_separator = strrchr(relative_name, '/');
+    if (!last_separator) {
+        return 0;
+    }
+    size_t parent_length = (size_t)(last_separator - relative_name);
+    memcpy(relative_path, relative_name, parent_length);
+    relative_path[parent_length] = '\0';
+    return make_directory(cache, relative_path);
+}
+
+/*!
+ * @brief make_destination_directories creates the directories of the files to copy before copying them
+ * It runs before the copies, which can then run in parallel. Each directory is created once (@see make_directory).
+ * @param entries are the entries of the files to copy
+ * @param count is the number of entries
+ * @param the_config is a pointer to the configuration
+ */
+static void make_destination_directories(files_list_entry_t **entries, size_t count, configuration_t *the_config) {
+    directory_cache_t cache;
+    if (count == 0 || init_directory_cache(&cache, the_config->destination) == -1) {
+        return;
+    }
+    size_t start_of_src = strlen(the_config->source);
+    for (size_t i=0; i<count; ++i) {
+        if (make_parent_directory(&cache, entries[i], start_of_src) == -1) {
+            perror("Canno't open the path \n");
+        }
+    }
+    if (the_config->verbose) {
+        printf("Directories: %llu created, %llu known\n", (unsigned long long)cache.created_count, (unsigned long long)cache.known_count);
+    }
+    free_directory_cache(&cache);
+}
+
+/*!
+ * @brief add_received_batch adds the entries of a batch sent by a lister to the tail of its list
+ * @param batch is a pointer to the received batch
+ * @param source is a pointer to the source list
+ * @param destination is a pointer to the destination list
+ */
+static void add_received_batch(files_list_batch_t *batch, files_list_t *source, files_list_t *destination) {
+    files_list_entry_t received_entry;
+    char received_path[PATH_SIZE];
+    files_list_t *target_list = (batch->reply_to == MSG_TYPE_TO_SOURCE_LISTER) ? source : destination;
+    size_t offset = 0;
+    for (uint16_t i=0; i<batch->count; ++i) {
+        ssize_t used = decode_file_entry(batch->payload + offset, batch->length - offset, &received_entry, received_path);
+        if (used == -1) {
+            printf("Invalid file entry received \n");
+            break;
+        }
+        offset += used;
+        add_entry_to_tail(target_list,duplicate_files_list_entry(target_list,&received_entry));
+    }
+}
+
+typedef struct {
+    configuration_t *the_config;
+    process_context_t *p_context;
+    files_list_t *source;
+    files_list_t *destination;
+    size_t start_of_src;
+    size_t start_of_dest;
+    files_list_entry_t *last_source; // Last entries compared, NULL before the first one
+    files_list_entry_t *last_destination;
+    bool source_complete; // The lister sent its whole list
+    bool destination_complete;
+    bool is_aborted; // A lister could not complete its list, nothing more is compared
+    difference_context_t difference;
+    files_list_entry_t **deferred; // Pairs of files with the same properties, source then destination
+    size_t deferred_count; // Number of pairs
+    size_t deferred_capacity;
+    directory_cache_t directories;
+    bool has_directories;
+    copy_pool_t copies;
+    bool has_copies;
+    copy_statistics_t statistics;
+} sync_pipeline_t;
+
+/*!
+ * @brief apply_pipeline_difference records the result of a comparison and starts the copy of new and changed files
+ * In verbose mode, each new or changed file is displayed as it is added to the difference list.
+ * @param pipeline is a pointer to the pipeline
+ * @param status is the result of the comparison
+ * @param source_entry is the source entry
+ * @param destination_entry is the destination entry, NULL for new files
+ */
+static void apply_pipeline_difference(sync_pipeline_t *pipeline, diff_status_t status, files_list_entry_t *source_entry, files_list_entry_t *destination_entry) {
+    add_to_difference(status, source_entry, destination_entry, &pipeline->difference);
+    if (pipeline->the_config->verbose && (status == DIFF_NEW || status == DIFF_CHANGED)) {
+        // The difference list is displayed as it grows, like synchronize displays it once complete
+        printf("%s\n", source_entry->path_and_name);
+    }
+    if ((status != DIFF_NEW && status != DIFF_CHANGED) || pipeline->the_config->dry_run || !S_ISREG(source_entry->mode)) {
+        return;
+    }
+    // Entries of the lists never move, the copy threads can use the source entry until the end
+    if (pipeline->has_directories && make_parent_directory(&pipeline->directories, source_entry, pipeline->start_of_src) == -1) {
+        perror("Canno't open the path \n");
+    }
+    if (!pipeline->has_copies || submit_copy(&pipeline->copies, source_entry) == -1) {
+        uint64_t copied_bytes;
+        copy_strategy_t strategy = copy_entry_to_destination(source_entry, pipeline->the_config, &copied_bytes);
+        add_copy_to_statistics(&pipeline->statistics, strategy, copied_bytes);
+    }
+}
+
+/*!
+ * @brief compare_pipeline_pair compares a source and a destination file with the same relative path
+ * Without a cached digest for both files, a pair with the same properties waits for the end of the lists: the
+ * analyzers hash files when the listers do not need them anymore.
+ * @param pipeline is a pointer to the pipeline
+ * @param source_entry is the source entry
+ * @param destination_entry is the destination entry
+ */
+static void compare_pipeline_pair(sync_pipeline_t *pipeline, files_list_entry_t *source_entry, files_list_entry_t *destination_entry) {
+    configuration_t *the_config = pipeline->the_config;
+    if (mismatch(source_entry, destination_entry, false)) {
+        apply_pipeline_difference(pipeline, DIFF_CHANGED, source_entry, destination_entry);
+        return;
+    }
+    if (!the_config->uses_md5 || source_entry->entry_type != FICHIER) {
+        apply_pipeline_difference(pipeline, DIFF_UNCHANGED, source_entry, destination_entry);
+        return;
+    }
+    if (find_cached_digest(source_entry, the_config->digest_algorithm) && find_cached_digest(destination_entry, the_config->digest_algorithm)) {
+        apply_pipeline_difference(pipeline, mismatch(source_entry, destination_entry, true) ? DIFF_CHANGED : DIFF_UNCHANGED, source_entry, destination_entry);
+        return;
+    }
+    if (pipeline->deferred_count == pipeline->deferred_capacity) {
+        size_t new_capacity = pipeline->deferred_capacity ? 2 * pipeline->deferred_capacity : 256;
+        files_list_entry_t **new_deferred = realloc(pipeline->deferred, 2 * new_capacity * sizeof(files_list_entry_t *));
+        if (!new_deferred) {
+            // Without memory, the file is copied without comparing the digests
+            apply_pipeline_difference(pipeline, DIFF_CHANGED, source_entry, destination_entry);
+            return;
+        }
+        pipeline->deferred = new_deferred;
+        pipeline->deferred_capacity = new_capacity;
+    }
+    pipeline->deferred[2 * pipeline->deferred_count] = source_entry;
+    pipeline->deferred[2 * pipeline->deferred_count + 1] = destination_entry;
+    ++pipeline->deferred_count;
+}
+
+/*!
+ * @brief advance_pipeline compares the entries received from both listers, as far as they can be compared
+ * Listers send their entries in the order of compare_paths. The last path received from a side is its
+ * watermark: a source entry before the watermark of the destination has its counterpart already received, or
+ * has none. The walk stops at the lowest watermark and goes on when more entries arrive.
+ * @param pipeline is a pointer to the pipeline
+ */
+static void advance_pipeline(sync_pipeline_t *pipeline) {
+    while (1) {
+        files_list_entry_t *source_entry = pipeline->last_source ? pipeline->last_source->next : pipeline->source->head;
+        files_list_entry_t *destination_entry = pipeline->last_destination ? pipeline->last_destination->next : pipeline->destination->head;
+        int order;
+        if (source_entry && destination_entry) {
+            order = compare_paths(source_entry->path_and_name + pipeline->start_of_src + 1, destination_entry->path_and_name + pipeline->start_of_dest + 1);
+        } else if (source_entry && pipeline->destination_complete) {
+            order = -1;
+        } else if (destination_entry && pipeline->source_complete) {
+            order = 1;
+        } else {
+            // Waits for the side that is behind
+            return;
+        }
+        if (order < 0) {
+            apply_pipeline_difference(pipeline, DIFF_NEW, source_entry, NULL);
+            pipeline->last_source = source_entry;
+        } else if (order > 0) {
+            pipeline->last_destination = destination_entry;
+        } else {
+            compare_pipeline_pair(pipeline, source_entry, destination_entry);
+            pipeline->last_source = source_entry;
+            pipeline->last_destination = destination_entry;
+        }
+    }
+}
+
+/*!
+ * @brief finish_pipeline compares the deferred pairs by digest, then waits for the copies
+ * When a list is aborted, the deferred pairs are not compared and the digest cache is kept as is.
+ * @param pipeline is a pointer to the pipeline, whose lists are complete or aborted
+ */
+static void finish_pipeline(sync_pipeline_t *pipeline) {
+    configuration_t *the_config = pipeline->the_config;
+    if (pipeline->deferred_count > 0 && !pipeline->is_aborted) {
+        digest_requests_t requests[2] = {
+                {pipeline->source, pipeline->start_of_src, the_config->digest_algorithm, NULL, 0, 0},
+                {pipeline->destination, pipeline->start_of_dest, the_config->digest_algorithm, NULL, 0, 0},
+        };
+        for (size_t i=0; i<pipeline->deferred_count; ++i) {
+            add_digest_request(&requests[0], pipeline->deferred[2 * i]);
+            add_digest_request(&requests[1], pipeline->deferred[2 * i + 1]);
+        }
+        hash_requested_files(the_config, pipeline->p_context, requests);
+        free(requests[0].entries);
+        free(requests[1].entries);
+        for (size_t i=0; i<pipeline->deferred_count; ++i) {
+            files_list_entry_t *source_entry = pipeline->deferred[2 * i];
+            files_list_entry_t *destination_entry = pipeline->deferred[2 * i + 1];
+            apply_pipeline_difference(pipeline, mismatch(source_entry, destination_entry, true) ? DIFF_CHANGED : DIFF_UNCHANGED, source_entry, destination_entry);
+        }
+    }
+    free(pipeline->deferred);
+    if (the_config->uses_md5 && the_config->uses_digest_cache && !the_config->dry_run && !pipeline->is_aborted
+            && save_digest_cache(the_config->cache_file, pipeline->source, pipeline->destination) == -1) {
+        perror("Erreur lors de l'enregistrement du cache d'empreintes");
+    }
+    if (pipeline->has_copies) {
+        finish_copy_pool(&pipeline->copies, &pipeline->statistics);
+    }
+    if (pipeline->has_directories) {
+        if (the_config->verbose) {
+            printf("Directories: %llu created, %llu known\n", (unsigned long long)pipeline->directories.created_count, (unsigned long long)pipeline->directories.known_count);
+        }
+        free_directory_cache(&pipeline->directories);
+    }
+    if (the_config->verbose && !the_config->dry_run) {
+        display_copy_statistics(&pipeline->statistics);
+    }
+}
+
+/*!
+ * @brief synchronize_pipelined synchronizes with the lister processes, comparing and copying files while the lists are built
+ * New files and files whose properties changed are copied by a pool of threads as soon as both lists reach
+ * them (@see advance_pipeline), so the copies overlap with the listing of the rest of the trees.
+ * @param the_config is a pointer to the configuration
+ * @param p_context is a pointer to the processes context
+ * @return 0 in case of success, -1 when a list was aborted
+ */
+static int synchronize_pipelined(configuration_t *the_config, process_context_t *p_context) {
+    files_list_t source, destination, difference;
+    init_files_list(&source);
+    init_files_list(&destination);
+    init_files_list(&difference);
+    sync_pipeline_t pipeline;
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.the_config = the_config;
+    pipeline.p_context = p_context;
+    pipeline.source = &source;
+    pipeline.destination = &destination;
+    pipeline.start_of_src = strlen(the_config->source);
+    pipeline.start_of_dest = strlen(the_config->destination);
+    pipeline.difference.the_config = the_config;
+    pipeline.difference.difference = &difference;
+    if (!the_config->dry_run) {
+        pipeline.has_directories = init_directory_cache(&pipeline.directories, the_config->destination) == 0;
+        pipeline.has_copies = start_copy_pool(&pipeline.copies, the_config) == 0;
+    }
+    if (the_config->verbose) {
+        printf("Send analyze directory command to listers, files are copied while the lists are received \n");
+    }
+    send_analyze_dir_command(p_context->message_queue_id,MSG_TYPE_TO_SOURCE_LISTER,the_config->source);
+    send_analyze_dir_command(p_context->message_queue_id,MSG_TYPE_TO_DESTINATION_LISTER,the_config->destination);
+    any_message_t message;
+    while (!pipeline.source_complete || !pipeline.destination_complete) {
+        if (receive_message(p_context->message_queue_id, MSG_TYPE_TO_MAIN, &message) == -1) {
+            perror("Erreur lors de la lecture du message");
+            exit(EXIT_FAILURE);
+        }
+        switch (get_message_op_code(&message)) {
+            case COMMAND_CODE_LIST_ABORTED:
+                pipeline.is_aborted = true;
+                // fall through
+            case COMMAND_CODE_LIST_COMPLETE:
+                if (message.files_batch.reply_to == MSG_TYPE_TO_SOURCE_LISTER) {
+                    pipeline.source_complete = true;
+                } else {
+                    pipeline.destination_complete = true;
+                }
+                break;
+            case COMMAND_CODE_FILES_BATCH:
+                add_received_batch(&message.files_batch, &source, &destination);
+                break;
+            default:
+                continue;
+        }
+        if (!pipeline.is_aborted) {
+            advance_pipeline(&pipeline);
+        }
+    }
+    if (pipeline.is_aborted) {
+        // The copies already started are those of files that differ, they are completed
+        printf("Listing failed, synchronization aborted\n");
+    }
+    finish_pipeline(&pipeline);
+    if (the_config->verbose) {
+        printf(" clear files lists  : ");
+    }
+    clear_files_list(&difference);
+    clear_files_list(&source);
+    clear_files_list(&destination);
+    if(the_config->verbose) {
+        printf(" End \n");
+    }
+    return pipeline.is_aborted ? -1 : 0;
+}
 
 /*!
  * @brief synchronize is the main function for synchronization
@@ -22,24 +525,30 @@
  * It must adapt to the parallel or not operation of the program.
  * @param the_config is a pointer to the configuration
  * @param p_context is a pointer to the processes context
+ * @return 0 in case of success, -1 when a list was aborted
  */
-void synchronize(configuration_t *the_config, process_context_t *p_context) {
+int synchronize(configuration_t *the_config, process_context_t *p_context) {
+    if (the_config->is_parallel && !the_config->is_threaded && the_config->uses_pipeline) {
+        return synchronize_pipelined(the_config, p_context);
+    }
     // Init list
     if (the_config->verbose) {
         printf(" Source / Destination list init \n");
     }
     files_list_t source;
-    source.head=NULL;
-    source.tail=NULL;
+    init_files_list(&source);
     files_list_t destination;
-    destination.head=NULL;
-    destination.tail=NULL;
+    init_files_list(&destination);
     files_list_t difference;
-    difference.head=NULL;
-    difference.tail=NULL;
-    if (the_config->is_parallel) {
-        bool lister_source = true;
-        bool lister_dest = true;
+    init_files_list(&difference);
+    bool is_aborted = false; // A list misses files, it cannot be compared
+    if (the_config->is_parallel && the_config->is_threaded) {
+        if (the_config->verbose) {
+            printf("Build file lists with threads, source : %s , destination : %s |  \n",the_config->source,the_config->destination);
+        }
+        is_aborted = (make_files_lists_threaded(&source, &destination, the_config) == -1);
+    } else if (the_config->is_parallel) {
+        int lists_complete = 0;
         //envoie des commandes de listages de repertoires au deux listeurs
 	    if (the_config->verbose) {
             printf("Send analyze directory command to listers \n");
@@ -47,55 +556,32 @@ void synchronize(configuration_t *the_config, process_context_t *p_context) {
 	    send_analyze_dir_command(p_context->message_queue_id,MSG_TYPE_TO_SOURCE_LISTER,the_config->source);
         send_analyze_dir_command(p_context->message_queue_id,MSG_TYPE_TO_DESTINATION_LISTER,the_config->destination);
 
-        simple_command_t end_message;
-        memset(&end_message,0, sizeof(simple_command_t));
-	    files_list_entry_transmit_t entry_from_lister;
+        any_message_t message;
         //boucle infini
 	    if (the_config->verbose) {
             printf("Build file lists on target, source : %s , destination : %s |  \n",the_config->source,the_config->destination);
         }
-	    while (1) {
-            memset(&entry_from_lister,0, sizeof(files_list_entry_transmit_t));
-            //attente d'entrée de liste de fichier à ajouter
-            size_t entry_result = msgrcv(p_context->message_queue_id,&entry_from_lister, sizeof(files_list_entry_transmit_t),COMMAND_CODE_FILE_ENTRY,IPC_NOWAIT);
-            if (entry_result == -1){
-                if (errno == ENOMSG) {
-                    //attendre 1000 mili secondes
-                    usleep(100000);
-                } else {
-                    perror("Erreur lors de la lecture du message");
-                    exit(EXIT_FAILURE);
-                }
-            }else{
-                if(entry_from_lister.mtype == MSG_TYPE_TO_SOURCE_LISTER){
-                    add_entry_to_tail(&source,&entry_from_lister.payload);
-                }
-                if(entry_from_lister.mtype == MSG_TYPE_TO_DESTINATION_LISTER){
-                    add_entry_to_tail(&destination,&entry_from_lister.payload);
-                }
-            }
-            //gestion des message de fin de list -> sortie de la boucle si toutes les entrées sont transmises
-            if(entry_from_lister.reply_to != 0){
-            size_t end_result = msgrcv(p_context->message_queue_id,&end_message, sizeof(simple_command_t),COMMAND_CODE_LIST_COMPLETE,IPC_NOWAIT);
-            if (end_result == -1) {
-                if (errno == ENOMSG) {
-                    // attendre 1000 mili secondes
-                    usleep(100000);
-                } else {
-                    perror("Erreur lors de la lecture du message");
-                    exit(EXIT_FAILURE);
-                }
-            } else {
-                if (end_message.mtype == MSG_TYPE_TO_SOURCE_LISTER) {
-                    lister_source = false;
-                }
-                if (end_message.mtype == MSG_TYPE_TO_DESTINATION_LISTER) {
-                    lister_dest = false;
-                }
-                if (!lister_source && !lister_dest ) {
-                    break;
-                }
+	    while (lists_complete < 2) {
+            //attente d'un lot d'entrées ou d'une fin de liste
+            if (receive_message(p_context->message_queue_id, MSG_TYPE_TO_MAIN, &message) == -1) {
+                perror("Erreur lors de la lecture du message");
+                exit(EXIT_FAILURE);
             }
+            switch (get_message_op_code(&message)) {
+            case COMMAND_CODE_LIST_ABORTED:
+                // la liste est incomplète, elle ne peut pas être comparée
+                is_aborted = true;
+                ++lists_complete;
+                break;
+            case COMMAND_CODE_LIST_COMPLETE:
+                // un listeur envoie sa fin de liste après toutes ses entrées
+                ++lists_complete;
+                break;
+            case COMMAND_CODE_FILES_BATCH:
+                add_received_batch(&message.files_batch, &source, &destination);
+                break;
+            default:
+                break;
             }
         }
         /*
@@ -120,7 +606,9 @@ void synchronize(configuration_t *the_config, process_context_t *p_context) {
         if (the_config->verbose) {
             printf("Build file list on target : %s  | ",the_config->source);
         }
-        make_files_list(&source,the_config->source);
+        if (make_files_list(&source,the_config->source,the_config->walkers_count) == -1) {
+            is_aborted = true;
+        }
         if (the_config->verbose) {
             display_files_list(&source);
         }
@@ -130,7 +618,9 @@ void synchronize(configuration_t *the_config, process_context_t *p_context) {
         if (the_config->verbose) {
             printf("Build file list on target : %s  | ",the_config->destination);
         }
-        make_files_list(&destination,the_config->destination);
+        if (make_files_list(&destination,the_config->destination,the_config->walkers_count) == -1) {
+            is_aborted = true;
+        }
         if (the_config->verbose) {
             display_files_list(&destination);
         }
@@ -138,57 +628,68 @@ void synchronize(configuration_t *the_config, process_context_t *p_context) {
             printf("\n\n");
         }
     }
+    if (is_aborted) {
+        printf("Listing failed, synchronization aborted\n");
+        clear_files_list(&source);
+        clear_files_list(&destination);
+        return -1;
+    }
     // build file list difference
-    files_list_entry_t *cmp_source = source.head;
-    files_list_entry_t *cmp_destination;
     if (the_config->verbose) {
         printf("Source and destination comparaison \n");
     }
-    while (cmp_source) {
-        if (destination.head) {
-            cmp_destination=find_entry_by_name(&destination, cmp_source->path_and_name, strlen(the_config->source), strlen(the_config->destination));
-            if (!cmp_destination) {
-                if (the_config->verbose) {
-                    printf("Add file %s to difference \n",cmp_source->path_and_name);
-                }
-                add_file_entry(&difference, cmp_source->path_and_name);
-            } else {
-                if (the_config->verbose) {
-                    printf(" Verification of files differences : ");
-                }
-                if (mismatch(cmp_source, cmp_destination, the_config->uses_md5)) {
-                    if (the_config->verbose) {
-                        printf(" DIFFERENT \n");
-                    }
-                    add_file_entry(&difference, cmp_source->path_and_name);
-                    if (the_config->verbose) {
-                        printf("Add file %s to difference \n",cmp_source->path_and_name);
-                    }
-                }
-                if (the_config->verbose) {
-                    printf(" EQUAL \n");
-                }
-            }
-        } else {
-            add_file_entry(&difference,cmp_source->path_and_name);
-            if (the_config->verbose) {
-                printf("Add file %s to difference \n",cmp_source->path_and_name);
-            }
-        }
-        cmp_source=cmp_source->next;
+    size_t start_of_src = strlen(the_config->source);
+    size_t start_of_dest = strlen(the_config->destination);
+    if (the_config->uses_md5) {
+        // Only files whose properties match can still differ by their content: hash them now
+        compute_missing_digests(the_config, p_context, &source, start_of_src, &destination, start_of_dest);
+    }
+    difference_context_t diff_context = {the_config, &difference};
+    compare_files_lists(&source, start_of_src, &destination, start_of_dest, the_config->uses_md5, add_to_difference, &diff_context);
+    // Both lists hold the digests of the compared files, except the replaced ones, they replace the cache
+    if (the_config->uses_md5 && the_config->uses_digest_cache && !the_config->dry_run && save_digest_cache(the_config->cache_file, &source, &destination) == -1) {
+        perror("Erreur lors de l'enregistrement du cache d'empreintes");
     }
-    make_files_list(&difference,NULL);
     if (the_config->verbose) {
         display_files_list(&difference);
     }
     if (the_config->verbose) {
         printf("|| Copy file difference || \n");
     }
-    files_list_entry_t *cmp_difference = difference.head;
+    copy_statistics_t copy_statistics = {{0}, {0}};
     if (!the_config->dry_run) {
-        while (cmp_difference) {
-            copy_entry_to_destination(cmp_difference, the_config);
-            cmp_difference = cmp_difference->next;
+        // Files to copy, their directories are created first, then they are copied in any order
+        size_t files_count = 0;
+        for (files_list_entry_t *cmp_difference = difference.head; cmp_difference; cmp_difference = cmp_difference->next) {
+            files_count += S_ISREG(cmp_difference->mode) ? 1 : 0;
+        }
+        files_list_entry_t **files_to_copy = malloc((files_count > 0 ? files_count : 1) * sizeof(files_list_entry_t *));
+        files_count = 0;
+        for (files_list_entry_t *cmp_difference = difference.head; cmp_difference; cmp_difference = cmp_difference->next) {
+            if (!S_ISREG(cmp_difference->mode)) {
+                continue;
+            }
+            if (files_to_copy) {
+                files_to_copy[files_count++] = cmp_difference;
+            } else {
+                uint64_t copied_bytes;
+                copy_strategy_t strategy = copy_entry_to_destination(cmp_difference, the_config, &copied_bytes);
+                add_copy_to_statistics(&copy_statistics, strategy, copied_bytes);
+            }
+        }
+        make_destination_directories(files_to_copy, files_count, the_config);
+        if (the_config->copy_jobs_count > 1 && files_count > 1) {
+            copy_entries_threaded(files_to_copy, files_count, the_config, &copy_statistics);
+        } else {
+            for (size_t i=0; i<files_count; ++i) {
+                uint64_t copied_bytes;
+                copy_strategy_t strategy = copy_entry_to_destination(files_to_copy[i], the_config, &copied_bytes);
+                add_copy_to_statistics(&copy_statistics, strategy, copied_bytes);
+            }
+        }
+        free(files_to_copy);
+        if (the_config->verbose) {
+            display_copy_statistics(&copy_statistics);
         }
     }
     if (the_config->verbose) {
@@ -200,6 +701,55 @@ void synchronize(configuration_t *the_config, process_context_t *p_context) {
     if(the_config->verbose) {
         printf(" End \n");
     }
+    return 0;
+}
+
+/*!
+ * @brief diff_files_lists compares a source and a destination list with a single merge walk
+ * Both lists must be ordered with compare_paths (@see is_files_list_sorted), which is the case for lists
+ * built with add_file_entry or received in order from a lister. Entries are matched on their path relative
+ * to their root, so the walk is O(n+m).
+ * @param src_list the source list
+ * @param start_of_src the length of the source root prefix
+ * @param dst_list the destination list
+ * @param start_of_dest the length of the destination root prefix
+ * @param has_md5 a value to enable or disable MD5 sum check (@see mismatch)
+ * @param callback the function called once per distinct relative path, in order
+ * @param parameters a pointer passed to callback
+ * @return 0 in case of success, -1 else
+ */
+int diff_files_lists(files_list_t *src_list, size_t start_of_src, files_list_t *dst_list, size_t start_of_dest, bool has_md5, diff_callback_t callback, void *parameters) {
+    if (!src_list || !dst_list || !callback) {
+        return -1;
+    }
+    files_list_entry_t *src_cursor = src_list->head;
+    files_list_entry_t *dst_cursor = dst_list->head;
+    while (src_cursor || dst_cursor) {
+        int order;
+        if (!src_cursor) {
+            order = 1;
+        } else if (!dst_cursor) {
+            order = -1;
+        } else {
+            order = compare_paths(src_cursor->path_and_name + start_of_src + 1, dst_cursor->path_and_name + start_of_dest + 1);
+        }
+        if (order < 0) {
+            callback(DIFF_NEW, src_cursor, NULL, parameters);
+            src_cursor = src_cursor->next;
+        } else if (order > 0) {
+            callback(DIFF_DESTINATION_ONLY, NULL, dst_cursor, parameters);
+            dst_cursor = dst_cursor->next;
+        } else {
+            if (mismatch(src_cursor, dst_cursor, has_md5)) {
+                callback(DIFF_CHANGED, src_cursor, dst_cursor, parameters);
+            } else {
+                callback(DIFF_UNCHANGED, src_cursor, dst_cursor, parameters);
+            }
+            src_cursor = src_cursor->next;
+            dst_cursor = dst_cursor->next;
+        }
+    }
+    return 0;
 }
 
 /*!
@@ -211,7 +761,7 @@ void synchronize(configuration_t *the_config, process_context_t *p_context) {
  */
 bool mismatch(files_list_entry_t *lhd, files_list_entry_t *rhd, bool has_md5) {
     if (has_md5==true) {
-          if (memcmp(lhd->md5sum, rhd->md5sum, sizeof(lhd->md5sum)) != 0) {
+          if (lhd->digest_algorithm != rhd->digest_algorithm || memcmp(lhd->digest, rhd->digest, get_digest_size(lhd->digest_algorithm)) != 0) {
               perror("MD5 sum are different \n");
               return true;  // Les empreintes MD5 sont différentes
           }
@@ -232,17 +782,12 @@ bool mismatch(files_list_entry_t *lhd, files_list_entry_t *rhd, bool has_md5) {
  * @brief make_files_list buils a files list in no parallel mode
  * @param list is a pointer to the list that will be built
  * @param target_path is the path whose files to list
+ * @param walkers_count is the number of threads listing the directory
+ * @return 0 in case of success, -1 when the list misses files
  */
-void make_files_list(files_list_t *list, char *target_path) {
-    make_list(list,target_path);
-    files_list_entry_t *cmp=list->head;
-    while (cmp) {
-        if (get_file_stats(cmp)==-1) {
-            printf("Error  \n");
-            return;
-        }
-        cmp = cmp->next;
-    }
+int make_files_list(files_list_t *list, char *target_path, uint8_t walkers_count) {
+    // Properties come from fstatat during the walk, digests are only computed when comparing (@see compute_missing_digests)
+    return walk_directory_tree(list, target_path, true, walkers_count);
 }
 
 /*!
@@ -259,76 +804,92 @@ void make_files_lists_parallel(files_list_t *src_list, files_list_t *dst_list, c
  * @brief copy_entry_to_destination copies a file from the source to the destination
  * It keeps access modes and mtime (@see utimensat)
  * Pay attention to the path so that the prefixes are not repeated from the source to the destination
- * Use sendfile to copy the file, mkdir to create the directory
+ * The data is copied by the copy engine (@see copy_file_data). Missing directories are created, but the
+ * callers copying in parallel create them first (@see make_destination_directories).
+ * In delta mode, a large file existing in the destination is only rewritten where it differs (@see delta_copy_file).
+ * It may run in several threads at the same time: the verbose output of a copy is a single line.
+ * @param source_entry is the entry to copy
+ * @param the_config is a pointer to the program configuration
+ * @param copied_bytes receives the number of bytes written (holes and unchanged blocks excluded), if not NULL
+ * @return the strategy used to copy the data, COPY_FAILED in case of error or for entries that are not files
  */
-void copy_entry_to_destination(files_list_entry_t *source_entry, configuration_t *the_config) {
+copy_strategy_t copy_entry_to_destination(files_list_entry_t *source_entry, configuration_t *the_config, uint64_t *copied_bytes) {
     char file_created_path[PATH_SIZE];
+    if (copied_bytes) {
+        *copied_bytes = 0;
+    }
     //delete prefix from file_list_entry
-    if (S_ISREG(source_entry->mode)) {
-        concat_path(file_created_path, the_config->destination, source_entry->path_and_name+strlen(the_config->source)+1);
-        if (the_config->verbose) {
-            printf("|| Copying %s into %s ||", file_created_path, the_config->destination);
+    if (!S_ISREG(source_entry->mode)) {
+        return COPY_FAILED;
+    }
+    concat_path(file_created_path, the_config->destination, source_entry->path_and_name+strlen(the_config->source)+1);
+    int source_fd = open(source_entry->path_and_name, O_RDONLY);
+    if (source_fd == -1) {
+        printf("|| Copying %s into %s || Failed \n", file_created_path, the_config->destination);
+        perror("Error during source file opening \n");
+        return COPY_FAILED;
+    }
+    uint64_t bytes_copied;
+    copy_strategy_t strategy = COPY_FAILED;
+    if (the_config->uses_delta && source_entry->size >= DELTA_MIN_FILE_SIZE) {
+        int destination_fd = open(file_created_path, O_RDWR);
+        struct stat destination_stat;
+        delta_result_t result;
+        if (destination_fd != -1 && fstat(destination_fd, &destination_stat) == 0 && S_ISREG(destination_stat.st_mode)
+                && destination_stat.st_size >= DELTA_MIN_FILE_SIZE
+                && delta_copy_file(source_fd, destination_fd, file_created_path, source_entry->mode, &result) == 0) {
+            strategy = COPY_DELTA;
+            bytes_copied = result.written_bytes;
         }
-        int source_fd = open(source_entry->path_and_name, O_RDONLY);
-        if (source_fd == -1) {
-            printf(" Failed \n");
-            perror("Error during source file opening \n");
-            return;
-        }
-        //Create intermediate folders
-        char *sep="/";
-        char *token = strtok(source_entry->path_and_name+strlen(the_config->source)+1,sep);
-        char dir_path[256] = "";
-        strcat(dir_path,the_config->destination);
-        while (strcmp(dir_path,file_created_path) != 0) {
-            strcat(dir_path,sep);
-            strcat(dir_path,token);
-            if (strcmp(dir_path,file_created_path)!=0) {
-                if (mkdir(dir_path,0777) != 0) {
-                    if (the_config->verbose) {
-                        printf(" Failed \n");
-                    }
-                    perror("Canno't open the path \n");
-                    return;
-                } else {
-
-                }
-            }
-            token = strtok(NULL,sep);
+        if (destination_fd != -1 && close(destination_fd) == -1) {
+            strategy = COPY_FAILED;
         }
+    }
+    if (strategy == COPY_FAILED) {
+        // A new file, or a failed delta, is copied as a whole
         int destination_fd = open(file_created_path, O_WRONLY | O_CREAT | O_TRUNC, source_entry->mode);
+        if (destination_fd == -1 && errno == ENOENT && create_parent_directories(file_created_path, strlen(the_config->destination)) == 0) {
+            //Create intermediate folders, then try again
+            destination_fd = open(file_created_path, O_WRONLY | O_CREAT | O_TRUNC, source_entry->mode);
+        }
         if (destination_fd == -1) {
             if (the_config->verbose) {
-                printf(" Failed \n");
+                printf("|| Copying %s into %s || Failed \n", file_created_path, the_config->destination);
             }
             perror("Error during destination file opening \n");
-            return;
+            close(source_fd);
+            return COPY_FAILED;
         }
-
-        off_t offset = 0;
-        ssize_t bytes_copied = sendfile(destination_fd, source_fd, &offset, source_entry->size);
-        if (bytes_copied == -1) {
-            if(the_config->verbose) {
-                printf(" Failed \n");
-            }
-            perror("Error copying file contents");
-            return;
+        strategy = copy_file_data(source_fd, destination_fd, source_entry->size, &bytes_copied);
+        if (close(destination_fd) == -1) {
+            strategy = COPY_FAILED;
         }
-        close(source_fd);
-        close(destination_fd);
-        // Keeping access modes and mtime
-        struct timespec mtime[2] = {source_entry->mtime, source_entry->mtime};
-        if (utimensat(AT_FDCWD, file_created_path, mtime, 0) == -1) {
-            if (the_config->verbose) {
-                printf(" Failed \n");
-            }
-            perror("Error setting acces modes and mtime");
-            return;
+    }
+    close(source_fd);
+    if (strategy == COPY_FAILED) {
+        if(the_config->verbose) {
+            printf("|| Copying %s into %s || Failed \n", file_created_path, the_config->destination);
         }
+        perror("Error copying file contents");
+        return COPY_FAILED;
+    }
+    // Keeping access modes and mtime
+    struct timespec mtime[2] = {source_entry->mtime, source_entry->mtime};
+    if (utimensat(AT_FDCWD, file_created_path, mtime, 0) == -1) {
         if (the_config->verbose) {
-            printf("Succes \n");
+            printf("|| Copying %s into %s || Failed \n", file_created_path, the_config->destination);
         }
+        perror("Error setting acces modes and mtime");
+        return COPY_FAILED;
+    }
+    if (the_config->verbose) {
+        printf("|| Copying %s into %s || Succes (%s, %llu bytes) \n", file_created_path, the_config->destination,
+               get_copy_strategy_name(strategy), (unsigned long long)bytes_copied);
+    }
+    if (copied_bytes) {
+        *copied_bytes = bytes_copied;
     }
+    return strategy;
 }
 
 /*!
@@ -339,25 +900,7 @@ void copy_entry_to_destination(files_list_entry_t *source_entry, configuration_t
  * @param target is the target dir whose content must be listed
  */
 void make_list(files_list_t *list, char *target) {
-    if (!list || !target) {
-        return;
-    }
-    DIR *target_dir;
-    struct dirent *dir_entry;
-    char path_file[PATH_SIZE];
-    if (!(target_dir = open_dir(target))) {// Check file opening
-        return;
-    }
-    while ((dir_entry=get_next_entry(target_dir)) != NULL) {
-        concat_path(path_file, target, dir_entry->d_name);
-        if (dir_entry->d_type == DT_REG) {
-            add_file_entry(list, path_file);
-        }
-        if (dir_entry->d_type == DT_DIR) {
-            make_list(list,path_file);
-        }
-    }
-    closedir(target_dir);
+    walk_directory_tree(list, target, false, 1);
 }
 
 /*!
@@ -4,13 +4,20 @@
 #include <files-list.h>
 #include <configuration.h>
 #include <processes.h>
+#include <copy-engine.h>
 #include <dirent.h>
 
-void synchronize(configuration_t *the_config, process_context_t *p_context);
-void make_files_list(files_list_t *list, char *target_path);
+typedef enum { DIFF_NEW, DIFF_CHANGED, DIFF_UNCHANGED, DIFF_DESTINATION_ONLY } diff_status_t;
+
+typedef void (*diff_callback_t)(diff_status_t status, files_list_entry_t *source_entry, files_list_entry_t *destination_entry, void *parameters);
+
+int synchronize(configuration_t *the_config, process_context_t *p_context);
+int make_files_list(files_list_t *list, char *target_path, uint8_t walkers_count);
+int diff_files_lists(files_list_t *src_list, size_t start_of_src, files_list_t *dst_list, size_t start_of_dest, bool has_md5, diff_callback_t callback, void *parameters);
 bool mismatch(files_list_entry_t *lhd, files_list_entry_t *rhd, bool has_md5);
+void compute_missing_digests(configuration_t *the_config, process_context_t *p_context, files_list_t *source, size_t start_of_src, files_list_t *destination, size_t start_of_dest);
 void make_files_lists_parallel(files_list_t *src_list, files_list_t *dst_list, configuration_t *the_config, int msg_queue);
-void copy_entry_to_destination(files_list_entry_t *source_entry, configuration_t *the_config);
+copy_strategy_t copy_entry_to_destination(files_list_entry_t *source_entry, configuration_t *the_config, uint64_t *copied_bytes);
 void make_list(files_list_t *list, char *target);
 DIR *open_dir(char *path);
 struct dirent *get_next_entry(DIR *dir);
\ No newline at end of file
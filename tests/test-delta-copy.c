@@ -0,0 +1,149 @@
+#include <delta-copy.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FILE_SIZE (DELTA_MIN_FILE_SIZE + 1024 * 1024)
+
+static char root[64];
+static char source_path[128];
+static char destination_path[128];
+
+/*!
+ * @brief fill_random fills a buffer with pseudo-random bytes, the same ones for a seed
+ * @param buffer is the buffer to fill
+ * @param size is the size of the buffer
+ * @param seed is the seed of the bytes
+ */
+static void fill_random(uint8_t *buffer, size_t size, unsigned int seed) {
+    for (size_t i=0; i<size; ++i) {
+        buffer[i] = (uint8_t)rand_r(&seed);
+    }
+}
+
+/*!
+ * @brief write_file writes a buffer in a file
+ * @param path is the path of the file
+ * @param buffer is the content of the file
+ * @param size is the size of the content
+ */
+static void write_file(const char *path, const uint8_t *buffer, size_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1);
+    assert(write(fd, buffer, size) == (ssize_t)size);
+    assert(close(fd) == 0);
+}
+
+/*!
+ * @brief assert_file_content checks that a file holds a buffer
+ * @param path is the path of the file
+ * @param buffer is the expected content
+ * @param size is the expected size
+ */
+static void assert_file_content(const char *path, const uint8_t *buffer, size_t size) {
+    uint8_t *content = malloc(size + 1);
+    assert(content);
+    int fd = open(path, O_RDONLY);
+    assert(fd != -1);
+    size_t length = 0;
+    ssize_t read_bytes;
+    while ((read_bytes = read(fd, content + length, size + 1 - length)) > 0) {
+        length += (size_t)read_bytes;
+    }
+    assert(read_bytes == 0 && close(fd) == 0);
+    assert(length == size && memcmp(content, buffer, size) == 0);
+    free(content);
+}
+
+/*!
+ * @brief run_delta updates the destination file from the source file with a delta
+ * @param result receives the amounts of data reused and written
+ * @return the inode of the destination before the update
+ */
+static ino_t run_delta(delta_result_t *result) {
+    int source_fd = open(source_path, O_RDONLY);
+    int destination_fd = open(destination_path, O_RDWR);
+    assert(source_fd != -1 && destination_fd != -1);
+    struct stat destination_stat;
+    assert(fstat(destination_fd, &destination_stat) == 0);
+    assert(delta_copy_file(source_fd, destination_fd, destination_path, 0644, result) == 0);
+    assert(close(destination_fd) == 0 && close(source_fd) == 0);
+    return destination_stat.st_ino;
+}
+
+/*!
+ * @brief get_inode gives the inode of a file
+ * @param path is the path of the file
+ * @return its inode
+ */
+static ino_t get_inode(const char *path) {
+    struct stat file_stat;
+    assert(stat(path, &file_stat) == 0);
+    return file_stat.st_ino;
+}
+
+/*!
+ * @brief test_changed_blocks updates a destination that differs from the source by a few bytes in three places
+ * Only the blocks holding the changes are written, in the destination file itself.
+ */
+static void test_changed_blocks() {
+    uint8_t *content = malloc(FILE_SIZE);
+    assert(content);
+    fill_random(content, FILE_SIZE, 25);
+    write_file(destination_path, content, FILE_SIZE);
+    size_t changes[] = {0, FILE_SIZE / 3, FILE_SIZE - 10};
+    for (size_t i=0; i<sizeof(changes) / sizeof(changes[0]); ++i) {
+        memset(content + changes[i], 0x5a, 8);
+    }
+    write_file(source_path, content, FILE_SIZE);
+
+    delta_result_t result;
+    ino_t inode = run_delta(&result);
+    assert(result.in_place && get_inode(destination_path) == inode);
+    // A change written over two blocks at most, the rest of the file is reused
+    size_t block_size = get_delta_block_size(FILE_SIZE);
+    assert(result.written_bytes > 0 && result.written_bytes <= 3 * 2 * block_size);
+    assert(result.matched_bytes + result.written_bytes == FILE_SIZE);
+    assert_file_content(destination_path, content, FILE_SIZE);
+    free(content);
+}
+
+/*!
+ * @brief test_inserted_bytes updates a destination whose content is shifted in the source by inserted bytes
+ * The blocks are found at other offsets, the destination is rebuilt from them and replaced.
+ */
+static void test_inserted_bytes() {
+    uint8_t *content = malloc(FILE_SIZE + 100);
+    assert(content);
+    fill_random(content + 100, FILE_SIZE, 20);
+    write_file(destination_path, content + 100, FILE_SIZE);
+    fill_random(content, 100, 21);
+    write_file(source_path, content, FILE_SIZE + 100);
+
+    delta_result_t result;
+    run_delta(&result);
+    assert(!result.in_place);
+    assert(result.matched_bytes >= FILE_SIZE - 2 * get_delta_block_size(FILE_SIZE));
+    assert_file_content(destination_path, content, FILE_SIZE + 100);
+    free(content);
+}
+
+int main() {
+    snprintf(root, sizeof(root), "/tmp/test-delta-copy-XXXXXX");
+    assert(mkdtemp(root));
+    snprintf(source_path, sizeof(source_path), "%s/source", root);
+    snprintf(destination_path, sizeof(destination_path), "%s/destination", root);
+
+    test_changed_blocks();
+    test_inserted_bytes();
+
+    unlink(source_path);
+    unlink(destination_path);
+    rmdir(root);
+    printf("test-delta-copy: OK\n");
+    return 0;
+}
@@ -0,0 +1,177 @@
+#include <sync.h>
+#include <configuration.h>
+#include <processes.h>
+#include <digest-cache.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static char root[64];
+static char source_dir[128];
+static char destination_dir[128];
+
+/*!
+ * @brief write_file writes a small file and gives it a fixed mtime
+ * @param path is the path of the file
+ * @param content is the content of the file
+ * @param mtime is the modification time, in seconds
+ */
+static void write_file(const char *path, const char *content, time_t mtime) {
+    FILE *file = fopen(path, "w");
+    assert(file);
+    fputs(content, file);
+    fclose(file);
+    struct timespec times[2] = {{mtime, 0}, {mtime, 0}};
+    assert(utimensat(AT_FDCWD, path, times, 0) == 0);
+}
+
+/*!
+ * @brief read_file reads a small file
+ * @param path is the path of the file
+ * @param content receives the content of the file, it must hold 64 bytes
+ */
+static void read_file(const char *path, char *content) {
+    FILE *file = fopen(path, "r");
+    assert(file);
+    size_t length = fread(content, 1, 63, file);
+    content[length] = '\0';
+    fclose(file);
+}
+
+/*!
+ * @brief get_change_time gives the ctime of a file, which any write of its content updates
+ * @param path is the path of the file
+ * @return the ctime
+ */
+static struct timespec get_change_time(const char *path) {
+    struct stat file_stat;
+    assert(stat(path, &file_stat) == 0);
+    return file_stat.st_ctim;
+}
+
+/*!
+ * @brief run_sync runs a sequential synchronization of the test directories, as main does
+ */
+static void run_sync() {
+    char *argv[] = {"lp25-backup", "--no-parallel", source_dir, destination_dir, NULL};
+    configuration_t the_config;
+    process_context_t p_context;
+    init_configuration(&the_config);
+    optind = 0;
+    assert(set_configuration(&the_config, 4, argv) == 0);
+    assert(prepare(&the_config, &p_context) == 0);
+    assert(synchronize(&the_config, &p_context) == 0);
+    clean_processes(&the_config, &p_context);
+    clear_digest_cache();
+}
+
+/*!
+ * @brief test_copied_file_is_not_copied_again synchronizes twice a file whose copy keeps its size and mtime
+ * The first run replaces the content of the destination file in place, the digest it had before must not be
+ * cached for it, or the second run would find it different from the source again.
+ */
+static void test_copied_file_is_not_copied_again() {
+    char source_file[256], destination_file[256], content[64];
+    snprintf(source_file, sizeof(source_file), "%s/f", source_dir);
+    snprintf(destination_file, sizeof(destination_file), "%s/f", destination_dir);
+    write_file(source_file, "aaaa", 1577836800);
+    write_file(destination_file, "bbbb", 1577836800);
+
+    run_sync();
+    read_file(destination_file, content);
+    assert(strcmp(content, "aaaa") == 0);
+    struct timespec copied_time = get_change_time(destination_file);
+
+    // A second copy would update the ctime of the destination file
+    struct timespec delay = {0, 20000000};
+    nanosleep(&delay, NULL);
+    run_sync();
+    struct timespec unchanged_time = get_change_time(destination_file);
+    assert(copied_time.tv_sec == unchanged_time.tv_sec && copied_time.tv_nsec == unchanged_time.tv_nsec);
+
+    // A source file modified since the cache was written is hashed and copied again
+    write_file(source_file, "cccc", 1577836801);
+    run_sync();
+    read_file(destination_file, content);
+    assert(strcmp(content, "cccc") == 0);
+
+    unlink(source_file);
+    unlink(destination_file);
+}
+
+/*!
+ * @brief test_cache_hit_and_miss saves the digest of an entry, then looks it up for the same file and for changed ones
+ * A digest is only given back for the same file, unchanged since it was cached, with the same algorithm.
+ */
+static void test_cache_hit_and_miss() {
+    char cache_path[256];
+    snprintf(cache_path, sizeof(cache_path), "%s/cache", root);
+    files_list_t list;
+    init_files_list(&list);
+    files_list_entry_t *entry = add_file_entry(&list, "/cached/file");
+    assert(entry);
+    entry->entry_type = FICHIER;
+    entry->device = 8;
+    entry->inode = 1234;
+    entry->size = 4096;
+    entry->mtime.tv_sec = 1577836800;
+    entry->mtime.tv_nsec = 500;
+    entry->digest_algorithm = DIGEST_MD5;
+    memset(entry->digest, 0xab, sizeof(entry->digest));
+    assert(save_digest_cache(cache_path, &list, NULL) == 0);
+    assert(load_digest_cache(cache_path) == 0);
+
+    files_list_entry_t lookup = *entry;
+    lookup.digest_algorithm = DIGEST_NONE;
+    memset(lookup.digest, 0, sizeof(lookup.digest));
+    assert(find_cached_digest(&lookup, DIGEST_MD5));
+    assert(lookup.digest_algorithm == DIGEST_MD5 && memcmp(lookup.digest, entry->digest, sizeof(entry->digest)) == 0);
+
+    // Another algorithm, or a change of the size or mtime, invalidates the record
+    assert(!find_cached_digest(&lookup, DIGEST_XXH64));
+    lookup.size = 4097;
+    assert(!find_cached_digest(&lookup, DIGEST_MD5));
+    lookup.size = entry->size;
+    lookup.mtime.tv_nsec = 501;
+    assert(!find_cached_digest(&lookup, DIGEST_MD5));
+    lookup.mtime = entry->mtime;
+    lookup.inode = 1235;
+    assert(!find_cached_digest(&lookup, DIGEST_MD5));
+
+    // Entries without a digest are not saved
+    entry->digest_algorithm = DIGEST_NONE;
+    assert(save_digest_cache(cache_path, &list, NULL) == 0);
+    assert(load_digest_cache(cache_path) == 0);
+    lookup.inode = entry->inode;
+    assert(!find_cached_digest(&lookup, DIGEST_MD5));
+
+    clear_digest_cache();
+    clear_files_list(&list);
+    unlink(cache_path);
+}
+
+int main() {
+    snprintf(root, sizeof(root), "/tmp/test-digest-cache-XXXXXX");
+    assert(mkdtemp(root));
+    snprintf(source_dir, sizeof(source_dir), "%s/src", root);
+    snprintf(destination_dir, sizeof(destination_dir), "%s/dst", root);
+    assert(mkdir(source_dir, 0755) == 0 && mkdir(destination_dir, 0755) == 0);
+
+    test_cache_hit_and_miss();
+    test_copied_file_is_not_copied_again();
+
+    char cache_file[256];
+    snprintf(cache_file, sizeof(cache_file), "%s/%s", destination_dir, DIGEST_CACHE_FILE_NAME);
+    unlink(cache_file);
+    rmdir(source_dir);
+    rmdir(destination_dir);
+    rmdir(root);
+    printf("test-digest-cache: OK\n");
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include <copy-engine.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SPARSE_FILE_SIZE (64 * 1024 * 1024)
+#define DATA_SIZE 4096
+
+static char root[64];
+
+/*!
+ * @brief write_data writes a block of a given byte in a file
+ * @param fd is the file, opened for writing
+ * @param offset is the offset of the block
+ * @param byte is the value of the bytes of the block
+ */
+static void write_data(int fd, off_t offset, char byte) {
+    char data[DATA_SIZE];
+    memset(data, byte, sizeof(data));
+    assert(pwrite(fd, data, sizeof(data), offset) == sizeof(data));
+}
+
+/*!
+ * @brief assert_same_content checks that two files have the same size and content, like cmp
+ * @param first_path is the path of the first file
+ * @param second_path is the path of the second file
+ */
+static void assert_same_content(const char *first_path, const char *second_path) {
+    static char first_buffer[1024 * 1024], second_buffer[1024 * 1024];
+    FILE *first = fopen(first_path, "r");
+    FILE *second = fopen(second_path, "r");
+    assert(first && second);
+    size_t first_length, second_length;
+    do {
+        first_length = fread(first_buffer, 1, sizeof(first_buffer), first);
+        second_length = fread(second_buffer, 1, sizeof(second_buffer), second);
+        assert(first_length == second_length && memcmp(first_buffer, second_buffer, first_length) == 0);
+    } while (first_length > 0);
+    fclose(first);
+    fclose(second);
+}
+
+/*!
+ * @brief copy_and_check copies a sparse file with the copy engine, then checks its holes and content
+ * @param source_path is the path of the source, which holds data_blocks blocks of DATA_SIZE bytes
+ * @param data_blocks is the number of data blocks of the source
+ */
+static void copy_and_check(const char *source_path, int data_blocks) {
+    char destination_path[128];
+    snprintf(destination_path, sizeof(destination_path), "%s/destination", root);
+    int source_fd = open(source_path, O_RDONLY);
+    int destination_fd = open(destination_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(source_fd != -1 && destination_fd != -1);
+    uint64_t copied_bytes;
+    copy_strategy_t strategy = copy_file_data(source_fd, destination_fd, SPARSE_FILE_SIZE, &copied_bytes);
+    assert(strategy != COPY_FAILED);
+    assert(close(destination_fd) == 0 && close(source_fd) == 0);
+
+    struct stat source_stat, destination_stat;
+    assert(stat(source_path, &source_stat) == 0 && stat(destination_path, &destination_stat) == 0);
+    assert(destination_stat.st_size == SPARSE_FILE_SIZE);
+    if (strategy != COPY_REFLINK) {
+        // Only the data is copied, and the holes take no blocks in the destination, like du tells
+        assert(copied_bytes == (uint64_t)data_blocks * DATA_SIZE);
+        assert(destination_stat.st_blocks <= source_stat.st_blocks);
+    }
+    assert_same_content(source_path, destination_path);
+    unlink(destination_path);
+}
+
+/*!
+ * @brief test_data_between_holes copies a file with data at its start, in its middle and at its end
+ */
+static void test_data_between_holes() {
+    char source_path[128];
+    snprintf(source_path, sizeof(source_path), "%s/between-holes", root);
+    int fd = open(source_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1);
+    assert(ftruncate(fd, SPARSE_FILE_SIZE) == 0);
+    write_data(fd, 0, 'a');
+    write_data(fd, SPARSE_FILE_SIZE / 2, 'b');
+    write_data(fd, SPARSE_FILE_SIZE - DATA_SIZE, 'c');
+    assert(close(fd) == 0);
+    copy_and_check(source_path, 3);
+    unlink(source_path);
+}
+
+/*!
+ * @brief test_trailing_hole copies a file ending with a hole, which must keep the size of the source
+ */
+static void test_trailing_hole() {
+    char source_path[128];
+    snprintf(source_path, sizeof(source_path), "%s/trailing-hole", root);
+    int fd = open(source_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1);
+    write_data(fd, 1024 * 1024, 'd');
+    assert(ftruncate(fd, SPARSE_FILE_SIZE) == 0);
+    assert(close(fd) == 0);
+    copy_and_check(source_path, 1);
+    unlink(source_path);
+}
+
+int main() {
+    snprintf(root, sizeof(root), "/tmp/test-sparse-copy-XXXXXX");
+    assert(mkdtemp(root));
+
+    test_data_between_holes();
+    test_trailing_hole();
+
+    rmdir(root);
+    printf("test-sparse-copy: OK\n");
+    return 0;
+}
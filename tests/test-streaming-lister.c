@@ -0,0 +1,54 @@
+#include <processes.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*!
+ * @brief find_colliding_paths builds two paths that land in the same bucket of a lister
+ * @param lister is a pointer to the lister
+ * @param first receives the first path
+ * @param second receives the second path
+ */
+static void find_colliding_paths(streaming_lister_t *lister, char *first, char *second) {
+    strcpy(first, "dir/file-0");
+    uint64_t bucket = hash_relative_path(first, strlen(first)) & lister->buckets_mask;
+    for (int i=1; ; ++i) {
+        sprintf(second, "dir/file-%d", i);
+        if ((hash_relative_path(second, strlen(second)) & lister->buckets_mask) == bucket) {
+            return;
+        }
+    }
+}
+
+/*!
+ * @brief test_unlink_older_colliding_file answers the older of two files in the same bucket first
+ * The newer file is the head of the bucket, it must still be found once the older one is unlinked.
+ */
+static void test_unlink_older_colliding_file() {
+    // Large batches, so that list_file never sends anything to the analyzers
+    lister_configuration_t cfg = {.my_recipient_id = MSG_TYPE_TO_SOURCE_LISTER, .analyzers_count = 1, .batch_size = 4};
+    streaming_lister_t lister;
+    assert(init_streaming_lister(&lister, &cfg) == 0);
+    char older[PATH_SIZE], newer[PATH_SIZE];
+    find_colliding_paths(&lister, older, newer);
+    assert(list_file(older, &lister) == 0);
+    assert(list_file(newer, &lister) == 0);
+    assert(lister.requested_count == 0);
+
+    assert(unlink_listed_file(&lister, older) == 0);
+    assert(unlink_listed_file(&lister, older) == -1);
+    assert(unlink_listed_file(&lister, newer) == 1);
+    assert(unlink_listed_file(&lister, newer) == -1);
+
+    free(lister.files[0].entry.path_and_name);
+    free(lister.files[1].entry.path_and_name);
+    free(lister.files);
+    free(lister.buckets);
+}
+
+int main() {
+    test_unlink_older_colliding_file();
+    printf("test-streaming-lister: OK\n");
+    return 0;
+}
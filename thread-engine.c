@@ -0,0 +1,405 @@
+#include <thread-engine.h>
+#include <sync.h>
+#include <file-properties.h>
+#include <tree-walker.h>
+#include <multi-buffer-md5.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+// Functions in this file implement the threaded execution engine: listers and analyzers are threads of the
+// main process. They share the files lists directly, so entries are never serialized nor copied.
+
+/*!
+ * @brief make_files_lists_threaded builds both (src and dest) files lists with threads
+ * One lister thread per side lists its directory, then pushes its entries to a work stealing queue.
+ * processes_count analyzer threads per side get the stats of the entries in place. All analyzers serve
+ * both sides, so a side with fewer files does not leave threads idle.
+ * @param src_list is a pointer to the source list to build
+ * @param dst_list is a pointer to the destination list to build
+ * @param the_config is a pointer to the program configuration
+ * @return 0 in case of success, -1 when a list misses files
+ */
+int make_files_lists_threaded(files_list_t *src_list, files_list_t *dst_list, configuration_t *the_config) {
+    int analyzers_count = 2 * (the_config->processes_count > 0 ? the_config->processes_count : 1);
+    threaded_context_t context;
+    if (init_work_queue(&context.queue, analyzers_count) == -1) {
+        printf("Cannot create the work queue, listing sequentially \n");
+        int src_result = make_files_list(src_list, the_config->source, the_config->walkers_count);
+        int dst_result = make_files_list(dst_list, the_config->destination, the_config->walkers_count);
+        return (src_result == -1 || dst_result == -1) ? -1 : 0;
+    }
+    pthread_mutex_init(&context.lock, NULL);
+    context.running_listers = 2;
+
+    pthread_t *analyzers = malloc(analyzers_count * sizeof(pthread_t));
+    analyzer_thread_parameters_t *analyzers_parameters = malloc(analyzers_count * sizeof(analyzer_thread_parameters_t));
+    int started_analyzers = 0;
+    if (analyzers && analyzers_parameters) {
+        for (int i=0; i<analyzers_count; ++i) {
+            analyzers_parameters[i].context = &context;
+            analyzers_parameters[i].worker = i;
+            if (pthread_create(&analyzers[i], NULL, analyzer_thread_loop, &analyzers_parameters[i]) != 0) {
+                break;
+            }
+            ++started_analyzers;
+        }
+    }
+
+    lister_thread_parameters_t listers_parameters[2] = {
+            {&context, src_list, the_config->source, 0, analyzers_count / 2, the_config->walkers_count, 0},
+            {&context, dst_list, the_config->destination, analyzers_count / 2, analyzers_count / 2, the_config->walkers_count, 0},
+    };
+    pthread_t listers[2];
+    bool started_listers[2];
+    for (int i=0; i<2; ++i) {
+        started_listers[i] = (pthread_create(&listers[i], NULL, lister_thread_loop, &listers_parameters[i]) == 0);
+        if (!started_listers[i]) {
+            // The lister runs in this thread instead
+            lister_thread_loop(&listers_parameters[i]);
+        }
+    }
+    for (int i=0; i<2; ++i) {
+        if (started_listers[i]) {
+            pthread_join(listers[i], NULL);
+        }
+    }
+    if (started_analyzers == 0) {
+        // No analyzer thread could be started: the queue is closed, drain it here
+        analyzer_thread_parameters_t self = {&context, 0};
+        analyzer_thread_loop(&self);
+    }
+    for (int i=0; i<started_analyzers; ++i) {
+        pthread_join(analyzers[i], NULL);
+    }
+    free(analyzers);
+    free(analyzers_parameters);
+    destroy_work_queue(&context.queue);
+    pthread_mutex_destroy(&context.lock);
+    return (listers_parameters[0].result == -1 || listers_parameters[1].result == -1) ? -1 : 0;
+}
+
+/*!
+ * @brief lister_thread_loop is the lister thread function
+ * @param parameters is a pointer to its parameters, to be cast to a lister_thread_parameters_t
+ * @return NULL
+ */
+void *lister_thread_loop(void *parameters) {
+    lister_thread_parameters_t *lister = (lister_thread_parameters_t *) parameters;
+    // The entries listed before a failure are still analyzed, the caller drops the lists
+    lister->result = walk_directory_tree(lister->list, lister->target, false, lister->walkers_count);
+    int next_deque = 0;
+    for (files_list_entry_t *cursor=lister->list->head; cursor != NULL; cursor=cursor->next) {
+        if (push_work(&lister->context->queue, lister->first_deque + next_deque, cursor) == -1) {
+            // Out of memory for the queue: analyze the entry here
+            get_file_stats(cursor);
+        }
+        next_deque = (next_deque + 1) % lister->deques_count;
+    }
+    pthread_mutex_lock(&lister->context->lock);
+    if (--lister->context->running_listers == 0) {
+        close_work_queue(&lister->context->queue);
+    }
+    pthread_mutex_unlock(&lister->context->lock);
+    return NULL;
+}
+
+/*!
+ * @brief analyzer_thread_loop is the analyzer thread function, it analyzes entries until the queue is closed
+ * @param parameters is a pointer to its parameters, to be cast to an analyzer_thread_parameters_t
+ * @return NULL
+ */
+void *analyzer_thread_loop(void *parameters) {
+    analyzer_thread_parameters_t *analyzer = (analyzer_thread_parameters_t *) parameters;
+    files_list_entry_t *entry;
+    while ((entry = pop_work(&analyzer->context->queue, analyzer->worker)) != NULL) {
+        get_file_stats(entry);
+    }
+    return NULL;
+}
+
+/*!
+ * @brief hash_entries_threaded computes the digests of requested entries with threads
+ * Threads take the entries one after the other from a shared counter, so large files do not hold back the
+ * others. The chunks of the large files are shared the same way, before the other entries, so that the
+ * largest file is hashed by all the threads. The calling thread hashes too.
+ * @param requests is an array of requests (e.g. one per side)
+ * @param requests_count is the number of requests
+ * @param threads_count is the number of threads hashing entries
+ * @param buffer_size is the size of the reads of each thread
+ * @param direct_io is true to read files with O_DIRECT
+ */
+void hash_entries_threaded(digest_requests_t *requests, int requests_count, int threads_count, size_t buffer_size, bool direct_io) {
+    hashing_context_t context;
+    context.requests = requests;
+    context.requests_count = requests_count;
+    atomic_init(&context.next, 0);
+    context.buffer_size = buffer_size;
+    context.direct_io = direct_io;
+    context.chunked_files = NULL;
+    context.chunked_count = 0;
+    atomic_init(&context.next_chunk, 0);
+    // The threads take the large files from chunked_files, and the others from copies of the requests
+    size_t large_files_count = 0;
+    for (int request=0; request<requests_count; ++request) {
+        for (size_t i=0; i<requests[request].count; ++i) {
+            large_files_count += (get_chunks_count(requests[request].entries[i]->size) > 1) ? 1 : 0;
+        }
+    }
+    digest_requests_t *other_requests = (large_files_count > 0) ? calloc(requests_count, sizeof(digest_requests_t)) : NULL;
+    chunked_file_t *chunked_files = (other_requests) ? malloc(large_files_count * sizeof(chunked_file_t)) : NULL;
+    bool has_copies = chunked_files != NULL;
+    for (int request=0; has_copies && request<requests_count; ++request) {
+        other_requests[request] = requests[request];
+        other_requests[request].count = 0;
+        other_requests[request].entries = malloc(requests[request].count * sizeof(files_list_entry_t *));
+        has_copies = other_requests[request].entries != NULL;
+    }
+    if (has_copies) {
+        for (int request=0; request<requests_count; ++request) {
+            for (size_t i=0; i<requests[request].count; ++i) {
+                files_list_entry_t *entry = requests[request].entries[i];
+                if (get_chunks_count(entry->size) > 1 && init_chunked_file(&chunked_files[context.chunked_count], entry, requests[request].algorithm) == 0) {
+                    ++context.chunked_count;
+                } else {
+                    other_requests[request].entries[other_requests[request].count++] = entry;
+                }
+            }
+        }
+        context.requests = other_requests;
+        context.chunked_files = chunked_files;
+    } else if (other_requests) {
+        // Without memory for the copies, each large file is hashed whole by one thread
+        for (int request=0; request<requests_count; ++request) {
+            free(other_requests[request].entries);
+        }
+        free(other_requests);
+        free(chunked_files);
+        other_requests = NULL;
+    }
+    pthread_t *threads = (threads_count > 1) ? malloc((threads_count - 1) * sizeof(pthread_t)) : NULL;
+    int started_threads = 0;
+    for (int i=0; threads && i<threads_count - 1; ++i) {
+        if (pthread_create(&threads[i], NULL, hashing_thread_loop, &context) != 0) {
+            break;
+        }
+        ++started_threads;
+    }
+    hashing_thread_loop(&context);
+    for (int i=0; i<started_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    for (size_t i=0; i<context.chunked_count; ++i) {
+        finish_chunked_file(&context.chunked_files[i]);
+    }
+    free(context.chunked_files);
+    for (int request=0; other_requests && request<requests_count; ++request) {
+        free(other_requests[request].entries);
+    }
+    free(other_requests);
+}
+
+/*!
+ * @brief hashing_thread_loop is the hashing thread function, it hashes entries until all are taken
+ * Each thread keeps its own reader for all the entries it takes.
+ * @param parameters is a pointer to the hashing context, to be cast to a hashing_context_t
+ * @return NULL
+ */
+void *hashing_thread_loop(void *parameters) {
+    hashing_context_t *context = (hashing_context_t *) parameters;
+    hashing_reader_t reader;
+    digest_algorithm_t reader_algorithm = (context->requests_count > 0) ? context->requests[0].algorithm : DIGEST_NONE;
+    if (init_hashing_reader(&reader, reader_algorithm, context->buffer_size, context->direct_io) == -1) {
+        reader_algorithm = DIGEST_NONE;
+    }
+    for (size_t index = atomic_fetch_add(&context->next_chunk, 1); ; index = atomic_fetch_add(&context->next_chunk, 1)) {
+        size_t file = 0;
+        while (file < context->chunked_count && index >= context->chunked_files[file].chunks_count) {
+            index -= context->chunked_files[file].chunks_count;
+            ++file;
+        }
+        if (file == context->chunked_count) {
+            break;
+        }
+        chunked_file_t *chunked_file = &context->chunked_files[file];
+        // Each chunk is taken by a single thread, which alone writes its digest and flag
+        if (chunked_file->algorithm == reader_algorithm && hash_file_chunk(&reader, chunked_file->entry->path_and_name, chunked_file->entry->size, index,
+                                                                           chunked_file->chunk_digests + index * get_digest_size(reader_algorithm)) == 0) {
+            chunked_file->chunk_hashed[index] = true;
+        }
+    }
+    // MD5 entries are taken by groups, so that the small files among them are hashed together
+    size_t chunk_size = (reader_algorithm == DIGEST_MD5) ? MD5_LANES : 1;
+    while (1) {
+        size_t index = atomic_fetch_add(&context->next, chunk_size);
+        int request = 0;
+        while (request < context->requests_count && index >= context->requests[request].count) {
+            index -= context->requests[request].count;
+            ++request;
+        }
+        if (request == context->requests_count) {
+            if (reader_algorithm != DIGEST_NONE) {
+                free_hashing_reader(&reader);
+            }
+            return NULL;
+        }
+        // The chunk may end in the next requests
+        for (size_t remaining = chunk_size; remaining > 0 && request < context->requests_count; ++request, index = 0) {
+            digest_requests_t *current = &context->requests[request];
+            size_t count = (current->count - index < remaining) ? current->count - index : remaining;
+            if (current->algorithm == reader_algorithm) {
+                hash_files(&reader, current->entries + index, count);
+            } else {
+                for (size_t i=0; i<count; ++i) {
+                    compute_file_digest(current->entries[index + i], current->algorithm);
+                }
+            }
+            remaining -= count;
+        }
+    }
+}
+
+/*!
+ * @brief copy_entries_threaded copies files to the destination with copy_jobs_count threads
+ * Threads take the files one after the other from a shared counter. The calling thread copies too.
+ * @param entries are the entries of the files to copy, whose directories exist in the destination
+ * @param count is the number of entries
+ * @param the_config is a pointer to the program configuration
+ * @param statistics is a pointer to the copy counters to update
+ */
+void copy_entries_threaded(files_list_entry_t **entries, size_t count, configuration_t *the_config, copy_statistics_t *statistics) {
+    copy_context_t context;
+    context.entries = entries;
+    context.count = count;
+    atomic_init(&context.next, 0);
+    context.the_config = the_config;
+    context.statistics = statistics;
+    pthread_mutex_init(&context.lock, NULL);
+    int threads_count = (the_config->copy_jobs_count < count) ? the_config->copy_jobs_count : (int)count;
+    pthread_t *threads = (threads_count > 1) ? malloc((threads_count - 1) * sizeof(pthread_t)) : NULL;
+    int started_threads = 0;
+    for (int i=0; threads && i<threads_count - 1; ++i) {
+        if (pthread_create(&threads[i], NULL, copy_thread_loop, &context) != 0) {
+            break;
+        }
+        ++started_threads;
+    }
+    copy_thread_loop(&context);
+    for (int i=0; i<started_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&context.lock);
+}
+
+/*!
+ * @brief copy_thread_loop is the copy thread function, it copies files until all are taken
+ * @param parameters is a pointer to the copy context, to be cast to a copy_context_t
+ * @return NULL
+ */
+void *copy_thread_loop(void *parameters) {
+    copy_context_t *context = (copy_context_t *) parameters;
+    copy_statistics_t statistics = {{0}, {0}};
+    for (size_t index = atomic_fetch_add(&context->next, 1); index < context->count; index = atomic_fetch_add(&context->next, 1)) {
+        files_list_entry_t *entry = context->entries[index];
+        uint64_t copied_bytes;
+        copy_strategy_t strategy = copy_entry_to_destination(entry, context->the_config, &copied_bytes);
+        add_copy_to_statistics(&statistics, strategy, copied_bytes);
+    }
+    pthread_mutex_lock(&context->lock);
+    for (int strategy=0; strategy<COPY_STRATEGIES_COUNT; ++strategy) {
+        context->statistics->files_count[strategy] += statistics.files_count[strategy];
+        context->statistics->bytes_count[strategy] += statistics.bytes_count[strategy];
+    }
+    pthread_mutex_unlock(&context->lock);
+    return NULL;
+}
+
+/*!
+ * @brief start_copy_pool starts copy_jobs_count threads copying the files submitted to them
+ * @param pool is a pointer to the pool to start
+ * @param the_config is a pointer to the program configuration
+ * @return 0 in case of success, -1 else
+ */
+int start_copy_pool(copy_pool_t *pool, configuration_t *the_config) {
+    pool->the_config = the_config;
+    pool->threads_count = (the_config->copy_jobs_count > 0) ? the_config->copy_jobs_count : 1;
+    pool->next_deque = 0;
+    atomic_init(&pool->next_worker, 0);
+    memset(&pool->statistics, 0, sizeof(pool->statistics));
+    pool->threads = malloc(pool->threads_count * sizeof(pthread_t));
+    if (!pool->threads || init_work_queue(&pool->queue, pool->threads_count) == -1) {
+        free(pool->threads);
+        return -1;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    int started_threads = 0;
+    while (started_threads < pool->threads_count && pthread_create(&pool->threads[started_threads], NULL, copy_worker_loop, pool) == 0) {
+        ++started_threads;
+    }
+    if (started_threads == 0) {
+        destroy_work_queue(&pool->queue);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->threads);
+        return -1;
+    }
+    // Deques of threads that could not start are emptied by the others
+    pool->threads_count = started_threads;
+    return 0;
+}
+
+/*!
+ * @brief submit_copy gives a file to copy to the pool, its directory must exist
+ * @param pool is a pointer to the pool
+ * @param entry is a pointer to the entry of the file, which must stay valid until finish_copy_pool
+ * @return 0 in case of success, -1 else
+ */
+int submit_copy(copy_pool_t *pool, files_list_entry_t *entry) {
+    int deque = pool->next_deque;
+    pool->next_deque = (pool->next_deque + 1) % pool->queue.workers_count;
+    return push_work(&pool->queue, deque, entry);
+}
+
+/*!
+ * @brief finish_copy_pool waits for the submitted copies, then stops the threads of the pool
+ * @param pool is a pointer to the pool
+ * @param statistics is a pointer to the copy counters to update
+ */
+void finish_copy_pool(copy_pool_t *pool, copy_statistics_t *statistics) {
+    close_work_queue(&pool->queue);
+    for (int i=0; i<pool->threads_count; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    for (int strategy=0; strategy<COPY_STRATEGIES_COUNT; ++strategy) {
+        statistics->files_count[strategy] += pool->statistics.files_count[strategy];
+        statistics->bytes_count[strategy] += pool->statistics.bytes_count[strategy];
+    }
+    destroy_work_queue(&pool->queue);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+}
+
+/*!
+ * @brief copy_worker_loop is the function of the threads of a copy pool, it copies files until the pool is finished
+ * @param parameters is a pointer to the pool, to be cast to a copy_pool_t
+ * @return NULL
+ */
+void *copy_worker_loop(void *parameters) {
+    copy_pool_t *pool = (copy_pool_t *) parameters;
+    int worker = atomic_fetch_add(&pool->next_worker, 1);
+    copy_statistics_t statistics = {{0}, {0}};
+    files_list_entry_t *entry;
+    while ((entry = pop_work(&pool->queue, worker)) != NULL) {
+        uint64_t copied_bytes;
+        copy_strategy_t strategy = copy_entry_to_destination(entry, pool->the_config, &copied_bytes);
+        add_copy_to_statistics(&statistics, strategy, copied_bytes);
+    }
+    pthread_mutex_lock(&pool->lock);
+    for (int strategy=0; strategy<COPY_STRATEGIES_COUNT; ++strategy) {
+        pool->statistics.files_count[strategy] += statistics.files_count[strategy];
+        pool->statistics.bytes_count[strategy] += statistics.bytes_count[strategy];
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <files-list.h>
+#include <configuration.h>
+#include <work-queue.h>
+#include <file-properties.h>
+#include <copy-engine.h>
+#include <stdatomic.h>
+
+typedef struct {
+    work_queue_t queue; // Entries waiting for analysis, shared by the analyzers of both sides
+    pthread_mutex_t lock;
+    int running_listers; // The queue is closed when the last lister is done
+} threaded_context_t;
+
+typedef struct {
+    threaded_context_t *context;
+    files_list_t *list; // List built by the lister and analyzed in place
+    char *target; // Directory to list
+    int first_deque; // Entries are spread over the deques of this side's analyzers
+    int deques_count;
+    uint8_t walkers_count; // Number of threads listing the directory
+    int result; // -1 when the list misses files
+} lister_thread_parameters_t;
+
+typedef struct {
+    threaded_context_t *context;
+    int worker; // Index of the analyzer's own deque
+} analyzer_thread_parameters_t;
+
+typedef struct {
+    digest_requests_t *requests;
+    int requests_count;
+    atomic_size_t next; // Index of the next entry to hash, over all the requests
+    chunked_file_t *chunked_files; // Large files, whose chunks are taken before the entries
+    size_t chunked_count;
+    atomic_size_t next_chunk; // Index of the next chunk to hash, over all the chunked files
+    size_t buffer_size; // Size of the buffer of each thread's reader
+    bool direct_io;
+} hashing_context_t;
+
+typedef struct {
+    files_list_entry_t **entries; // Files to copy, their directories already exist
+    size_t count;
+    atomic_size_t next; // Index of the next file to copy
+    configuration_t *the_config;
+    pthread_mutex_t lock; // Protects statistics
+    copy_statistics_t *statistics;
+} copy_context_t;
+
+typedef struct {
+    work_queue_t queue; // Files to copy, pushed while they are found
+    configuration_t *the_config;
+    pthread_t *threads;
+    int threads_count;
+    int next_deque; // Deque of the next file, so that copies are spread over the threads
+    atomic_int next_worker; // Each thread takes its deque index from it when it starts
+    pthread_mutex_t lock; // Protects statistics
+    copy_statistics_t statistics;
+} copy_pool_t;
+
+int make_files_lists_threaded(files_list_t *src_list, files_list_t *dst_list, configuration_t *the_config);
+void *lister_thread_loop(void *parameters);
+void *analyzer_thread_loop(void *parameters);
+void hash_entries_threaded(digest_requests_t *requests, int requests_count, int threads_count, size_t buffer_size, bool direct_io);
+void *hashing_thread_loop(void *parameters);
+void copy_entries_threaded(files_list_entry_t **entries, size_t count, configuration_t *the_config, copy_statistics_t *statistics);
+void *copy_thread_loop(void *parameters);
+int start_copy_pool(copy_pool_t *pool, configuration_t *the_config);
+int submit_copy(copy_pool_t *pool, files_list_entry_t *entry);
+void finish_copy_pool(copy_pool_t *pool, copy_statistics_t *statistics);
+void *copy_worker_loop(void *parameters);
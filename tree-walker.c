@@ -0,0 +1,550 @@
+#include <tree-walker.h>
+#include <file-properties.h>
+#include <work-queue.h>
+#include <defines.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// Functions in this file list directory trees. Directories are read with getdents64 through their file
+// descriptor, and their children are reached with openat and fstatat, so the kernel never resolves full paths.
+// Children are sorted per directory, so a depth first walk produces the list order (@see compare_paths).
+// Several walker threads may share the directories of a tree through a work stealing queue: each directory
+// then becomes a node holding its files and subdirectories in order, and the nodes are concatenated in depth
+// first order once the walk is over.
+
+#define WALK_BATCH_SIZE (64 * 1024)
+
+// Record returned by getdents64, the libc does not always provide it
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} walk_dirent64_t;
+
+typedef struct {
+    const char *name;
+    size_t name_offset; // Offset of the name in the names buffer while it may move
+    unsigned char type; // d_type of the entry, DT_UNKNOWN when the filesystem does not provide it
+} walk_child_t;
+
+typedef struct _walk_node walk_node_t;
+
+typedef struct {
+    files_list_entry_t *entry; // File of the directory, NULL for a subdirectory
+    walk_node_t *subdirectory;
+} walk_item_t;
+
+struct _walk_node {
+    char *path;
+    int fd; // Opened by the walker that found the directory, -1 to open it by path
+    walk_item_t *items; // Files and subdirectories, in list order
+    size_t items_count;
+};
+
+typedef struct {
+    work_queue_t queue; // Directories waiting to be read
+    atomic_size_t pending_directories; // Queued or being read, the queue is closed when it drops to 0
+    atomic_int queued_fds;
+    atomic_bool failed; // A directory could not be read, the list is incomplete
+} parallel_walk_t;
+
+typedef struct {
+    files_list_t *list; // List receiving the entries (a private list for walker threads, only its arenas are used)
+    walk_callback_t callback; // Called for each file instead of adding it to list, for a streaming walk
+    void *callback_parameters;
+    bool with_stats;
+    parallel_walk_t *walk; // NULL for a sequential walk
+    int worker; // Index of the walker's deque in the walk queue
+    pthread_t thread;
+    char path[PATH_SIZE]; // Path of the directory being walked, extended in place for its children
+    uint8_t batch[WALK_BATCH_SIZE]; // getdents64 buffer, each directory is read entirely before its children
+} tree_walker_t;
+
+typedef struct {
+    bool is_set;
+    dev_t device; // Directory holding the excluded files
+    ino_t inode;
+    char name[PATH_SIZE];
+    char temporary_name[PATH_SIZE]; // Written next to the file before it is renamed
+} walk_exclusion_t;
+
+// The digest cache is not part of the backup, wherever it is stored
+static walk_exclusion_t excluded_files = {.is_set = false};
+
+static int compare_walk_children(const void *lhd, const void *rhd) {
+    return compare_paths(((const walk_child_t *)lhd)->name, ((const walk_child_t *)rhd)->name);
+}
+
+/*!
+ * @brief is_excluded_file tells if a directory entry is the excluded file or its temporary file
+ * Names are compared first, so the directory is only checked with fstat for an entry with the same name.
+ * @param dir_fd is the file descriptor of the directory
+ * @param name is the name of the entry
+ * @return true if the entry must not be listed
+ */
+static bool is_excluded_file(int dir_fd, const char *name) {
+    if (!excluded_files.is_set || (strcmp(name, excluded_files.name) != 0 && strcmp(name, excluded_files.temporary_name) != 0)) {
+        return false;
+    }
+    struct stat directory;
+    return fstat(dir_fd, &directory) == 0 && directory.st_dev == excluded_files.device && directory.st_ino == excluded_files.inode;
+}
+
+/*!
+ * @brief read_directory_children reads all the relevant entries of an opened directory
+ * Entries are read with getdents64 in large batches, and sorted with compare_paths so that a depth first walk
+ * produces the list order.
+ * @param walker is a pointer to the walker, whose batch buffer is used
+ * @param dir_fd is the file descriptor of the directory
+ * @param children is a pointer to the children array, allocated by the function (to be freed by the caller)
+ * @param names is a pointer to the buffer of names of the children, allocated by the function (to be freed by the caller)
+ * @return the number of children, -1 when the directory cannot be read entirely (nothing is allocated then)
+ */
+static ssize_t read_directory_children(tree_walker_t *walker, int dir_fd, walk_child_t **children, char **names) {
+    size_t count = 0, children_capacity = 0, names_length = 0, names_capacity = 0;
+    *children = NULL;
+    *names = NULL;
+    while (1) {
+        long read_bytes = syscall(SYS_getdents64, dir_fd, walker->batch, sizeof(walker->batch));
+        if (read_bytes < 0) {
+            // A partial directory would be taken for the whole directory
+            perror(strerror(errno));
+            free(*children);
+            free(*names);
+            *children = NULL;
+            *names = NULL;
+            return -1;
+        }
+        if (read_bytes == 0) {
+            break;
+        }
+        for (long offset = 0; offset < read_bytes; ) {
+            walk_dirent64_t *dent = (walk_dirent64_t *)(walker->batch + offset);
+            offset += dent->d_reclen;
+            if (dent->d_type != DT_REG && dent->d_type != DT_DIR && dent->d_type != DT_UNKNOWN) {
+                continue;
+            }
+            if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0) {
+                continue;
+            }
+            if (is_excluded_file(dir_fd, dent->d_name)) {
+                continue;
+            }
+            size_t name_length = strlen(dent->d_name) + 1;
+            if (count == children_capacity) {
+                children_capacity = children_capacity ? 2 * children_capacity : 64;
+                walk_child_t *new_children = realloc(*children, children_capacity * sizeof(walk_child_t));
+                if (!new_children) {
+                    free(*children);
+                    free(*names);
+                    *children = NULL;
+                    *names = NULL;
+                    return -1;
+                }
+                *children = new_children;
+            }
+            if (names_length + name_length > names_capacity) {
+                names_capacity = names_capacity ? 2 * names_capacity : 4096;
+                while (names_length + name_length > names_capacity) {
+                    names_capacity *= 2;
+                }
+                char *new_names = realloc(*names, names_capacity);
+                if (!new_names) {
+                    free(*children);
+                    free(*names);
+                    *children = NULL;
+                    *names = NULL;
+                    return -1;
+                }
+                *names = new_names;
+            }
+            memcpy(*names + names_length, dent->d_name, name_length);
+            (*children)[count].name_offset = names_length;
+            (*children)[count].type = dent->d_type;
+            names_length += name_length;
+            ++count;
+        }
+    }
+    // Names only become stable once the buffer stops growing
+    for (size_t i=0; i<count; ++i) {
+        (*children)[i].name = *names + (*children)[i].name_offset;
+    }
+    qsort(*children, count, sizeof(walk_child_t), compare_walk_children);
+    return (ssize_t)count;
+}
+
+/*!
+ * @brief get_separator_end computes where the names of the children of a directory start in a path
+ * concat_path does not double the separator when the target ends with /
+ * @param path is the path of the directory
+ * @param path_length is the length of path
+ * @return the offset of the names of the children
+ */
+static size_t get_separator_end(char *path, size_t path_length) {
+    return (path_length > 0 && path[path_length - 1] == '/') ? path_length : path_length + 1;
+}
+
+/*!
+ * @brief resolve_child completes the walker's path with a child and finds its type
+ * For regular files, the entry is allocated in the walker's list with its properties when they are requested,
+ * unless the walk is streaming.
+ * @param walker is a pointer to the walker, its path holds the path of the directory
+ * @param dir_fd is the file descriptor of the directory
+ * @param child is a pointer to the child
+ * @param path_length is the length of the path of the directory
+ * @param entry is set to the new entry of a regular file
+ * @return DT_REG or DT_DIR, DT_UNKNOWN when the child must be skipped
+ */
+static unsigned char resolve_child(tree_walker_t *walker, int dir_fd, walk_child_t *child, size_t path_length, files_list_entry_t **entry) {
+    size_t prefix_length = get_separator_end(walker->path, path_length);
+    size_t name_length = strlen(child->name);
+    if (prefix_length + name_length >= PATH_SIZE) {
+        return DT_UNKNOWN;
+    }
+    walker->path[path_length] = '/';
+    memcpy(walker->path + prefix_length, child->name, name_length + 1);
+    struct stat buf;
+    unsigned char type = child->type;
+    if (type == DT_UNKNOWN || (walker->with_stats && type == DT_REG)) {
+        if (fstatat(dir_fd, child->name, &buf, AT_SYMLINK_NOFOLLOW) == -1) {
+            return DT_UNKNOWN;
+        }
+        type = S_ISREG(buf.st_mode) ? DT_REG : (S_ISDIR(buf.st_mode) ? DT_DIR : DT_UNKNOWN);
+    }
+    if (type == DT_REG && !walker->callback) {
+        *entry = new_files_list_entry(walker->list, walker->path);
+        if (!*entry) {
+            return DT_UNKNOWN;
+        }
+        if (walker->with_stats) {
+            set_file_stats(*entry, &buf);
+        }
+    }
+    return type;
+}
+
+/*!
+ * @brief walk_directory adds the files of an opened directory and its subdirectories to the walker's list
+ * @param walker is a pointer to the walker, its path holds the path of the directory
+ * @param dir_fd is the file descriptor of the directory
+ * @param path_length is the length of the path of the directory
+ * @return 0 in case of success, -1 when a directory cannot be read or the callback stopped the walk
+ */
+static int walk_directory(tree_walker_t *walker, int dir_fd, size_t path_length) {
+    walk_child_t *children;
+    char *names;
+    ssize_t count = read_directory_children(walker, dir_fd, &children, &names);
+    int result = (count == -1) ? -1 : 0;
+    for (ssize_t i=0; result == 0 && i<count; ++i) {
+        files_list_entry_t *entry;
+        unsigned char type = resolve_child(walker, dir_fd, &children[i], path_length, &entry);
+        if (type == DT_REG && walker->callback) {
+            result = walker->callback(walker->path, walker->callback_parameters);
+        } else if (type == DT_REG) {
+            add_entry_to_tail(walker->list, entry);
+        } else if (type == DT_DIR) {
+            int child_fd = openat(dir_fd, children[i].name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child_fd == -1) {
+                perror(strerror(errno));
+                result = -1;
+                continue;
+            }
+            result = walk_directory(walker, child_fd, strlen(walker->path));
+            close(child_fd);
+        }
+    }
+    walker->path[path_length] = '\0';
+    free(children);
+    free(names);
+    return result;
+}
+
+/*!
+ * @brief finish_directory accounts for a directory that has been read, and closes the queue after the last one
+ * @param walk is a pointer to the parallel walk
+ */
+static void finish_directory(parallel_walk_t *walk) {
+    if (atomic_fetch_sub(&walk->pending_directories, 1) == 1) {
+        close_work_queue(&walk->queue);
+    }
+}
+
+/*!
+ * @brief walk_node reads the directory of a node: its files become entries, its subdirectories new nodes
+ * that are queued for any walker
+ * @param walker is a pointer to the walker
+ * @param node is a pointer to the node to read
+ */
+static void walk_node(tree_walker_t *walker, walk_node_t *node) {
+    parallel_walk_t *walk = walker->walk;
+    int dir_fd = node->fd;
+    if (dir_fd == -1) {
+        dir_fd = open(node->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    } else {
+        atomic_fetch_sub(&walk->queued_fds, 1);
+    }
+    if (dir_fd == -1) {
+        perror(strerror(errno));
+        atomic_store(&walk->failed, true);
+        finish_directory(walk);
+        return;
+    }
+    walk_child_t *children;
+    char *names;
+    ssize_t count = read_directory_children(walker, dir_fd, &children, &names);
+    node->items = (count > 0) ? malloc(count * sizeof(walk_item_t)) : NULL;
+    if (count == -1 || (count > 0 && !node->items)) {
+        atomic_store(&walk->failed, true);
+    }
+    size_t path_length = strlen(node->path);
+    memcpy(walker->path, node->path, path_length + 1);
+    for (ssize_t i=0; node->items && i<count; ++i) {
+        files_list_entry_t *entry;
+        unsigned char type = resolve_child(walker, dir_fd, &children[i], path_length, &entry);
+        if (type == DT_REG) {
+            node->items[node->items_count].entry = entry;
+            node->items[node->items_count++].subdirectory = NULL;
+        } else if (type == DT_DIR) {
+            walk_node_t *subdirectory = calloc(1, sizeof(walk_node_t));
+            if (!subdirectory || !(subdirectory->path = strdup(walker->path))) {
+                free(subdirectory);
+                atomic_store(&walk->failed, true);
+                continue;
+            }
+            subdirectory->fd = -1;
+            if (atomic_fetch_add(&walk->queued_fds, 1) < WALK_MAX_QUEUED_FDS) {
+                subdirectory->fd = openat(dir_fd, children[i].name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            }
+            if (subdirectory->fd == -1) {
+                atomic_fetch_sub(&walk->queued_fds, 1);
+            }
+            node->items[node->items_count].entry = NULL;
+            node->items[node->items_count++].subdirectory = subdirectory;
+            atomic_fetch_add(&walk->pending_directories, 1);
+            if (push_work(&walk->queue, walker->worker, subdirectory) == -1) {
+                // The queue cannot grow: read the directory now
+                walk_node(walker, subdirectory);
+                memcpy(walker->path, node->path, path_length + 1);
+            }
+        }
+    }
+    close(dir_fd);
+    free(children);
+    free(names);
+    finish_directory(walk);
+}
+
+/*!
+ * @brief walker_thread_loop reads queued directories until the whole tree has been read
+ * @param parameters is a pointer to the walker, to be cast to a tree_walker_t
+ * @return NULL
+ */
+static void *walker_thread_loop(void *parameters) {
+    tree_walker_t *walker = (tree_walker_t *) parameters;
+    walk_node_t *node;
+    while ((node = pop_work(&walker->walk->queue, walker->worker)) != NULL) {
+        walk_node(walker, node);
+    }
+    return NULL;
+}
+
+/*!
+ * @brief link_nodes appends the entries of a node and its subdirectories to a list, in depth first order,
+ * and frees the nodes
+ * @param list is a pointer to the list to build
+ * @param node is a pointer to the node
+ */
+static void link_nodes(files_list_t *list, walk_node_t *node) {
+    for (size_t i=0; i<node->items_count; ++i) {
+        if (node->items[i].entry) {
+            add_entry_to_tail(list, node->items[i].entry);
+        } else {
+            link_nodes(list, node->items[i].subdirectory);
+        }
+    }
+    free(node->items);
+    free(node->path);
+    free(node);
+}
+
+/*!
+ * @brief walk_directory_tree_parallel lists a tree with several walker threads
+ * The calling thread is one of the walkers, so the walk completes even if no thread can be started.
+ * @param list is a pointer to the list that will be built
+ * @param target_fd is the file descriptor of the target dir
+ * @param target is the target dir whose content must be listed
+ * @param with_stats is true to fill the properties of the files (except the digest) during the walk
+ * @param walkers_count is the number of walkers
+ * @return 0 in case of success, -1 when a directory cannot be read
+ */
+static int walk_directory_tree_parallel(files_list_t *list, int target_fd, char *target, bool with_stats, uint8_t walkers_count) {
+    parallel_walk_t walk;
+    tree_walker_t *walkers = malloc(walkers_count * sizeof(tree_walker_t));
+    files_list_t *walkers_lists = malloc(walkers_count * sizeof(files_list_t));
+    walk_node_t *root = calloc(1, sizeof(walk_node_t));
+    if (!walkers || !walkers_lists || !root || !(root->path = strdup(target)) || init_work_queue(&walk.queue, walkers_count) == -1) {
+        free(walkers);
+        free(walkers_lists);
+        if (root) {
+            free(root->path);
+        }
+        free(root);
+        close(target_fd);
+        return -1;
+    }
+    atomic_init(&walk.pending_directories, 1);
+    atomic_init(&walk.queued_fds, 1);
+    atomic_init(&walk.failed, false);
+    root->fd = target_fd;
+    push_work(&walk.queue, 0, root);
+
+    int started_walkers = 0;
+    for (int i=0; i<walkers_count; ++i) {
+        init_files_list(&walkers_lists[i]);
+        walkers[i].list = &walkers_lists[i];
+        walkers[i].callback = NULL;
+        walkers[i].with_stats = with_stats;
+        walkers[i].walk = &walk;
+        walkers[i].worker = i;
+        if (i > 0 && pthread_create(&walkers[i].thread, NULL, walker_thread_loop, &walkers[i]) == 0) {
+            ++started_walkers;
+        }
+    }
+    walker_thread_loop(&walkers[0]);
+    for (int i=1; i<=started_walkers; ++i) {
+        pthread_join(walkers[i].thread, NULL);
+    }
+    destroy_work_queue(&walk.queue);
+
+    // Entries were allocated by each walker in its own list, the final list takes their memory
+    for (int i=0; i<walkers_count; ++i) {
+        adopt_files_list_arenas(list, &walkers_lists[i]);
+    }
+    link_nodes(list, root);
+    free(walkers);
+    free(walkers_lists);
+    return atomic_load(&walk.failed) ? -1 : 0;
+}
+
+/*!
+ * @brief walk_directory_tree lists the files of a directory tree, optionally with their properties
+ * Files are appended in list order (@see compare_paths), so the list is expected to be empty.
+ * @param list is a pointer to the list that will be built
+ * @param target is the target dir whose content must be listed
+ * @param with_stats is true to fill the properties of the files (except the digest) during the walk
+ * @param walkers_count is the number of threads reading directories, 1 for a sequential walk
+ * @return 0 in case of success, -1 when the list misses files because a directory cannot be read
+ */
+int walk_directory_tree(files_list_t *list, char *target, bool with_stats, uint8_t walkers_count) {
+    if (!list || !target) {
+        return -1;
+    }
+    size_t target_length = strlen(target);
+    if (target_length == 0 || target_length >= PATH_SIZE) {
+        return -1;
+    }
+    int target_fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (target_fd == -1) {
+        perror(strerror(errno));
+        return -1;
+    }
+    if (walkers_count > 1) {
+        return walk_directory_tree_parallel(list, target_fd, target, with_stats, walkers_count);
+    }
+    tree_walker_t *walker = malloc(sizeof(tree_walker_t));
+    if (!walker) {
+        close(target_fd);
+        return -1;
+    }
+    walker->list = list;
+    walker->callback = NULL;
+    walker->with_stats = with_stats;
+    walker->walk = NULL;
+    memcpy(walker->path, target, target_length + 1);
+    int result = walk_directory(walker, target_fd, target_length);
+    close(target_fd);
+    free(walker);
+    return result;
+}
+
+/*!
+ * @brief walk_directory_tree_streaming calls a function for each file of a directory tree, as soon as it is found
+ * Files come in list order (@see compare_paths), and the walk keeps no list: only the children of the
+ * directories being walked are in memory.
+ * @param target is the target dir whose content must be listed
+ * @param callback is the function called for each file
+ * @param parameters is passed to callback
+ * @return 0 in case of success, -1 when a directory cannot be read or the callback stopped the walk
+ */
+int walk_directory_tree_streaming(char *target, walk_callback_t callback, void *parameters) {
+    if (!target || !callback) {
+        return -1;
+    }
+    size_t target_length = strlen(target);
+    if (target_length == 0 || target_length >= PATH_SIZE) {
+        return -1;
+    }
+    int target_fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (target_fd == -1) {
+        perror(strerror(errno));
+        return -1;
+    }
+    tree_walker_t *walker = malloc(sizeof(tree_walker_t));
+    if (!walker) {
+        close(target_fd);
+        return -1;
+    }
+    walker->list = NULL;
+    walker->callback = callback;
+    walker->callback_parameters = parameters;
+    walker->with_stats = false;
+    walker->walk = NULL;
+    memcpy(walker->path, target, target_length + 1);
+    int result = walk_directory(walker, target_fd, target_length);
+    close(target_fd);
+    free(walker);
+    return result;
+}
+
+/*!
+ * @brief exclude_from_walks keeps a file and its temporary file (path.tmp) out of the next walks
+ * The file is identified by the device and inode of its directory, so it is only excluded from that directory,
+ * however the walked trees are named. Processes and threads started afterwards inherit the exclusion.
+ * @param path is the path of the file, which may not exist yet. An empty path excludes nothing.
+ */
+void exclude_from_walks(char *path) {
+    excluded_files.is_set = false;
+    char *separator = strrchr(path, '/');
+    char *name = separator ? separator + 1 : path;
+    if (*name == '\0' || strlen(name) + sizeof(".tmp") > PATH_SIZE) {
+        return;
+    }
+    char directory_path[PATH_SIZE];
+    if (!separator) {
+        strcpy(directory_path, ".");
+    } else if (separator == path) {
+        strcpy(directory_path, "/");
+    } else {
+        snprintf(directory_path, sizeof(directory_path), "%.*s", (int)(separator - path), path);
+    }
+    struct stat directory;
+    if (stat(directory_path, &directory) == -1) {
+        return;
+    }
+    excluded_files.device = directory.st_dev;
+    excluded_files.inode = directory.st_ino;
+    strcpy(excluded_files.name, name);
+    snprintf(excluded_files.temporary_name, sizeof(excluded_files.temporary_name), "%s.tmp", name);
+    excluded_files.is_set = true;
+}
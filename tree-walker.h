@@ -0,0 +1,16 @@
+#pragma once
+
+#include <files-list.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Directories waiting in the parallel walk queue keep their descriptor open up to this number, the next
+// ones are opened again by path
+#define WALK_MAX_QUEUED_FDS 256
+
+// Called for each file found by a streaming walk, with its full path. It returns 0, or -1 to stop the walk
+typedef int (*walk_callback_t)(char *path, void *parameters);
+
+int walk_directory_tree(files_list_t *list, char *target, bool with_stats, uint8_t walkers_count);
+int walk_directory_tree_streaming(char *target, walk_callback_t callback, void *parameters);
+void exclude_from_walks(char *path);
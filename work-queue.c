@@ -0,0 +1,184 @@
+#include <work-queue.h>
+#include <stdlib.h>
+#include <sched.h>
+
+#define DEQUE_INITIAL_CAPACITY 256
+
+// Functions in this file implement a work stealing queue shared by worker threads.
+// Each worker has its own deque: it pushes and pops at the bottom (LIFO, cache friendly) and, when its deque
+// is empty, steals from the top of the other workers' deques (FIFO, oldest and largest work first).
+
+/*!
+ * @brief init_work_queue initializes a work queue
+ * @param queue is a pointer to the queue to initialize
+ * @param workers_count is the number of workers, each of them gets a deque
+ * @return 0 in case of success, -1 else
+ */
+int init_work_queue(work_queue_t *queue, int workers_count) {
+    if (!queue || workers_count <= 0) {
+        return -1;
+    }
+    queue->deques = calloc(workers_count, sizeof(work_deque_t));
+    if (!queue->deques) {
+        return -1;
+    }
+    for (int i=0; i<workers_count; ++i) {
+        queue->deques[i].items = malloc(DEQUE_INITIAL_CAPACITY * sizeof(void *));
+        if (!queue->deques[i].items) {
+            for (int j=0; j<i; ++j) {
+                free(queue->deques[j].items);
+                pthread_mutex_destroy(&queue->deques[j].lock);
+            }
+            free(queue->deques);
+            return -1;
+        }
+        queue->deques[i].capacity = DEQUE_INITIAL_CAPACITY;
+        queue->deques[i].top = 0;
+        queue->deques[i].count = 0;
+        pthread_mutex_init(&queue->deques[i].lock, NULL);
+    }
+    queue->workers_count = workers_count;
+    queue->available = 0;
+    queue->closed = false;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    return 0;
+}
+
+/*!
+ * @brief deque_grow doubles the capacity of a deque, its lock must be held
+ * @param deque is a pointer to the deque
+ * @return 0 in case of success, -1 else
+ */
+static int deque_grow(work_deque_t *deque) {
+    size_t new_capacity = deque->capacity * 2;
+    void **new_items = malloc(new_capacity * sizeof(void *));
+    if (!new_items) {
+        return -1;
+    }
+    for (size_t i=0; i<deque->count; ++i) {
+        new_items[i] = deque->items[(deque->top + i) % deque->capacity];
+    }
+    free(deque->items);
+    deque->items = new_items;
+    deque->capacity = new_capacity;
+    deque->top = 0;
+    return 0;
+}
+
+/*!
+ * @brief push_work adds an item at the bottom of a worker's deque and wakes up an idle worker
+ * @param queue is a pointer to the queue
+ * @param worker is the index of the deque to push to (producers that are not workers may use any index)
+ * @param item is the item to add, must not be NULL
+ * @return 0 in case of success, -1 else
+ */
+int push_work(work_queue_t *queue, int worker, void *item) {
+    if (!queue || !item || worker < 0 || worker >= queue->workers_count) {
+        return -1;
+    }
+    work_deque_t *deque = &queue->deques[worker];
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity && deque_grow(deque) == -1) {
+        pthread_mutex_unlock(&deque->lock);
+        return -1;
+    }
+    deque->items[(deque->top + deque->count) % deque->capacity] = item;
+    ++deque->count;
+    pthread_mutex_unlock(&deque->lock);
+
+    pthread_mutex_lock(&queue->lock);
+    ++queue->available;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+/*!
+ * @brief take_work tries to get an item without blocking: from the bottom of the own deque, else stolen
+ * from the top of another deque
+ * @param queue is a pointer to the queue
+ * @param worker is the index of the calling worker
+ * @return an item, NULL if all deques are empty
+ */
+static void *take_work(work_queue_t *queue, int worker) {
+    work_deque_t *own = &queue->deques[worker];
+    void *item = NULL;
+    pthread_mutex_lock(&own->lock);
+    if (own->count > 0) {
+        --own->count;
+        item = own->items[(own->top + own->count) % own->capacity];
+    }
+    pthread_mutex_unlock(&own->lock);
+    for (int i=1; !item && i<queue->workers_count; ++i) {
+        work_deque_t *victim = &queue->deques[(worker + i) % queue->workers_count];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->count > 0) {
+            item = victim->items[victim->top];
+            victim->top = (victim->top + 1) % victim->capacity;
+            --victim->count;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return item;
+}
+
+/*!
+ * @brief pop_work gets the next item for a worker, waiting when no work is available
+ * @param queue is a pointer to the queue
+ * @param worker is the index of the calling worker
+ * @return an item, NULL when the queue is closed and empty
+ */
+void *pop_work(work_queue_t *queue, int worker) {
+    if (!queue || worker < 0 || worker >= queue->workers_count) {
+        return NULL;
+    }
+    // Reserve an item first so that idle workers sleep instead of scanning empty deques
+    pthread_mutex_lock(&queue->lock);
+    while (queue->available == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    if (queue->available == 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return NULL;
+    }
+    --queue->available;
+    pthread_mutex_unlock(&queue->lock);
+    // The reserved item is in one of the deques, it may take another scan if a worker took it meanwhile
+    void *item;
+    while (!(item = take_work(queue, worker))) {
+        sched_yield();
+    }
+    return item;
+}
+
+/*!
+ * @brief close_work_queue tells the workers that no more items will be pushed
+ * Workers get the remaining items, then pop_work returns NULL.
+ * @param queue is a pointer to the queue
+ */
+void close_work_queue(work_queue_t *queue) {
+    if (queue) {
+        pthread_mutex_lock(&queue->lock);
+        queue->closed = true;
+        pthread_cond_broadcast(&queue->not_empty);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+/*!
+ * @brief destroy_work_queue frees a queue, no worker may use it anymore
+ * @param queue is a pointer to the queue
+ */
+void destroy_work_queue(work_queue_t *queue) {
+    if (queue && queue->deques) {
+        for (int i=0; i<queue->workers_count; ++i) {
+            free(queue->deques[i].items);
+            pthread_mutex_destroy(&queue->deques[i].lock);
+        }
+        free(queue->deques);
+        queue->deques = NULL;
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->not_empty);
+    }
+}
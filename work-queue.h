@@ -0,0 +1,28 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    void **items; // Circular buffer, the owner works at the bottom, thieves take from the top
+    size_t capacity;
+    size_t top;
+    size_t count;
+    pthread_mutex_t lock;
+} work_deque_t;
+
+typedef struct {
+    work_deque_t *deques; // One deque per worker
+    int workers_count;
+    size_t available; // Number of queued items, protected by lock
+    bool closed; // Set when producers are done, idle workers then return
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+} work_queue_t;
+
+int init_work_queue(work_queue_t *queue, int workers_count);
+int push_work(work_queue_t *queue, int worker, void *item);
+void *pop_work(work_queue_t *queue, int worker);
+void close_work_queue(work_queue_t *queue);
+void destroy_work_queue(work_queue_t *queue);